@@ -38,6 +38,33 @@ public:
         return true;
     }
 
+    // 0 for an empty box, whose max is below its min, like enclosed_box() of disjoint boxes
+    double surface_area() const {
+        const auto d = _max - _min;
+        if (d.x() < 0 || d.y() < 0 || d.z() < 0) {
+            return 0;
+        }
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    // Like hit, but also narrows [t_min, t_max] to the part of the ray inside the box
+    bool clip(const ray& r, double& t_min, double& t_max) const {
+        for (int i = 0; i < 3; i++) {
+            auto invD = 1.0 / r.direction()[i];
+            auto t0 = (min()[i] - r.origin()[i]) * invD;
+            auto t1 = (max()[i] - r.origin()[i]) * invD;
+            if (invD < 0.0) {
+                std::swap(t0, t1);
+            }
+            t_min = std::max(t_min, t0);
+            t_max = std::min(t_max, t1);
+            if (t_max <= t_min) {
+                return false;
+            }
+        }
+        return true;
+    }
+
 private:
     point3 _min;
     point3 _max;
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+// Samples index i with probability weights[i] / sum(weights) in constant time, with Vose's
+// alias method. All weights zero gives a uniform distribution.
+class alias_table {
+public:
+    alias_table() {}
+
+    alias_table(const std::vector<double>& weights) : bins(weights.size()) {
+        const auto n = weights.size();
+        if (n == 0) {
+            return;
+        }
+        auto sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+        for (size_t i = 0; i < n; i++) {
+            bins[i].pmf = sum > 0 ? weights[i] / sum : 1.0 / n;
+        }
+
+        // Scaled so the average bin holds 1. Every bin is filled up to 1 with a part of one
+        // of the bins that hold too much, its alias.
+        std::vector<double> scaled(n);
+        std::vector<int> under;
+        std::vector<int> over;
+        for (size_t i = 0; i < n; i++) {
+            scaled[i] = bins[i].pmf * n;
+            (scaled[i] < 1 ? under : over).push_back(static_cast<int>(i));
+        }
+        while (!under.empty() && !over.empty()) {
+            auto small = under.back();
+            under.pop_back();
+            auto large = over.back();
+            bins[small].threshold = scaled[small];
+            bins[small].alias = large;
+            scaled[large] -= 1 - scaled[small];
+            if (scaled[large] < 1) {
+                over.pop_back();
+                under.push_back(large);
+            }
+        }
+        // What is left holds 1 up to rounding errors
+        for (auto i : under) {
+            bins[i].threshold = 1;
+        }
+        for (auto i : over) {
+            bins[i].threshold = 1;
+        }
+    }
+
+    // u is uniform in [0, 1)
+    int sample(double u) const {
+        const auto x = u * bins.size();
+        const auto i = std::min(static_cast<size_t>(x), bins.size() - 1);
+        return x - i < bins[i].threshold ? static_cast<int>(i) : bins[i].alias;
+    }
+
+    double pmf(int i) const {
+        return bins[i].pmf;
+    }
+
+    size_t size() const {
+        return bins.size();
+    }
+
+private:
+    struct bin {
+        double pmf = 0;
+        // Part of the bin that belongs to its own index, the rest belongs to alias
+        double threshold = 1;
+        int alias = 0;
+    };
+
+    std::vector<bin> bins;
+};
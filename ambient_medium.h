@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+
+#include "./hittable.h"
+#include "./isotropic.h"
+#include "./material.h"
+#include "./ray.h"
+
+// A medium filling the whole scene, like haze or atmosphere. It isn't an object in the
+// scene: the integrator applies it to every segment of a path, with free-flight distances
+// and transmittance computed in closed form.
+//
+// The density at height y is density * exp(-height_falloff * (y - base_height)), so a
+// height_falloff of 0 gives a homogeneous medium. Outside the sphere of the given radius
+// around the origin there is no medium.
+class ambient_medium {
+public:
+    ambient_medium(
+        double _density,
+        color albedo,
+        double _height_falloff = 0,
+        double _base_height = 0,
+        double _radius = infinity
+    ) : phase_function(std::make_shared<isotropic>(albedo))
+      , density(_density)
+      , height_falloff(_height_falloff)
+      , base_height(_base_height)
+      , radius(_radius)
+    {}
+
+    // Samples where light traveling along r between t_min and t_max scatters. Returns false
+    // when it gets through without scattering.
+    bool sample(const ray& r, double t_min, double t_max, hit_record& rec) const {
+        if (!clip(r, t_min, t_max)) {
+            return false;
+        }
+
+        const auto target_depth = -std::log(1 - random_double());
+        const auto c = height_falloff * r.direction().y();
+        const auto sigma_t_min = sigma(r, t_min);
+
+        // Solve optical_depth(t_min, t_min + x) == target_depth for x
+        double x;
+        if (std::abs(c) < 1e-12) {
+            x = target_depth / sigma_t_min;
+        } else {
+            const auto remaining = 1 - target_depth * c / sigma_t_min;
+            if (remaining <= 0) {
+                // The medium thins out too quickly along the ray to ever reach target_depth
+                return false;
+            }
+            x = -std::log(remaining) / c;
+        }
+
+        if (!(t_min + x < t_max)) {
+            return false;
+        }
+
+        rec.t = t_min + x;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3{1, 0, 0}; // unused
+        rec.front_face = true; // unused
+        rec.material = phase_function;
+        return true;
+    }
+
+    // Fraction of light that gets from r.at(t_min) to r.at(t_max) without scattering
+    double transmittance(const ray& r, double t_min, double t_max) const {
+        if (!clip(r, t_min, t_max)) {
+            return 1;
+        }
+        return std::exp(-optical_depth(r, t_min, t_max));
+    }
+
+    std::shared_ptr<material> phase_function;
+    double density;
+    double height_falloff;
+    double base_height;
+    double radius;
+
+private:
+    // Extinction per unit of t (not per unit of distance) at r.at(t)
+    double sigma(const ray& r, double t) const {
+        const auto y = r.origin().y() + t * r.direction().y();
+        return density * std::exp(-height_falloff * (y - base_height)) * r.direction().length();
+    }
+
+    double optical_depth(const ray& r, double t0, double t1) const {
+        const auto c = height_falloff * r.direction().y();
+        if (std::isinf(t1) && c <= 0) {
+            return infinity;
+        }
+        if (std::abs(c) < 1e-12) {
+            return sigma(r, t0) * (t1 - t0);
+        }
+        return sigma(r, t0) * (1 - std::exp(-c * (t1 - t0))) / c;
+    }
+
+    // Narrows [t_min, t_max] to the part of r inside the medium's sphere
+    bool clip(const ray& r, double& t_min, double& t_max) const {
+        if (density <= 0) {
+            return false;
+        }
+        if (std::isinf(radius)) {
+            return t_min < t_max;
+        }
+
+        const auto a = dot(r.direction(), r.direction());
+        const auto half_b = dot(r.origin(), r.direction());
+        const auto c = dot(r.origin(), r.origin()) - radius * radius;
+        const auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+        const auto sqrtd = std::sqrt(discriminant);
+        t_min = std::max(t_min, (-half_b - sqrtd) / a);
+        t_max = std::min(t_max, (-half_b + sqrtd) / a);
+        return t_min < t_max;
+    }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "./perlin.h"
+#include "./vec3.h"
+
+// A periodic perlin noise sampled once on a grid covering one period, and looked up with
+// trilinear interpolation. A lookup is cheaper than evaluating the gradient noise, but the
+// result is only continuous, not smooth, and it takes (period * samples_per_unit)^3 floats
+// of memory.
+class baked_noise {
+public:
+    // New random noise with a period of 16 units
+    baked_noise() : baked_noise(perlin{16}) {}
+
+    // samples_per_unit must be a power of two
+    baked_noise(const perlin& source, int samples_per_unit = 4)
+      : size(source.period() * samples_per_unit),
+        mask(size - 1),
+        samples_per_unit(samples_per_unit),
+        values(static_cast<size_t>(size) * size * size)
+    {
+        const auto step = 1.0 / samples_per_unit;
+        for (int k = 0; k < size; k++) {
+            for (int j = 0; j < size; j++) {
+                for (int i = 0; i < size; i += 4) {
+                    point3 points[4];
+                    double noise[4];
+                    for (int l = 0; l < 4; l++) {
+                        points[l] = point3{(i + l) * step, j * step, k * step};
+                    }
+                    source.noise4(points, noise);
+                    for (int l = 0; l < 4 && i + l < size; l++) {
+                        values[offset(i + l, j, k)] = static_cast<float>(noise[l]);
+                    }
+                }
+            }
+        }
+    }
+
+    double noise(const point3& p) const {
+        auto x = p.x() * samples_per_unit;
+        auto y = p.y() * samples_per_unit;
+        auto z = p.z() * samples_per_unit;
+        auto i = fast_floor(x);
+        auto j = fast_floor(y);
+        auto k = fast_floor(z);
+        auto u = x - i;
+        auto v = y - j;
+        auto w = z - k;
+        auto i0 = i & mask;
+        auto j0 = j & mask;
+        auto k0 = k & mask;
+        auto i1 = (i + 1) & mask;
+        auto j1 = (j + 1) & mask;
+        auto k1 = (k + 1) & mask;
+
+        auto c00 = lerp(values[offset(i0, j0, k0)], values[offset(i1, j0, k0)], u);
+        auto c10 = lerp(values[offset(i0, j1, k0)], values[offset(i1, j1, k0)], u);
+        auto c01 = lerp(values[offset(i0, j0, k1)], values[offset(i1, j0, k1)], u);
+        auto c11 = lerp(values[offset(i0, j1, k1)], values[offset(i1, j1, k1)], u);
+        return lerp(lerp(c00, c10, v), lerp(c01, c11, v), w);
+    }
+
+    double turb(const point3& p, int depth = 7) const {
+        auto accum = 0.0;
+        auto temp_p = p;
+        auto weight = 1.0;
+
+        for (int i = 0; i < depth; i++) {
+            accum += weight * noise(temp_p);
+            weight *= 0.5;
+            temp_p *= 2;
+        }
+
+        return std::abs(accum);
+    }
+
+private:
+    int size;
+    int mask;
+    int samples_per_unit;
+    std::vector<float> values;
+
+    static int fast_floor(double x) {
+        auto i = static_cast<int>(x);
+        return x < i ? i - 1 : i;
+    }
+
+    size_t offset(int i, int j, int k) const {
+        return (static_cast<size_t>(k) * size + j) * size + i;
+    }
+
+    static double lerp(double a, double b, double t) {
+        return a + t * (b - a);
+    }
+};
@@ -0,0 +1,33 @@
+// Reports how good the BVHs of the scenes are, to tell whether a slow scene is slow because
+// of its acceleration structure: nodes, leaf depths and sizes, SAH cost, how much siblings
+// overlap, memory, and the primitives with the largest bounding boxes with their share of
+// the cost. See bvh_analysis.h. Run from the repository root, where the scenes find their
+// textures:
+//
+//     ./analyze-scenes [scene...]
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../bvh_analysis.h"
+#include "../scenes/scene_list.h"
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> names{argv + 1, argv + argc};
+    for (const auto& s : scenes) {
+        if (!names.empty() && std::find(names.begin(), names.end(), s.name) == names.end()) {
+            continue;
+        }
+        scene scene;
+        s.build(scene);
+        std::cout << "== " << s.name << "\n";
+        bvh_analysis{std::cout}.report(scene.world);
+        if (scene.atmosphere) {
+            std::cout << "Atmosphere: a medium filling the whole scene, sampled along every ray"
+                      << " besides the BVH\n";
+        }
+        std::cout << std::endl;
+    }
+}
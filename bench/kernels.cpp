@@ -0,0 +1,241 @@
+// Speed of the kernels of the inner loop, each on its own: ray intersection, traversal, noise,
+// texture lookups, random directions and the pdfs. Inputs are random but the same every run.
+// Kernels are timed warm, cycling through a few inputs (and objects) that stay in the L1
+// cache, and cold, through inputs and objects in random order in arrays much larger than the
+// caches. Run from the repository root after changing e.g. vec3.h or pdf.h, and compare.
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../aabb.h"
+#include "../bvh.h"
+#include "../cpu_dispatch.h"
+#include "../image_texture.h"
+#include "../lambertian.h"
+#include "../pdf.h"
+#include "../perlin.h"
+#include "../sphere.h"
+#include "../tiled_image.h"
+#include "../xy_rect.h"
+
+const int op_count = 1 << 21;
+// Inputs cycled through warm and cold, powers of two
+const int warm_set = 1 << 8;
+const int cold_set = 1 << 19;
+
+// Inputs of the cold runs, in an order that defeats prefetching
+std::vector<int> cold_order;
+
+// ns per call of op(k), with k cycling through the inputs
+template<typename F>
+double ns_per_op(F op, bool cold) {
+    auto sink = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < op_count; i++) {
+        sink += op(cold ? cold_order[i & (cold_set - 1)] : i & (warm_set - 1));
+    }
+    auto end = std::chrono::steady_clock::now();
+    // Keep the compiler from removing the work
+    if (sink == 12345.678) {
+        std::cerr << sink;
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() / op_count;
+}
+
+void report(const char* name, const char* variant, double ns) {
+    std::cout << std::setw(30) << std::left << name << std::setw(6) << variant
+              << std::right << std::fixed << std::setprecision(1) << std::setw(9) << ns
+              << " ns/op " << std::setw(10) << std::setprecision(2) << 1e3 / ns << " Mops/s"
+              << std::endl;
+    std::cout << std::defaultfloat;
+}
+
+template<typename F>
+void bench(const char* name, F op) {
+    report(name, "warm", ns_per_op(op, false));
+    report(name, "cold", ns_per_op(op, true));
+}
+
+// For kernels without inputs
+template<typename F>
+void bench_no_input(const char* name, F op) {
+    report(name, "", ns_per_op(op, false));
+}
+
+// A ray towards a random point in box, widened so about half of the rays miss what's in it
+ray aimed_at(const aabb& box) {
+    const auto size = box.max() - box.min();
+    const auto target = box.min() - 0.25 * size + 1.5 * vec3{
+        random_double() * size.x(), random_double() * size.y(), random_double() * size.z()};
+    const auto origin = target + 50 * random_unit_vector();
+    return ray{origin, target - origin};
+}
+
+int main() {
+    std::cout << "Kernels compiled for: " << kernel_isa() << std::endl;
+
+    cold_order.resize(cold_set);
+    for (int i = 0; i < cold_set; i++) {
+        cold_order[i] = i;
+    }
+    std::shuffle(cold_order.begin(), cold_order.end(), std::mt19937{});
+
+    auto material = std::make_shared<lambertian>(color{0.5, 0.5, 0.5});
+
+    // Intersection
+
+    std::vector<sphere> spheres;
+    std::vector<aabb> boxes;
+    std::vector<ray> rays;
+    spheres.reserve(cold_set);
+    for (int i = 0; i < cold_set; i++) {
+        spheres.emplace_back(point3::random(-100, 100), random_double(1, 5), material);
+        aabb box;
+        spheres.back().bounding_box(0, 0, box);
+        boxes.push_back(box);
+        rays.push_back(aimed_at(box));
+    }
+    bench("sphere::hit", [&] (int k) {
+        hit_record rec;
+        return spheres[k].hit(rays[k], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    bench("aabb::hit", [&] (int k) {
+        return boxes[k].hit(rays[k], 0.001, infinity) ? 1.0 : 0.0;
+    });
+
+    std::vector<xy_rect> xy_rects;
+    std::vector<xz_rect> xz_rects;
+    std::vector<yz_rect> yz_rects;
+    xy_rects.reserve(cold_set);
+    xz_rects.reserve(cold_set);
+    yz_rects.reserve(cold_set);
+    for (int i = 0; i < cold_set; i++) {
+        const auto a = random_double(-100, 100);
+        const auto b = random_double(-100, 100);
+        const auto k = random_double(-100, 100);
+        xy_rects.emplace_back(a, a + 10, b, b + 10, k, material);
+        xz_rects.emplace_back(a, a + 10, b, b + 10, k, material);
+        yz_rects.emplace_back(a, a + 10, b, b + 10, k, material);
+    }
+    const auto rect_rays = [&] (const hittable& rect, int k) {
+        aabb box;
+        rect.bounding_box(0, 0, box);
+        rays[k] = aimed_at(box);
+    };
+    for (int i = 0; i < cold_set; i++) {
+        rect_rays(xy_rects[i], i);
+    }
+    bench("xy_rect::hit", [&] (int k) {
+        hit_record rec;
+        return xy_rects[k].hit(rays[k], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    for (int i = 0; i < cold_set; i++) {
+        rect_rays(xz_rects[i], i);
+    }
+    bench("xz_rect::hit", [&] (int k) {
+        hit_record rec;
+        return xz_rects[k].hit(rays[k], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    for (int i = 0; i < cold_set; i++) {
+        rect_rays(yz_rects[i], i);
+    }
+    bench("yz_rect::hit", [&] (int k) {
+        hit_record rec;
+        return yz_rects[k].hit(rays[k], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+
+    // Traversal of one BVH: warm rays keep visiting the same nodes, cold rays go all over it.
+    // Building copies the object list at every node, so it can't be very large.
+    {
+        hittable_list list;
+        for (int i = 0; i < 1 << 12; i++) {
+            list.add(std::make_shared<sphere>(point3::random(-200, 200), 5, material));
+        }
+        bvh_node bvh{list, 0, 0};
+        for (int i = 0; i < cold_set; i++) {
+            rays[i] = ray{point3::random(-200, 200), random_unit_vector()};
+        }
+        bench("bvh_node::hit", [&] (int k) {
+            hit_record rec;
+            return bvh.hit(rays[k], 0.001, infinity, rec) ? rec.t : 0.0;
+        });
+        bench("bvh_node::occluded", [&] (int k) {
+            return bvh.occluded(rays[k], 0.001, infinity) ? 1.0 : 0.0;
+        });
+    }
+
+    // Noise and textures
+
+    std::vector<point3> points(cold_set);
+    for (auto& p : points) {
+        p = point3::random(-100, 100);
+    }
+    perlin noise;
+    bench("perlin::noise", [&] (int k) { return noise.noise(points[k]); });
+    bench("perlin::turb", [&] (int k) { return noise.turb(points[k]); });
+
+    {
+        // Larger than the caches, with its mip levels
+        const int size = 4096;
+        std::vector<unsigned char> pixels(static_cast<size_t>(size) * size * 3);
+        std::mt19937 generator;
+        for (auto& p : pixels) {
+            p = static_cast<unsigned char>(generator());
+        }
+        image_texture texture{std::make_shared<const tiled_image>(pixels.data(), size, size, 3)};
+        std::vector<double> us(cold_set);
+        std::vector<double> vs(cold_set);
+        for (int i = 0; i < cold_set; i++) {
+            us[i] = random_double();
+            vs[i] = random_double();
+        }
+        bench("image_texture::value", [&] (int k) {
+            return texture.value(us[k], vs[k], points[k]).x();
+        });
+        bench("image_texture::filtered_value", [&] (int k) {
+            return texture.filtered_value(us[k], vs[k], points[k], 1.0 / 512).x();
+        });
+    }
+
+    // Sampling
+
+    bench_no_input("random_cosine_direction", [] (int) {
+        return random_cosine_direction().z();
+    });
+    bench_no_input("random_in_unit_sphere", [] (int) {
+        return random_in_unit_sphere().z();
+    });
+    bench_no_input("random_unit_vector", [] (int) {
+        return random_unit_vector().z();
+    });
+
+    std::vector<vec3> normals(cold_set);
+    for (auto& n : normals) {
+        n = random_unit_vector();
+    }
+    sphere_pdf uniform;
+    bench_no_input("sphere_pdf", [&] (int) {
+        return uniform.value(uniform.generate());
+    });
+    bench("cosine_pdf", [&] (int k) {
+        cosine_pdf p{normals[k]};
+        return p.value(p.generate());
+    });
+    xz_rect light{213, 343, 227, 332, 554, material};
+    bench("hittable_pdf", [&] (int k) {
+        hittable_pdf p{light, points[k]};
+        return p.value(p.generate());
+    });
+    bench("mixture_pdf", [&] (int k) {
+        mixture_pdf p{
+            std::make_shared<hittable_pdf>(light, points[k]),
+            std::make_shared<cosine_pdf>(normals[k])
+        };
+        return p.value(p.generate());
+    });
+}
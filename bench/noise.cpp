@@ -0,0 +1,160 @@
+// Accuracy and speed of the noise implementations: scalar perlin::noise, the four-wide
+// perlin::noise4 and the trilinear lookups of baked_noise.
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "../perlin.h"
+#include "../baked_noise.h"
+
+const int point_count = 1 << 20;
+
+template<typename F>
+double ns_per_point(F f) {
+    auto start = std::chrono::steady_clock::now();
+    auto sink = f();
+    auto end = std::chrono::steady_clock::now();
+    // Keep the compiler from removing the work
+    if (sink == 12345.678) {
+        std::cerr << sink;
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() / point_count;
+}
+
+void report_error(const char* name, const std::vector<double>& a, const std::vector<double>& b) {
+    auto max_error = 0.0;
+    auto sum_squared = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        auto e = std::abs(a[i] - b[i]);
+        max_error = std::max(max_error, e);
+        sum_squared += e * e;
+    }
+    std::cout << std::setw(28) << std::left << name
+              << " max error " << std::setw(14) << max_error
+              << " rms error " << std::sqrt(sum_squared / a.size()) << "\n";
+}
+
+void report_time(const char* name, double ns) {
+    std::cout << std::setw(28) << std::left << name
+              << std::setw(10) << std::fixed << std::setprecision(1) << ns << " ns/point\n";
+    std::cout << std::defaultfloat;
+}
+
+int main() {
+    const int period = 16;
+    perlin noise{period};
+    baked_noise baked{noise, 4};
+    baked_noise fine_baked{noise, 8};
+
+    std::vector<point3> points(point_count);
+    for (auto& p : points) {
+        p = point3::random(-100, 100);
+    }
+
+    std::vector<double> scalar(point_count);
+    std::vector<double> simd(point_count);
+    std::vector<double> baked_values(point_count);
+    std::vector<double> fine_values(point_count);
+
+    // Accuracy
+
+    for (int i = 0; i < point_count; i++) {
+        scalar[i] = noise.noise(points[i]);
+        baked_values[i] = baked.noise(points[i]);
+        fine_values[i] = fine_baked.noise(points[i]);
+    }
+    for (int i = 0; i < point_count; i += 4) {
+        noise.noise4(&points[i], &simd[i]);
+    }
+    report_error("noise4 vs noise", scalar, simd);
+    report_error("baked noise (4/unit)", scalar, baked_values);
+    report_error("baked noise (8/unit)", scalar, fine_values);
+
+    for (int i = 0; i < point_count; i++) {
+        auto accum = 0.0;
+        auto temp_p = points[i];
+        auto weight = 1.0;
+        for (int octave = 0; octave < 7; octave++) {
+            accum += weight * noise.noise(temp_p);
+            weight *= 0.5;
+            temp_p *= 2;
+        }
+        scalar[i] = std::abs(accum);
+        simd[i] = noise.turb(points[i]);
+        baked_values[i] = baked.turb(points[i]);
+        fine_values[i] = fine_baked.turb(points[i]);
+    }
+    report_error("turb vs scalar turb", scalar, simd);
+    report_error("baked turb (4/unit)", scalar, baked_values);
+    report_error("baked turb (8/unit)", scalar, fine_values);
+
+    // Speed
+
+    report_time("noise", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            sum += noise.noise(p);
+        }
+        return sum;
+    }));
+    report_time("noise4", ns_per_point([&] {
+        auto sum = 0.0;
+        double values[4];
+        for (int i = 0; i < point_count; i += 4) {
+            noise.noise4(&points[i], values);
+            sum += values[0] + values[1] + values[2] + values[3];
+        }
+        return sum;
+    }));
+    report_time("baked noise (4/unit)", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            sum += baked.noise(p);
+        }
+        return sum;
+    }));
+    report_time("baked noise (8/unit)", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            sum += fine_baked.noise(p);
+        }
+        return sum;
+    }));
+    report_time("scalar turb", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            auto temp_p = p;
+            auto weight = 1.0;
+            for (int octave = 0; octave < 7; octave++) {
+                sum += weight * noise.noise(temp_p);
+                weight *= 0.5;
+                temp_p *= 2;
+            }
+        }
+        return sum;
+    }));
+    report_time("turb", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            sum += noise.turb(p);
+        }
+        return sum;
+    }));
+    report_time("baked turb (4/unit)", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            sum += baked.turb(p);
+        }
+        return sum;
+    }));
+    report_time("baked turb (8/unit)", ns_per_point([&] {
+        auto sum = 0.0;
+        for (const auto& p : points) {
+            sum += fine_baked.turb(p);
+        }
+        return sum;
+    }));
+}
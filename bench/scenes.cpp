@@ -0,0 +1,234 @@
+// Renders the scenes at a fixed size and sample count with 1 up to N threads. Reports render
+// time, samples and rays per second, BVH build time, peak memory and how well rendering
+// scales with threads. Every render runs in a process of its own, forked from this one, so
+// each starts from the same random numbers and an empty texture cache and has its own peak
+// memory. Run from the repository root, where the scenes find their textures:
+//
+//     ./bench-scenes [--width 200] [--spp 16] [--threads N] [--baseline old.json] [scene...]
+//
+// The results go to stdout as JSON, one scene per line, and can be saved as a baseline that
+// later runs compare their times against.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cpu_dispatch.h"
+#include "../scenes/scene_list.h"
+
+struct run_result {
+    int threads = 0;
+    double build_seconds = 0;
+    double render_seconds = 0;
+    long long samples = 0;
+    long long rays = 0;
+    double peak_rss_mb = 0;
+};
+
+// Renders in a child process, which sends back what it measured through a pipe
+bool run(const named_scene& s, int width, int spp, int threads, run_result& result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        std::perror("pipe");
+        return false;
+    }
+    const auto child = fork();
+    if (child < 0) {
+        std::perror("fork");
+        return false;
+    }
+    if (child == 0) {
+        close(fds[0]);
+        scene scene;
+        s.build(scene);
+        scene.image_width = width;
+        scene.samples_per_pixel = spp;
+        scene.nthreads = threads;
+        // Neither the image nor the progress are of interest
+        std::cout.rdbuf(nullptr);
+        std::cerr.rdbuf(nullptr);
+        scene.render();
+
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+        const auto rss_mb = usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+        const auto rss_mb = usage.ru_maxrss / 1024.0;
+#endif
+        std::ostringstream out;
+        out << std::setprecision(17) << scene.stats.build_seconds << ' '
+            << scene.stats.render_seconds << ' ' << scene.stats.samples << ' '
+            << scene.stats.rays << ' ' << rss_mb << '\n';
+        const auto text = out.str();
+        if (write(fds[1], text.data(), text.size()) != static_cast<ssize_t>(text.size())) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    std::string text;
+    char buffer[256];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof buffer)) > 0) {
+        text.append(buffer, n);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "ERROR: Rendering " << s.name << " with " << threads << " threads failed.\n";
+        return false;
+    }
+    std::istringstream in{text};
+    result.threads = threads;
+    in >> result.build_seconds >> result.render_seconds >> result.samples >> result.rays
+       >> result.peak_rss_mb;
+    return static_cast<bool>(in);
+}
+
+// The number after "key": in text, searching from position from, or -1
+double json_number(const std::string& text, const std::string& key, size_t from = 0) {
+    const auto at = text.find("\"" + key + "\":", from);
+    if (at == std::string::npos) {
+        return -1;
+    }
+    return std::strtod(text.c_str() + at + key.size() + 3, nullptr);
+}
+
+// Seconds the baseline took to render with threads threads, or -1
+double baseline_seconds(const std::string& line, int threads) {
+    const auto runs = line.find("\"runs\":");
+    for (auto at = line.find("{", runs); at != std::string::npos; at = line.find("{", at + 1)) {
+        if (static_cast<int>(json_number(line, "threads", at)) == threads) {
+            return json_number(line, "seconds", at);
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    int width = 200;
+    int spp = 16;
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string baseline_file;
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--width" && i + 1 < argc) {
+            width = std::atoi(argv[++i]);
+        } else if (arg == "--spp" && i + 1 < argc) {
+            spp = std::atoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            max_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_file = argv[++i];
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Usage: " << argv[0] << " [--width W] [--spp S] [--threads N]"
+                      << " [--baseline results.json] [scene...]\n";
+            return 1;
+        } else {
+            names.push_back(arg);
+        }
+    }
+
+    std::vector<std::string> baseline;
+    if (!baseline_file.empty()) {
+        std::ifstream in{baseline_file};
+        if (!in) {
+            std::cerr << "ERROR: Could not read baseline '" << baseline_file << "'.\n";
+            return 1;
+        }
+        for (std::string line; std::getline(in, line);) {
+            baseline.push_back(line);
+        }
+    }
+
+    // 1, 2, 4, ... and the maximum
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::cerr << "Kernels compiled for: " << kernel_isa() << "\n";
+    for (const auto& s : scenes) {
+        if (!names.empty() && std::find(names.begin(), names.end(), s.name) == names.end()) {
+            continue;
+        }
+
+        std::vector<run_result> results;
+        for (const auto threads : thread_counts) {
+            run_result result;
+            if (run(s, width, spp, threads, result)) {
+                results.push_back(result);
+            }
+        }
+        if (results.empty()) {
+            continue;
+        }
+
+        std::string old;
+        for (const auto& line : baseline) {
+            if (line.find("\"scene\": \"" + std::string{s.name} + "\"") != std::string::npos) {
+                old = line;
+            }
+        }
+
+        auto peak_rss_mb = 0.0;
+        auto build_seconds = 0.0;
+        for (const auto& r : results) {
+            peak_rss_mb = std::max(peak_rss_mb, r.peak_rss_mb);
+            build_seconds += r.build_seconds / results.size();
+        }
+        const auto& single = results.front();
+
+        std::cout << std::fixed << std::setprecision(4)
+                  << "{\"scene\": \"" << s.name << "\", \"isa\": \"" << kernel_isa()
+                  << "\", \"width\": " << width
+                  << ", \"spp\": " << spp << ", \"bvh_build_ms\": " << 1000 * build_seconds
+                  << ", \"peak_rss_mb\": " << peak_rss_mb << ", \"runs\": [";
+        std::cerr << s.name << ": BVH " << std::fixed << std::setprecision(2)
+                  << 1000 * build_seconds << " ms, peak RSS " << peak_rss_mb << " MB\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+            // How much of the ideal speedup over one thread is reached
+            const auto efficiency = single.render_seconds / (r.threads * r.render_seconds);
+            std::cout << (i > 0 ? ", " : "") << std::setprecision(4)
+                      << "{\"threads\": " << r.threads
+                      << ", \"seconds\": " << r.render_seconds
+                      << ", \"samples_per_second\": " << std::setprecision(0)
+                      << r.samples / r.render_seconds
+                      << ", \"rays_per_second\": " << r.rays / r.render_seconds
+                      << ", \"efficiency\": " << std::setprecision(3) << efficiency << "}";
+
+            std::cerr << "  " << std::setw(3) << r.threads << " threads: "
+                      << std::setprecision(3) << std::setw(8) << r.render_seconds << " s, "
+                      << std::setprecision(2) << std::setw(8) << r.samples / r.render_seconds / 1e3
+                      << " k samples/s, " << std::setw(8) << r.rays / r.render_seconds / 1e6
+                      << " M rays/s, efficiency " << std::setprecision(0) << std::setw(3)
+                      << 100 * efficiency << "%";
+            const auto before = old.empty() ? -1 : baseline_seconds(old, r.threads);
+            if (before > 0) {
+                std::cerr << ", " << std::showpos << std::setprecision(1)
+                          << 100 * (r.render_seconds / before - 1) << std::noshowpos
+                          << "% time vs baseline";
+            }
+            std::cerr << "\n";
+        }
+        std::cout << "]}" << std::endl;
+    }
+}
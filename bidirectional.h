@@ -0,0 +1,625 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "./ambient_medium.h"
+#include "./camera.h"
+#include "./counters.h"
+#include "./denoiser.h"
+#include "./film.h"
+#include "./hittable.h"
+#include "./light_sampler.h"
+#include "./material.h"
+#include "./onb.h"
+#include "./pdf.h"
+
+// A point on a path traced from the camera or from a light
+struct path_vertex {
+    enum class kind { camera, light, environment, surface, medium };
+
+    kind type = kind::surface;
+    // Only p is set for the camera. For a light the normal is on the side it emits from.
+    hit_record rec;
+    // The ray along which the path arrived here; for the environment only its direction
+    ray r_in;
+    // Light (or importance) carried along the path up to here, over its density
+    color beta;
+    // From scatter(), times scattering_pdf() it is the BRDF times the cosine
+    color attenuation;
+    // Scatters in a single direction only (mirrors and glass), so it can't be connected to
+    bool delta = false;
+    bool connectible = false;
+    // Densities per unit of area (solid angle for the environment) of sampling this vertex
+    // from the previous one along the path, and from the next one going the other way
+    double pdf_fwd = 0;
+    double pdf_rev = 0;
+
+    bool on_surface() const {
+        return type == kind::surface || type == kind::light;
+    }
+};
+
+// Bidirectional path tracing: every sample traces a path from the camera and one from a
+// light, and connects every vertex of the one to every vertex of the other. Each way of
+// building the same path is weighed against the others with the power heuristic (Veach's
+// thesis, as in pbrt). Connecting light path vertices to the camera (light tracing) lands
+// on arbitrary pixels, so that light is added to a film.
+//
+// The environment is only found by camera paths and by sampling it from their vertices;
+// light paths start on the lights of light_tree.
+class bidirectional_tracer {
+public:
+    bidirectional_tracer(
+        const hittable& _world_tree,
+        const light_sampler& _light_tree,
+        const ambient_medium* _atmosphere,
+        const std::vector<std::shared_ptr<hittable>>& _media,
+        const camera& _cam,
+        film& _splats,
+        int _max_depth,
+        double _diffuse_spread
+    ) : world_tree(_world_tree), light_tree(_light_tree), atmosphere(_atmosphere)
+      , media(_media), cam(_cam), splats(_splats), max_depth(_max_depth), diffuse_spread(_diffuse_spread)
+    {
+        // get_ray() is given coordinates up to width / (width - 1), see scene::render()
+        film_area = cam.unit_viewport_area()
+            * splats.width / std::max(1, splats.width - 1)
+            * splats.height / std::max(1, splats.height - 1);
+        for (size_t i = 0; i < light_tree.size(); i++) {
+            point3 p;
+            vec3 normal;
+            double area = 0;
+            light_tree.light(static_cast<int>(i)).sample_surface(p, normal, area);
+            areas.push_back(area);
+        }
+    }
+
+    // Light arriving along r, a ray from camera.get_ray(). Light that reaches the camera
+    // through other pixels is added to the film. features, when given, gets what the camera
+    // path first sees.
+    color sample(const ray& r, ray_cone cone, feature_path* features = nullptr) const {
+        std::vector<path_vertex> camera_path;
+        path_vertex eye;
+        eye.type = path_vertex::kind::camera;
+        eye.rec.p = r.origin();
+        eye.beta = color{1, 1, 1};
+        eye.connectible = true;
+        camera_path.push_back(eye);
+        random_walk(
+            r, color{1, 1, 1}, camera_pdf(r.direction()), cone, true, camera_path,
+            max_depth + 2);
+        if (features) {
+            see_features(camera_path, *features);
+        }
+
+        std::vector<path_vertex> light_path;
+        trace_light_path(light_path);
+
+        color result{0, 0, 0};
+        const auto light_vertices = static_cast<int>(light_path.size());
+        for (int t = 1; t <= static_cast<int>(camera_path.size()); t++) {
+            // Sampling a light (s == 1) doesn't need the light path
+            for (int s = 0; s <= std::max(light_vertices, 1); s++) {
+                const auto depth = s + t - 2;
+                if ((s == 1 && t == 1) || depth < 0 || depth > max_depth) {
+                    continue;
+                }
+                if (t == 1) {
+                    connect_to_camera(light_path, camera_path, s);
+                } else {
+                    result += connect(light_path, camera_path, s, t);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    const hittable& world_tree;
+    const light_sampler& light_tree;
+    const ambient_medium* atmosphere;
+    // Shadow rays pass through these, see hittable::collect_media()
+    const std::vector<std::shared_ptr<hittable>>& media;
+    const camera& cam;
+    film& splats;
+    int max_depth;
+    double diffuse_spread;
+    // Area of the film at a distance of 1 from the lens
+    double film_area;
+    std::vector<double> areas;
+
+    // Density over solid angle of the camera sending a ray in direction
+    double camera_pdf(const vec3& direction) const {
+        const auto cos_theta = cam.cos_theta(direction);
+        if (cos_theta <= 0) {
+            return 0;
+        }
+        return 1 / (film_area * cos_theta * cos_theta * cos_theta);
+    }
+
+    // Chance of a light path starting on light i, per unit of its area
+    double light_origin_pdf(int i) const {
+        if (i < 0 || areas[i] <= 0) {
+            return 0;
+        }
+        return (1 - light_tree.environment_probability) * light_tree.emitter_probability(i)
+            / areas[i];
+    }
+
+    void trace_light_path(std::vector<path_vertex>& path) const {
+        if (light_tree.size() == 0 || random_double() < light_tree.environment_probability) {
+            return;
+        }
+        double probability;
+        const auto i = light_tree.sample_emitter(random_double(), probability);
+        path_vertex light;
+        light.type = path_vertex::kind::light;
+        double area;
+        color radiance;
+        if (!light_tree.sample_emission(i, light.rec.p, light.rec.normal, area, radiance)
+            || radiance.length_squared() == 0) {
+            return;
+        }
+        light.rec.front_face = true;
+        light.beta = radiance;
+        light.pdf_fwd = light_origin_pdf(i);
+        path.push_back(light);
+
+        onb uvw;
+        uvw.build_from_w(light.rec.normal);
+        const vec3 direction = uvw.local(random_cosine_direction());
+        const auto pdf_direction = dot(direction, light.rec.normal) / pi;
+        if (light.pdf_fwd <= 0 || pdf_direction <= 0) {
+            return;
+        }
+        // Cosine weighted, so the cosine cancels against the density of the direction
+        random_walk(
+            ray{light.rec.p, direction}, radiance * pi / light.pdf_fwd, pdf_direction,
+            ray_cone{0, diffuse_spread}, false, path, max_depth + 1);
+    }
+
+    // Extends path from its last vertex along r, sampled there with density pdf per unit of
+    // solid angle, until it has max_vertices vertices
+    void random_walk(
+        ray r, color beta, double pdf, ray_cone cone, bool from_camera,
+        std::vector<path_vertex>& path, size_t max_vertices
+    ) const {
+        auto pdf_fwd = pdf;
+        while (path.size() < max_vertices) {
+            hit_record rec;
+            auto hit_anything = world_tree.hit(r, 0.001, infinity, rec);
+            if (hit_anything) {
+                rec.object->complete(r, rec);
+            }
+            if (atmosphere && atmosphere->sample(r, 0.001, hit_anything ? rec.t : infinity, rec)) {
+                hit_anything = true;
+            }
+
+            path_vertex v;
+            v.r_in = r;
+            v.beta = beta;
+            if (!hit_anything) {
+                if (from_camera && light_tree.environment) {
+                    v.type = path_vertex::kind::environment;
+                    v.pdf_fwd = pdf_fwd;
+                    path.push_back(v);
+                }
+                return;
+            }
+
+            count(&render_counters::vertices);
+            const auto width = cone.width_at(rec.t * r.direction().length());
+            rec.uv_footprint = width * rec.uv_per_unit;
+            v.type = rec.material->volumetric()
+                ? path_vertex::kind::medium : path_vertex::kind::surface;
+            v.rec = rec;
+            v.pdf_fwd = convert_density(pdf_fwd, path.back(), v);
+
+            scatter_record srec;
+            const auto scatters = rec.material->scatter(r, rec, srec);
+            v.attenuation = srec.attenuation;
+            v.delta = scatters && srec.pdf == nullptr;
+            v.connectible = scatters && srec.pdf != nullptr;
+            path.push_back(v);
+            if (!scatters || path.size() >= max_vertices) {
+                return;
+            }
+
+            double pdf_rev;
+            auto survival = 1.0;
+            if (srec.pdf == nullptr) {
+                beta = beta * srec.attenuation;
+                r = srec.skip_pdf_ray;
+                pdf_fwd = pdf_rev = 0;
+                cone = ray_cone{width, cone.spread};
+            } else {
+                const ray scattered{rec.p, srec.pdf->generate()};
+                pdf_fwd = srec.pdf->value(scattered.direction());
+                if (pdf_fwd <= 0) {
+                    return;
+                }
+                const auto weight = srec.attenuation
+                    * rec.material->scattering_pdf(r, rec, scattered) / pdf_fwd;
+                pdf_rev = srec.pdf->value(-r.direction());
+                beta = beta * weight;
+                r = scattered;
+                cone = ray_cone{width, std::max(cone.spread, diffuse_spread)};
+                // Russian roulette, so long paths don't cost a connection per vertex pair
+                if (path.size() > 3) {
+                    survival = std::min(1.0, std::max({weight.x(), weight.y(), weight.z()}));
+                }
+            }
+
+            auto& previous = path[path.size() - 2];
+            previous.pdf_rev = convert_density(pdf_rev, path.back(), previous);
+            if (survival < 1) {
+                if (random_double() >= survival) {
+                    return;
+                }
+                beta = beta / survival;
+            }
+        }
+    }
+
+    // Density pdf per unit of solid angle at from, per unit of area at to
+    static double convert_density(double pdf, const path_vertex& from, const path_vertex& to) {
+        if (to.type == path_vertex::kind::environment) {
+            return pdf;
+        }
+        const auto w = to.rec.p - from.rec.p;
+        const auto distance2 = w.length_squared();
+        if (distance2 == 0) {
+            return 0;
+        }
+        if (to.on_surface()) {
+            pdf *= std::abs(dot(to.rec.normal, w)) / std::sqrt(distance2);
+        }
+        return pdf / distance2;
+    }
+
+    // The BRDF (or phase function) at v times the cosine towards p, for light between p and
+    // where the path arrived at v from
+    static color scattered(const path_vertex& v, const point3& p) {
+        return v.attenuation * v.rec.material->scattering_pdf(v.r_in, v.rec, ray{v.rec.p, p - v.rec.p});
+    }
+
+    // Density per unit of area at next of v sampling the direction towards next, when the
+    // path arrived at v from prev
+    double vertex_pdf(const path_vertex& v, const path_vertex* prev, const path_vertex& next) const {
+        if (v.type == path_vertex::kind::light) {
+            return light_pdf(v, next);
+        }
+        if (v.type == path_vertex::kind::camera) {
+            const auto direction = next.rec.p - v.rec.p;
+            if (!on_film(v.rec.p, next.rec.p)) {
+                return 0;
+            }
+            return convert_density(camera_pdf(direction), v, next);
+        }
+
+        // Sampled as if arriving from prev
+        const ray r_in{prev->rec.p, v.rec.p - prev->rec.p};
+        auto rec = v.rec;
+        if (v.type == path_vertex::kind::surface) {
+            rec.set_face_normal(r_in, rec.front_face ? rec.normal : -rec.normal);
+        }
+        scatter_record srec;
+        if (!rec.material->scatter(r_in, rec, srec) || srec.pdf == nullptr) {
+            return 0;
+        }
+        const auto direction = next.type == path_vertex::kind::environment
+            ? next.r_in.direction() : next.rec.p - v.rec.p;
+        return convert_density(srec.pdf->value(direction), v, next);
+    }
+
+    // Density per unit of area at next of a light path leaving light vertex v towards next
+    static double light_pdf(const path_vertex& v, const path_vertex& next) {
+        const auto w = next.rec.p - v.rec.p;
+        const auto distance2 = w.length_squared();
+        if (distance2 == 0) {
+            return 0;
+        }
+        const auto cos_light = dot(v.rec.normal, w) / std::sqrt(distance2);
+        if (cos_light <= 0) {
+            return 0;
+        }
+        return convert_density(cos_light / pi, v, next);
+    }
+
+    bool on_film(const point3& lens_point, const point3& p) const {
+        double s;
+        double t;
+        if (!cam.viewport_coordinates(lens_point, p, s, t)) {
+            return false;
+        }
+        const auto max_s = 1.0 * splats.width / std::max(1, splats.width - 1);
+        const auto max_t = 1.0 * splats.height / std::max(1, splats.height - 1);
+        return s >= 0 && s < max_s && t >= 0 && t < max_t;
+    }
+
+    // Tells features the vertices of a camera path up to the first one it scatters from
+    static void see_features(const std::vector<path_vertex>& path, feature_path& features) {
+        for (size_t i = 1; i < path.size() && !features.done; i++) {
+            const auto& v = path[i];
+            if (v.type == path_vertex::kind::environment) {
+                break;
+            }
+            const auto length = (v.rec.p - path[i - 1].rec.p).length();
+            if (v.connectible) {
+                features.scatter(
+                    length, v.attenuation, v.rec.normal, v.type == path_vertex::kind::medium);
+            } else if (v.delta) {
+                features.pass(length, v.attenuation);
+            } else {
+                features.stop(length, v.rec.normal);
+            }
+        }
+        features.end();
+    }
+
+    // Fraction of the light leaving a that arrives at b
+    double transmittance(const point3& a, const point3& b) const {
+        const auto d = b - a;
+        const auto distance = d.length();
+        const ray r{a, d / distance};
+        count(&render_counters::shadow_rays);
+        if (world_tree.occluded(r, 0.001, distance - 0.001)) {
+            return 0;
+        }
+        return media_transmittance(r, distance);
+    }
+
+    // Fraction of light that passes through the atmosphere and the media along r, up to t_max
+    double media_transmittance(const ray& r, double t_max) const {
+        auto fraction = atmosphere ? atmosphere->transmittance(r, 0.001, t_max) : 1.0;
+        for (const auto& medium : media) {
+            if (fraction <= 0) {
+                break;
+            }
+            fraction *= medium->transmittance(r, 0.001, t_max);
+        }
+        return fraction;
+    }
+
+    // The camera path's first t vertices joined to the light path's first s vertices
+    color connect(
+        std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path, int s, int t
+    ) const {
+        auto& pt = camera_path[t - 1];
+        if (s == 0) {
+            // The camera path found a light by itself
+            color emitted{0, 0, 0};
+            if (pt.type == path_vertex::kind::environment) {
+                emitted = light_tree.environment->radiance(pt.r_in.direction());
+            } else if (pt.type == path_vertex::kind::surface) {
+                emitted = pt.rec.material->emitted(pt.r_in, pt.rec);
+            }
+            if (emitted.length_squared() == 0) {
+                return color{0, 0, 0};
+            }
+            return pt.beta * emitted * mis_weight(light_path, camera_path, nullptr, 0, t);
+        }
+        if (!pt.connectible) {
+            return color{0, 0, 0};
+        }
+
+        if (s == 1) {
+            path_vertex light;
+            const auto contribution = sample_light(pt, light);
+            if (contribution.length_squared() == 0) {
+                return color{0, 0, 0};
+            }
+            return contribution * mis_weight(light_path, camera_path, &light, 1, t);
+        }
+
+        const auto& qs = light_path[s - 1];
+        if (!qs.connectible) {
+            return color{0, 0, 0};
+        }
+        const auto distance2 = (qs.rec.p - pt.rec.p).length_squared();
+        auto contribution = qs.beta * scattered(qs, pt.rec.p) * scattered(pt, qs.rec.p) * pt.beta
+            / distance2;
+        if (contribution.length_squared() == 0) {
+            return color{0, 0, 0};
+        }
+        contribution *= transmittance(pt.rec.p, qs.rec.p);
+        if (contribution.length_squared() == 0) {
+            return color{0, 0, 0};
+        }
+        return contribution * mis_weight(light_path, camera_path, nullptr, s, t);
+    }
+
+    // Light from a light (or the environment) picked for pt, scattered along pt's path. Sets
+    // light to the vertex on the light.
+    color sample_light(const path_vertex& pt, path_vertex& light) const {
+        double probability;
+        const auto i = light_tree.sample(pt.rec.p, random_double(), probability);
+        light.connectible = true;
+        if (i == light_sampler::environment_index) {
+            double environment_pdf;
+            const auto direction = light_tree.environment->sample(environment_pdf);
+            if (environment_pdf <= 0) {
+                return color{0, 0, 0};
+            }
+            light.type = path_vertex::kind::environment;
+            light.r_in = ray{pt.rec.p, direction};
+            light.pdf_fwd = probability * environment_pdf;
+            auto contribution = pt.beta * scattered(pt, pt.rec.p + direction)
+                * light_tree.environment->radiance(direction) / light.pdf_fwd;
+            if (contribution.length_squared() == 0) {
+                return color{0, 0, 0};
+            }
+            count(&render_counters::shadow_rays);
+            if (world_tree.occluded(light.r_in, 0.001, infinity)) {
+                return color{0, 0, 0};
+            }
+            return contribution * media_transmittance(light.r_in, infinity);
+        }
+        if (i < 0) {
+            return color{0, 0, 0};
+        }
+
+        const auto& emitter = light_tree.light(i);
+        const ray to_light{pt.rec.p, emitter.random(pt.rec.p)};
+        if (!emitter.hit(to_light, 0.001, infinity, light.rec)) {
+            return color{0, 0, 0};
+        }
+        light.rec.object->complete(to_light, light.rec);
+        light.type = path_vertex::kind::light;
+        light.r_in = to_light;
+        const auto emitted = light.rec.material->emitted(to_light, light.rec);
+        const auto light_pdf = probability * emitter.pdf_value(pt.rec.p, to_light.direction());
+        if (emitted.length_squared() == 0 || light_pdf <= 0) {
+            return color{0, 0, 0};
+        }
+        // Weighed as if the light had been picked like a light path's start, which is a
+        // different density but only changes how the strategies share the path
+        light.pdf_fwd = light_origin_pdf(i);
+        auto contribution = pt.beta * scattered(pt, light.rec.p) * emitted / light_pdf;
+        if (contribution.length_squared() == 0) {
+            return color{0, 0, 0};
+        }
+        return contribution * transmittance(pt.rec.p, light.rec.p);
+    }
+
+    // Light tracing: the light path's first s vertices joined to a point on the lens
+    void connect_to_camera(
+        std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path, int s
+    ) const {
+        const auto& qs = light_path[s - 1];
+        if (!qs.connectible) {
+            return;
+        }
+        path_vertex eye;
+        eye.type = path_vertex::kind::camera;
+        eye.rec.p = cam.random_lens_point();
+        eye.connectible = true;
+
+        double u;
+        double v;
+        if (!cam.viewport_coordinates(eye.rec.p, qs.rec.p, u, v)) {
+            return;
+        }
+        const auto i = static_cast<int>(std::floor(u * (splats.width - 1)));
+        const auto j = static_cast<int>(std::floor(v * (splats.height - 1)));
+        if (i < 0 || i >= splats.width || j < 0 || j >= splats.height) {
+            return;
+        }
+
+        // The importance the camera gives a direction is the density with which it sends
+        // rays that way, which per unit of area at qs is camera_pdf() times the cosine at
+        // the camera over the squared distance
+        const auto direction = qs.rec.p - eye.rec.p;
+        const auto cos_theta = cam.cos_theta(direction);
+        const auto distance2 = direction.length_squared();
+        auto contribution = qs.beta * scattered(qs, eye.rec.p)
+            / (film_area * cos_theta * cos_theta * cos_theta * distance2);
+        if (contribution.length_squared() == 0) {
+            return;
+        }
+        contribution *= transmittance(qs.rec.p, eye.rec.p);
+        if (contribution.length_squared() == 0) {
+            return;
+        }
+        splats.add(i, j, contribution * mis_weight(light_path, camera_path, &eye, s, 1));
+    }
+
+    // Power heuristic weight of building the path with s light and t camera vertices,
+    // compared to the other ways of building it. sampled replaces the last vertex of the
+    // light path (s == 1) or of the camera path (t == 1).
+    double mis_weight(
+        std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path,
+        const path_vertex* sampled, int s, int t
+    ) const {
+        if (s + t == 2) {
+            return 1;
+        }
+
+        path_vertex endpoint;
+        if (sampled != nullptr) {
+            endpoint = *sampled;
+        }
+        path_vertex* qs = s == 1 ? &endpoint : s > 1 ? &light_path[s - 1] : nullptr;
+        path_vertex* pt = t == 1 ? &endpoint : &camera_path[t - 1];
+        path_vertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+        path_vertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+        // The environment can't start light paths, so it only competes with the other way
+        // of finding it: a camera path hitting it versus sampling it from the vertex before
+        if (s == 0 && pt->type == path_vertex::kind::environment) {
+            if (pt_minus->delta) {
+                return 1;
+            }
+            const auto r = light_tree.environment_probability
+                * light_tree.environment->pdf_value(pt->r_in.direction()) / pt->pdf_fwd;
+            return 1 / (1 + r * r);
+        }
+        if (s == 1 && qs->type == path_vertex::kind::environment) {
+            const auto r = vertex_pdf(*pt, pt_minus, *qs) / qs->pdf_fwd;
+            return 1 / (1 + r * r);
+        }
+
+        auto light_index = -1;
+        if (s == 0) {
+            light_index = light_tree.index_of(pt->rec.object);
+            if (light_index < 0) {
+                // A light that can't be sampled, so only camera paths find it
+                return 1;
+            }
+        }
+
+        // Densities of the vertices around the connection for the other direction, which
+        // depend on the connection
+        const auto saved_pt = pt->pdf_rev;
+        const auto saved_pt_minus = pt_minus ? pt_minus->pdf_rev : 0;
+        const auto saved_qs = qs ? qs->pdf_rev : 0;
+        const auto saved_qs_minus = qs_minus ? qs_minus->pdf_rev : 0;
+
+        pt->pdf_rev = s > 0 ? vertex_pdf(*qs, qs_minus, *pt) : light_origin_pdf(light_index);
+        if (pt_minus) {
+            pt_minus->pdf_rev = s > 0 ? vertex_pdf(*pt, qs, *pt_minus) : light_pdf(*pt, *pt_minus);
+        }
+        if (qs) {
+            qs->pdf_rev = vertex_pdf(*pt, pt_minus, *qs);
+        }
+        if (qs_minus) {
+            qs_minus->pdf_rev = vertex_pdf(*qs, pt, *qs_minus);
+        }
+
+        // Densities that are zero because of a delta vertex cancel out
+        auto remap = [](double pdf) { return pdf != 0 ? pdf : 1; };
+
+        auto sum = 0.0;
+        auto r = 1.0;
+        for (int i = t - 1; i > 0; i--) {
+            const auto& v = i == t - 1 ? *pt : camera_path[i];
+            r *= remap(v.pdf_rev) / remap(v.pdf_fwd);
+            if (!v.delta && !camera_path[i - 1].delta) {
+                sum += r * r;
+            }
+        }
+        r = 1;
+        for (int i = s - 1; i >= 0; i--) {
+            const auto& v = i == s - 1 ? *qs : light_path[i];
+            r *= remap(v.pdf_rev) / remap(v.pdf_fwd);
+            const auto delta_before = i > 0 && light_path[i - 1].delta;
+            if (!v.delta && !delta_before) {
+                sum += r * r;
+            }
+        }
+
+        pt->pdf_rev = saved_pt;
+        if (pt_minus) {
+            pt_minus->pdf_rev = saved_pt_minus;
+        }
+        if (qs) {
+            qs->pdf_rev = saved_qs;
+        }
+        if (qs_minus) {
+            qs_minus->pdf_rev = saved_qs_minus;
+        }
+        return 1 / (1 + sum);
+    }
+};
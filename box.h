@@ -29,13 +29,26 @@ public:
         return sides.hit(r, t_min, t_max, rec);
     }
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        // The sides are where the ray enters and leaves the box, which a single slab test
+        // finds faster than testing each side
+        auto enter = -infinity;
+        auto leave = infinity;
+        if (!aabb{_min, _max}.clip(r, enter, leave)) {
+            return false;
+        }
+        return count_test(
+            (enter >= t_min && enter <= t_max) || (leave >= t_min && leave <= t_max));
+    }
+
     bool bounding_box(double time0, double time1, aabb& output_box) const override {
         output_box = aabb{_min, _max};
         return true;
     }
 
+    hittable_list sides;
+
 private:
     point3 _min;
     point3 _max;
-    hittable_list sides;
 };
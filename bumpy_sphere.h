@@ -1,51 +1,47 @@
 #pragma once
 
 #include "./vec3.h"
+#include "./counters.h"
 #include "./hittable.h"
 #include "./material.h"
 #include "./perlin.h"
+#include "./baked_noise.h"
 
 class bumpy_sphere : public hittable {
 public:
     bumpy_sphere(
         point3 center, double radius, double noise_amplitude, double noise_scale,
-        std::shared_ptr<material> material
+        std::shared_ptr<material> material, bool baked = false
     ) : center(center), radius(radius), noise_amplitude(noise_amplitude), 
-        noise_scale(noise_scale), material(material) {};
+        noise_scale(noise_scale), material(material),
+        baked(baked ? std::make_shared<baked_noise>() : nullptr) {};
 
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        const vec3 oc = r.origin() - center;
-        const auto a = dot(r.direction(), r.direction());
-        const auto b = 2.0 * dot(oc, r.direction());
-        const auto c = dot(oc, oc) - radius*radius;
-        const auto discriminant = b * b - 4 * a * c;
-        if (discriminant < 0) {
+        double root;
+        if (!count_test(intersect(r, t_min, t_max, root))) {
             return false;
-        } else {
-            auto sqrtd = sqrt(discriminant);
+        }
 
-            // Find the nearest root that lies in the acceptable range.
-            auto root = (-b - sqrtd) / a / 2;
-            if (root < t_min || root > t_max) {
-                root = (- b + sqrtd) / a / 2;
-                if (root < t_min || root > t_max) {
-                    return false;
-                }
-            }
+        rec.t = root;
+        rec.front_face = dot(r.direction(), r.at(root) - center) < 0;
+        rec.object = this;
+        return true;
+    }
 
-            rec.t = root;
-            rec.p = r.at(rec.t);
-            vec3 bump{
-                perlin_x.noise(noise_scale * rec.p), 
-                perlin_y.noise(noise_scale * rec.p), 
-                perlin_z.noise(noise_scale * rec.p)};
-            vec3 outward_normal = (rec.p - center) / radius + noise_amplitude * bump;
-            rec.set_face_normal(r, outward_normal);
+    void complete(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius + noise_amplitude * bump(rec.p);
+        rec.set_face_normal(r, outward_normal);
+        if (material->uses_uv()) {
             get_sphere_uv(outward_normal, rec.u, rec.v);
-            rec.material = material;
-
-            return true;
+            rec.uv_per_unit = 1 / (pi * radius);
         }
+        rec.material = material;
+    }
+
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        double root;
+        return count_test(intersect(r, t_min, t_max, root));
     }
 
     bool bounding_box(double time0, double time1, aabb& output_box) const override {
@@ -61,11 +57,48 @@ public:
     double noise_amplitude;
     double noise_scale;
     std::shared_ptr<material> material;
-    perlin perlin_x;
-    perlin perlin_y;
-    perlin perlin_z;
+    perlin noise;
+    std::shared_ptr<baked_noise> baked;
 
 private:
+    // Sets root to the nearest t between t_min and t_max where r crosses the sphere
+    bool intersect(const ray& r, double t_min, double t_max, double& root) const {
+        const vec3 oc = r.origin() - center;
+        const auto a = dot(r.direction(), r.direction());
+        const auto b = 2.0 * dot(oc, r.direction());
+        const auto c = dot(oc, oc) - radius*radius;
+        const auto discriminant = b * b - 4 * a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+        auto sqrtd = sqrt(discriminant);
+
+        // Find the nearest root that lies in the acceptable range.
+        root = (-b - sqrtd) / a / 2;
+        if (root < t_min || root > t_max) {
+            root = (- b + sqrtd) / a / 2;
+            if (root < t_min || root > t_max) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The three components come from the same noise at points far apart, which makes them
+    // independent and lets them be evaluated together
+    vec3 bump(const point3& p) const {
+        const vec3 offset_y{71.3, 17.9, 43.1};
+        const vec3 offset_z{29.7, 83.3, 61.9};
+        const auto q = noise_scale * p;
+        if (baked) {
+            return vec3{baked->noise(q), baked->noise(q + offset_y), baked->noise(q + offset_z)};
+        }
+        point3 points[4] = {q, q + offset_y, q + offset_z, q};
+        double values[4];
+        noise.noise4(points, values);
+        return vec3{values[0], values[1], values[2]};
+    }
+
     // p must be of length 1
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         auto theta = std::acos(-p.y());
@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <memory>
 
+#include "./counters.h"
+#include "./cpu_dispatch.h"
 #include "./hittable_list.h"
 #include "./utils.h"
 
@@ -68,17 +70,16 @@ public:
         }
 
         box = surrounding_box(left_box, right_box);
+        left_node = dynamic_cast<const bvh_node*>(left.get());
+        right_node = dynamic_cast<const bvh_node*>(right.get());
     }
 
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        if (!box.hit(r, t_min, t_max)) {
-            return false;
-        }
-
-        bool hit_left = left->hit(r, t_min, t_max, rec);
-        bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+        return traverse(r, t_min, t_max, &rec);
+    }
 
-        return hit_left || hit_right;
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        return traverse(r, t_min, t_max, nullptr);
     }
 
     bool bounding_box(double time0, double time1, aabb& output_box) const override {
@@ -86,9 +87,71 @@ public:
         return true;
     }
 
+    void collect_emitters(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& lights
+    ) const override {
+        left->collect_emitters(left, lights);
+        if (right != left) {
+            right->collect_emitters(right, lights);
+        }
+    }
+
+    void collect_media(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& media
+    ) const override {
+        left->collect_media(left, media);
+        if (right != left) {
+            right->collect_media(right, media);
+        }
+    }
+
     std::shared_ptr<hittable> left;
     std::shared_ptr<hittable> right;
     aabb box;
+
+private:
+    // left and right when they are BVH nodes too, else nullptr
+    const bvh_node* left_node = nullptr;
+    const bvh_node* right_node = nullptr;
+
+    // Walks the nodes below this one with a stack of its own instead of calling them, so
+    // only primitives are called through hittable. With rec it finds the closest hit,
+    // without it stops at the first.
+    RENDER_KERNEL
+    bool traverse(const ray& r, double t_min, double t_max, hit_record* rec) const {
+        const bvh_node* stack[64];
+        int size = 0;
+        stack[size++] = this;
+        auto hit_anything = false;
+        while (size > 0) {
+            const auto node = stack[--size];
+            count(&render_counters::bvh_nodes);
+            if (!node->box.hit(r, t_min, t_max)) {
+                continue;
+            }
+            // A node over a single primitive has it as both children
+            const auto children = node->left == node->right ? 1 : 2;
+            // Right first, so a left node ends up on top of the stack
+            for (int i = children - 1; i >= 0; i--) {
+                const auto child_node = i == 0 ? node->left_node : node->right_node;
+                if (child_node != nullptr && size < 64) {
+                    stack[size++] = child_node;
+                    continue;
+                }
+                // Primitives, and nodes that don't fit on the stack
+                const auto& child = i == 0 ? node->left : node->right;
+                if (rec == nullptr) {
+                    if (child->occluded(r, t_min, t_max)) {
+                        return true;
+                    }
+                } else if (child->hit(r, t_min, t_max, *rec)) {
+                    hit_anything = true;
+                    t_max = rec->t;
+                }
+            }
+        }
+        return hit_anything;
+    }
 };
 
 bool box_x_compare(
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+
+#include "./box.h"
+#include "./bvh.h"
+#include "./constant_medium.h"
+#include "./csg.h"
+#include "./hittable_list.h"
+#include "./rotation.h"
+#include "./translation.h"
+
+// Measures how good the BVHs of a scene are: the one scene::render() builds over the world,
+// and those the scene built itself, like one over many small objects put in a translate.
+//
+// Costs are those of the surface area heuristic (SAH), in intersection tests per ray that
+// hits the root's box: a ray that hits a box hits a box inside it with a probability of the
+// ratio of their surface areas. A bounding box test and a primitive test both count as one.
+// A primitive that contains others, like a box (six rectangles), a hittable_list or a
+// translated BVH, costs as much as what it tests in turn.
+class bvh_analysis {
+public:
+    // Statistics of one BVH
+    struct statistics {
+        int nodes = 0;
+        int leaves = 0;
+        // Leaves per depth, the root at 0
+        std::vector<int> leaf_depths;
+        // Leaves per number of primitives in them
+        std::vector<int> leaf_sizes;
+        // Primitives below the leaves, and what they cost
+        struct primitive {
+            const hittable* object;
+            double area;
+            double cost;
+            // Of the whole BVH's cost
+            double share;
+        };
+        std::vector<primitive> primitives;
+        double sah_cost = 0;
+        // What testing all primitives one after the other would cost
+        double list_cost = 0;
+        // Surface area of the overlap of two children over that of their parent, averaged
+        // over the internal nodes weighted by their area
+        double overlap = 0;
+        size_t bytes = 0;
+    };
+
+    explicit bvh_analysis(std::ostream& _out) : out(_out) {}
+
+    // Builds the BVH over world as scene::render() does, and reports on it and the BVHs
+    // nested in its objects
+    void report(const hittable_list& world) {
+        const auto start = std::chrono::steady_clock::now();
+        bvh_node root{world, 0, 0};
+        const auto build_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+
+        std::set<const hittable*> objects;
+        for (const auto& object : world.objects) {
+            objects.insert(object.get());
+        }
+        out << "World: " << world.objects.size() << " objects, BVH built in " << std::fixed
+            << std::setprecision(2) << build_ms << " ms\n";
+        const auto stats = analyze(root, objects);
+        print("world", stats);
+        // Nested BVHs hang below the primitives, and maybe below theirs in turn
+        for (const auto& p : stats.primitives) {
+            nested(*p.object, type_name(*p.object));
+        }
+    }
+
+    // Expected intersection tests for a ray that reaches h
+    double cost(const hittable& h) {
+        const auto found = costs.find(&h);
+        if (found != costs.end()) {
+            return found->second;
+        }
+        double result = 1;
+        if (const auto node = dynamic_cast<const bvh_node*>(&h)) {
+            result = analyze(*node, {}).sah_cost;
+        } else if (const auto list = dynamic_cast<const hittable_list*>(&h)) {
+            result = 0;
+            for (const auto& object : list->objects) {
+                result += cost(*object);
+            }
+        } else if (const auto b = dynamic_cast<const box*>(&h)) {
+            result = cost(b->sides);
+        } else if (const auto t = dynamic_cast<const translate*>(&h)) {
+            result = cost(*t->child);
+        } else if (const auto r = dynamic_cast<const rotate_y*>(&h)) {
+            result = cost(*r->child);
+        } else if (const auto m = dynamic_cast<const constant_medium*>(&h)) {
+            // Where the ray enters the boundary, and where it leaves it
+            result = 2 * cost(*m->boundary);
+        } else if (const auto d = dynamic_cast<const difference*>(&h)) {
+            result = cost(*d->a) + cost(*d->b);
+        } else if (const auto i = dynamic_cast<const intersection*>(&h)) {
+            result = cost(*i->a) + cost(*i->b);
+        } else if (const auto f = dynamic_cast<const fusion*>(&h)) {
+            result = cost(*f->a) + cost(*f->b);
+        }
+        costs[&h] = result;
+        return result;
+    }
+
+    // Statistics of the BVH below root. Nodes in primitives are primitives, not nodes of
+    // this BVH, even when they are BVH nodes themselves.
+    statistics analyze(const bvh_node& root, const std::set<const hittable*>& primitives) {
+        statistics stats;
+        const auto root_area = root.box.surface_area();
+        auto overlap_area = 0.0;
+        auto internal_area = 0.0;
+        walk(root, 0, root_area, primitives, stats, overlap_area, internal_area);
+        stats.overlap = internal_area > 0 ? overlap_area / internal_area : 0;
+        // Allocated with make_shared, along with a reference count
+        stats.bytes = stats.nodes * (sizeof(bvh_node) + 2 * sizeof(long));
+        for (auto& p : stats.primitives) {
+            stats.list_cost += p.cost;
+            p.share = stats.sah_cost > 0 ? p.share / stats.sah_cost : 0;
+        }
+        std::sort(stats.primitives.begin(), stats.primitives.end(),
+            [] (const auto& a, const auto& b) { return a.area > b.area; });
+        return stats;
+    }
+
+private:
+    std::ostream& out;
+    std::map<const hittable*, double> costs;
+    // How many of the largest primitives to list
+    static constexpr int largest = 8;
+
+    void walk(
+        const bvh_node& node, int depth, double root_area,
+        const std::set<const hittable*>& primitives, statistics& stats,
+        double& overlap_area, double& internal_area
+    ) {
+        stats.nodes++;
+        const auto area = node.box.surface_area();
+        // Its children are tested when its box is hit
+        const auto reached = root_area > 0 ? area / root_area : 1;
+        // Its own box, tested when its parent's box was hit; the root's always is
+        if (depth == 0) {
+            stats.sah_cost += 1;
+        }
+
+        const auto is_node = [&] (const std::shared_ptr<hittable>& child) {
+            return primitives.count(child.get()) == 0
+                && dynamic_cast<const bvh_node*>(child.get()) != nullptr;
+        };
+        int in_leaf = 0;
+        // A node over a single primitive has it as both children
+        const auto child_count = node.left == node.right ? 1 : 2;
+        for (int i = 0; i < child_count; i++) {
+            const auto& child = i == 0 ? node.left : node.right;
+            if (is_node(child)) {
+                stats.sah_cost += reached;
+                walk(static_cast<const bvh_node&>(*child), depth + 1, root_area, primitives,
+                    stats, overlap_area, internal_area);
+            } else {
+                aabb child_box;
+                child->bounding_box(0, 0, child_box);
+                const auto c = cost(*child);
+                stats.sah_cost += reached * c;
+                stats.primitives.push_back({child.get(), child_box.surface_area(), c, reached * c});
+                in_leaf++;
+            }
+        }
+
+        if (is_node(node.left) || is_node(node.right)) {
+            aabb left_box;
+            aabb right_box;
+            node.left->bounding_box(0, 0, left_box);
+            node.right->bounding_box(0, 0, right_box);
+            overlap_area += enclosed_box(left_box, right_box).surface_area();
+            internal_area += area;
+        } else {
+            stats.leaves++;
+            add(stats.leaf_depths, depth);
+            add(stats.leaf_sizes, in_leaf);
+        }
+    }
+
+    static void add(std::vector<int>& histogram, int i) {
+        if (static_cast<int>(histogram.size()) <= i) {
+            histogram.resize(i + 1);
+        }
+        histogram[i]++;
+    }
+
+    // Reports on the BVHs in h, which is on the given path below the world
+    void nested(const hittable& h, const std::string& path) {
+        const auto inside = [&] (const hittable& child) {
+            nested(child, path + " > " + type_name(child));
+        };
+        if (const auto node = dynamic_cast<const bvh_node*>(&h)) {
+            const auto stats = analyze(*node, {});
+            print(path, stats);
+            for (const auto& p : stats.primitives) {
+                nested(*p.object, path + " > " + type_name(*p.object));
+            }
+        } else if (const auto list = dynamic_cast<const hittable_list*>(&h)) {
+            for (const auto& object : list->objects) {
+                inside(*object);
+            }
+        } else if (const auto t = dynamic_cast<const translate*>(&h)) {
+            inside(*t->child);
+        } else if (const auto r = dynamic_cast<const rotate_y*>(&h)) {
+            inside(*r->child);
+        } else if (const auto m = dynamic_cast<const constant_medium*>(&h)) {
+            inside(*m->boundary);
+        }
+    }
+
+    void print(const std::string& name, const statistics& stats) {
+        out << std::fixed << std::setprecision(2) << name << ": " << stats.nodes << " nodes, "
+            << stats.leaves << " leaves, " << stats.primitives.size() << " primitives, "
+            << stats.bytes / 1024.0 << " KiB of nodes\n";
+        out << "  SAH cost " << stats.sah_cost << " tests per ray, " << stats.list_cost
+            << " without the BVH, sibling overlap " << 100 * stats.overlap << "%\n";
+
+        if (!stats.leaf_depths.empty()) {
+            auto first = 0;
+            while (stats.leaf_depths[first] == 0) {
+                first++;
+            }
+            auto sum = 0.0;
+            for (size_t d = 0; d < stats.leaf_depths.size(); d++) {
+                sum += 1.0 * d * stats.leaf_depths[d];
+            }
+            out << "  Leaf depth " << first << " to " << stats.leaf_depths.size() - 1
+                << ", mean " << sum / stats.leaves << ":";
+            for (size_t d = first; d < stats.leaf_depths.size(); d++) {
+                out << ' ' << stats.leaf_depths[d];
+            }
+            out << "\n  Primitives per leaf:";
+            for (size_t n = 1; n < stats.leaf_sizes.size(); n++) {
+                out << ' ' << n << ": " << stats.leaf_sizes[n];
+            }
+            out << '\n';
+        }
+
+        out << "  Largest primitives (surface area of their box, cost, share of the SAH cost):\n";
+        const auto n = std::min<size_t>(largest, stats.primitives.size());
+        for (size_t i = 0; i < n; i++) {
+            const auto& p = stats.primitives[i];
+            out << "    " << std::setw(24) << std::left << type_name(*p.object) << std::right
+                << std::setw(14) << std::setprecision(0) << p.area << std::setw(10)
+                << std::setprecision(2) << p.cost << std::setw(8) << std::setprecision(1)
+                << 100 * p.share << "%\n";
+        }
+    }
+
+    static std::string type_name(const hittable& h) {
+        const char* name = typeid(h).name();
+#if defined(__GNUG__)
+        int status;
+        std::unique_ptr<char, void (*)(void*)> demangled{
+            abi::__cxa_demangle(name, nullptr, nullptr, &status), std::free};
+        if (status == 0) {
+            return demangled.get();
+        }
+#endif
+        return name;
+    }
+};
@@ -30,6 +30,7 @@ public:
         lower_left_corner = origin - horizontal / 2 - vertical / 2 - focus_distance * w;
 
         lens_radius = aperture / 2;
+        focus = focus_distance;
     }
 
     ray get_ray(double s, double t) const {
@@ -42,6 +43,37 @@ public:
         };
     }
 
+    // A point on the lens, where get_ray() starts its rays
+    point3 random_lens_point() const {
+        auto rd = lens_radius * random_in_unit_disk();
+        return origin + u * rd.x() + v * rd.y();
+    }
+
+    // Sets s and t to the viewport coordinates get_ray() would be called with for a ray from
+    // lens_point through p. Returns false when p isn't in front of the camera.
+    bool viewport_coordinates(const point3& lens_point, const point3& p, double& s, double& t) const {
+        const auto d = p - lens_point;
+        const auto depth = -dot(d, w);
+        if (depth <= 0) {
+            return false;
+        }
+        const auto on_viewport = lens_point + (focus / depth) * d - lower_left_corner;
+        s = dot(on_viewport, horizontal) / horizontal.length_squared();
+        t = dot(on_viewport, vertical) / vertical.length_squared();
+        return true;
+    }
+
+    // Area of the part of the viewport between 0 and 1 in s and t, scaled to a distance of 1
+    // from the lens
+    double unit_viewport_area() const {
+        return horizontal.length() * vertical.length() / (focus * focus);
+    }
+
+    // Cosine of the angle between direction and the viewing direction
+    double cos_theta(const vec3& direction) const {
+        return -dot(direction.normalized(), w);
+    }
+
 private:
     point3 origin;
     point3 lower_left_corner;
@@ -49,4 +81,5 @@ private:
     vec3 vertical;
     vec3 u, v, w;
     double lens_radius;
+    double focus;
 };
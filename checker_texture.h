@@ -30,6 +30,10 @@ public:
         }
     }
 
+    bool uses_uv() const override {
+        return even->uses_uv() || odd->uses_uv();
+    }
+
     std::shared_ptr<texture> even;
     std::shared_ptr<texture> odd;
     double frequency;
@@ -59,6 +59,7 @@ public:
         rec.normal = vec3{1, 0, 0}; // unused
         rec.front_face = true; // unused
         rec.material = phase_function;
+        rec.object = this;
 
         return true;
     }
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+
+#include "./color.h"
+
+// Counts of the work rendering does, kept per thread. They are only counted when compiled with
+// -DRENDER_COUNTERS (make counters); otherwise count() compiles to nothing.
+#if defined(RENDER_COUNTERS)
+constexpr bool counters_enabled = true;
+#else
+constexpr bool counters_enabled = false;
+#endif
+
+struct render_counters {
+    long long samples = 0;
+    // Visits of bvh_node::hit() and occluded()
+    long long bvh_nodes = 0;
+    // Intersection tests of spheres and rectangles, and how many of them hit
+    long long primitive_tests = 0;
+    long long primitive_hits = 0;
+    // Hits shaded along paths, from the camera and, in bidirectional mode, from the lights
+    long long vertices = 0;
+    long long shadow_rays = 0;
+    long long diffuse_scatters = 0;
+    long long specular_scatters = 0;
+
+    render_counters& operator+=(const render_counters& other) {
+        samples += other.samples;
+        bvh_nodes += other.bvh_nodes;
+        primitive_tests += other.primitive_tests;
+        primitive_hits += other.primitive_hits;
+        vertices += other.vertices;
+        shadow_rays += other.shadow_rays;
+        diffuse_scatters += other.diffuse_scatters;
+        specular_scatters += other.specular_scatters;
+        return *this;
+    }
+
+    // Traversal steps, nodes visited and primitives tested
+    long long traversal() const {
+        return bvh_nodes + primitive_tests;
+    }
+
+    void report(std::ostream& out) const {
+        const auto per = [] (long long n, long long d) { return d > 0 ? 1.0 * n / d : 0.0; };
+        out << "Counters: " << samples << " samples, " << vertices << " vertices ("
+            << per(vertices, samples) << " per sample), " << shadow_rays << " shadow rays\n"
+            << "  " << per(bvh_nodes, vertices + shadow_rays) << " BVH nodes and "
+            << per(primitive_tests, vertices + shadow_rays)
+            << " primitive tests per vertex or shadow ray, "
+            << 100 * per(primitive_tests - primitive_hits, primitive_tests)
+            << "% of the tests missed\n"
+            << "  " << diffuse_scatters << " diffuse and " << specular_scatters
+            << " specular scatters\n";
+    }
+};
+
+inline render_counters& thread_counters() {
+    static thread_local render_counters counters;
+    return counters;
+}
+
+// Adds n to a counter of the calling thread, like count(&render_counters::vertices)
+inline void count(long long render_counters::* counter, long long n = 1) {
+    if constexpr (counters_enabled) {
+        thread_counters().*counter += n;
+    }
+}
+
+// Counts an intersection test of a primitive, passing on whether it hit
+inline bool count_test(bool hit) {
+    if constexpr (counters_enabled) {
+        thread_counters().primitive_tests++;
+        thread_counters().primitive_hits += hit;
+    }
+    return hit;
+}
+
+// Adds the calling thread's counts to total and starts them over
+inline void flush_counters(render_counters& total) {
+    if constexpr (counters_enabled) {
+        static std::mutex mutex;
+        std::scoped_lock lock(mutex);
+        total += thread_counters();
+        thread_counters() = render_counters{};
+    }
+}
+
+// Color for t between 0 and 1 in a heatmap: black, blue, red, yellow, white
+inline color heat(double t) {
+    static const color stops[] = {
+        {0, 0, 0}, {0.1, 0.1, 0.8}, {0.9, 0.1, 0.1}, {1, 0.9, 0.1}, {1, 1, 1}
+    };
+    const auto x = std::clamp(t, 0.0, 1.0) * 4;
+    const auto i = std::min(3, static_cast<int>(x));
+    return stops[i] + (x - i) * (stops[i + 1] - stops[i]);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// The hot kernels are compiled for several x86-64 levels in the same binary, marked with
+// RENDER_KERNEL. When the program starts, the loader uses CPUID to pick the best version each
+// kernel has for the CPU (target_clones, through GNU indirect functions). One binary thus
+// uses AVX2 and FMA, or AVX-512, where the CPU has them, and still runs on any x86-64.
+// Calls to a kernel go through a pointer, which costs more than wider instructions save in
+// something as small as one sphere test, so only kernels that do more per call are marked:
+// whole BVH traversals, turbulence, rows of the denoiser.
+// This needs GCC 12 or later on x86-64 Linux. Elsewhere, or when built with
+// -DRENDER_NO_DISPATCH, the kernels are compiled once for the build's target.
+#if defined(__x86_64__) && defined(__gnu_linux__) && defined(__GNUC__) && !defined(__clang__) \
+    && __GNUC__ >= 12 && !defined(RENDER_NO_DISPATCH)
+#define RENDER_DISPATCH 1
+#define RENDER_KERNEL __attribute__((target_clones("default", "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+#define RENDER_DISPATCH 0
+#define RENDER_KERNEL
+#endif
+
+// Which versions of the kernels run on this CPU, for reports
+inline const char* kernel_isa() {
+#if RENDER_DISPATCH
+    // What the loader checks to pick a version
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v4")) {
+        return "x86-64-v4 (AVX-512)";
+    }
+    if (__builtin_cpu_supports("x86-64-v3")) {
+        return "x86-64-v3 (AVX2, FMA)";
+    }
+    return "x86-64 (SSE2)";
+#else
+    return "build target (no dispatch)";
+#endif
+}
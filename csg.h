@@ -8,6 +8,15 @@ inline bool get_interval(
     const hittable& h, const ray& r, double t_min, double t_max, interval& interval
 );
 
+// Completes rec, found on an operand, as a hit on csg. The side it was given is kept, as the
+// surfaces of a subtracted operand are hit from the other side.
+inline void complete_operand(const hittable& csg, const ray& r, hit_record& rec) {
+    const auto front_face = rec.front_face;
+    rec.object->complete(r, rec);
+    rec.front_face = front_face;
+    rec.object = &csg;
+}
+
 class difference : public hittable {
 public:
     // a - b
@@ -16,16 +25,23 @@ public:
     ) : a(a_), b(b_) {}
 
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        auto a_intervals = get_intervals(r, *a);
-        auto b_intervals = get_intervals(r, *b);
-        auto intervals = set_difference(a_intervals, b_intervals);
+        auto intervals = get_intervals(r, *a);
+        // Nothing is removed from a when the ray misses b's bounds
+        aabb box_b;
+        if (!intervals.empty()
+          && (!b->bounding_box(0, 1, box_b) || box_b.hit(r, t_min, t_max))
+        ) {
+            intervals = set_difference(intervals, get_intervals(r, *b));
+        }
         for (const interval& interval : intervals) {
             if (t_min < interval.first.t && interval.first.t < t_max) {
                 rec = interval.first;
+                complete_operand(*this, r, rec);
                 return true;
             }
             if (t_min < interval.second.t && interval.second.t < t_max) {
                 rec = interval.second;
+                complete_operand(*this, r, rec);
                 return true;
             }
         }
@@ -142,10 +158,12 @@ public:
             if (first.t < second.t) {
                 if (t_min < first.t && first.t < t_max) {
                     rec = first;
+                    complete_operand(*this, r, rec);
                     return true;
                 }
                 if (t_min < second.t && second.t < t_max) {
                     rec = second;
+                    complete_operand(*this, r, rec);
                     return true;
                 }
             }
@@ -162,9 +180,11 @@ public:
         return has_box;
     }
 
-private:
+public:
     const std::shared_ptr<hittable> a;
     const std::shared_ptr<hittable> b;
+
+private:
     aabb box;
     bool has_box;
 };
@@ -192,24 +212,29 @@ public:
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
         hit_record rec_a;
         hit_record rec_b;
+        // Leaves rec alone when the hit is beyond t_max
+        auto accept = [&](const hit_record& found) {
+            if (found.t >= t_max) {
+                return false;
+            }
+            rec = found;
+            complete_operand(*this, r, rec);
+            return true;
+        };
         
         bool hit_a = a->hit(r, t_min, infinity, rec_a);
         bool hit_b = b->hit(r, t_min, infinity, rec_b);
 
         while (hit_a || hit_b) {
             if (!hit_b) {
-                rec = rec_a;
-                return true;
+                return accept(rec_a);
             } else if (!hit_a) {
-                rec = rec_b;
-                return rec.t < t_max;
+                return accept(rec_b);
             } else { // both hit
                 if (rec_a.front_face && rec_b.front_face) {
-                    rec = rec_a.t < rec_b.t ? rec_a : rec_b;
-                    return rec.t < t_max;
+                    return accept(rec_a.t < rec_b.t ? rec_a : rec_b);
                 } else if (!rec_a.front_face && !rec_b.front_face) {
-                    rec = rec_a.t > rec_b.t ? rec_a : rec_b;
-                    return rec.t < t_max;
+                    return accept(rec_a.t > rec_b.t ? rec_a : rec_b);
                 } else {
                     // inside
                     if (rec_a.front_face) { 
@@ -221,8 +246,7 @@ public:
                                 hit_a = a->hit(r, rec_a.t + 0.0001, infinity, rec_a);
                             }
                         } else {
-                            rec = rec_b;
-                            return rec.t < t_max;
+                            return accept(rec_b);
                         }
                     } else { // rec_b.front_face
                         if (rec_b.t < rec_a.t) {
@@ -233,8 +257,7 @@ public:
                                 hit_b = b->hit(r, rec_b.t + 0.0001, infinity, rec_b);
                             }
                         } else {
-                            rec = rec_a;
-                            return rec.t < t_max;
+                            return accept(rec_a);
                         }
                     }
                 }
@@ -248,9 +271,11 @@ public:
         return has_box;
     }
 
-private:
+public:
     const std::shared_ptr<hittable> a;
     const std::shared_ptr<hittable> b;
+
+private:
     aabb box;
     bool has_box;
 };
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "./csg.h"
+
+enum class csg_op { leaf, fusion, intersection, difference };
+
+// A CSG tree as written in a scene, before it is compiled. Fusions and intersections take
+// any number of operands. A difference subtracts all its other operands from the first one.
+struct csg_node {
+    csg_op op;
+    std::shared_ptr<hittable> leaf;
+    std::vector<csg_node> operands;
+};
+
+inline csg_node csg_leaf(std::shared_ptr<hittable> object) {
+    return csg_node{csg_op::leaf, object, {}};
+}
+
+inline csg_node csg_fusion(std::vector<csg_node> operands) {
+    return csg_node{csg_op::fusion, nullptr, operands};
+}
+
+inline csg_node csg_intersection(std::vector<csg_node> operands) {
+    return csg_node{csg_op::intersection, nullptr, operands};
+}
+
+// operands[0] - operands[1] - ... - operands[n - 1]
+inline csg_node csg_difference(std::vector<csg_node> operands) {
+    return csg_node{csg_op::difference, nullptr, operands};
+}
+
+// Converts a tree of difference, intersection and fusion objects into a csg_node. Nested
+// fusions and intersections are merged into a single n-ary node, and so are chains of
+// differences: (a - b) - c becomes a - b - c.
+csg_node csg_tree(const std::shared_ptr<hittable>& object) {
+    auto merge = [](csg_op op, csg_node node, std::vector<csg_node>& operands) {
+        if (node.op == op) {
+            operands.insert(operands.end(), node.operands.begin(), node.operands.end());
+        } else {
+            operands.push_back(node);
+        }
+    };
+
+    if (auto d = std::dynamic_pointer_cast<difference>(object)) {
+        std::vector<csg_node> operands;
+        merge(csg_op::difference, csg_tree(d->a), operands);
+        operands.push_back(csg_tree(d->b));
+        return csg_difference(operands);
+    }
+    if (auto i = std::dynamic_pointer_cast<intersection>(object)) {
+        std::vector<csg_node> operands;
+        merge(csg_op::intersection, csg_tree(i->a), operands);
+        merge(csg_op::intersection, csg_tree(i->b), operands);
+        return csg_intersection(operands);
+    }
+    if (auto f = std::dynamic_pointer_cast<fusion>(object)) {
+        std::vector<csg_node> operands;
+        merge(csg_op::fusion, csg_tree(f->a), operands);
+        merge(csg_op::fusion, csg_tree(f->b), operands);
+        return csg_fusion(operands);
+    }
+    return csg_leaf(object);
+}
+
+// A CSG tree flattened into a program: the nodes are stored in pre-order in one array and
+// every node has a bounding box, clipped to the region where the node can still affect the
+// result. Subtrees whose box the ray misses are skipped, as are the remaining operands of
+// an intersection or difference once the result is known to be empty. Intervals are merged
+// in buffers kept per thread, one pair per level of the program, and hold only where the
+// ray crosses a surface; the hit record is made once, for the crossing that is returned.
+class compiled_csg : public hittable {
+public:
+    compiled_csg(const csg_node& root) {
+        aabb unbounded{
+            point3{-infinity, -infinity, -infinity},
+            point3{infinity, infinity, infinity}
+        };
+        compile(root, unbounded);
+        levels = levels_used(0);
+    }
+
+    // Compiles a tree of difference, intersection and fusion objects
+    compiled_csg(const std::shared_ptr<hittable>& object) : compiled_csg(csg_tree(object)) {}
+
+    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        crossing closest;
+        if (!closest_crossing(r, t_min, t_max, closest)) {
+            return false;
+        }
+        // The leaf finds the crossing again, the same way, this time for its whole record
+        rec = hit_record{};
+        if (!closest.leaf->hit(r, closest.leaf_t_min, t_max, rec)) {
+            return false;
+        }
+        rec.front_face = closest.front_face;
+        complete_operand(*this, r, rec);
+        return true;
+    }
+
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        crossing closest;
+        return closest_crossing(r, t_min, t_max, closest);
+    }
+
+    bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        if (program[0].empty) {
+            output_box = empty_box();
+            return true;
+        }
+        output_box = program[0].box;
+        return is_bounded(program[0].box);
+    }
+
+private:
+    struct instruction {
+        csg_op op;
+        const hittable* leaf;
+        size_t end; // index one past the last instruction of this subtree
+        aabb box;
+        bool empty; // the subtree can't contribute anything to the result
+    };
+
+    // Where the ray crosses the surface of a leaf
+    struct crossing {
+        double t;
+        bool front_face;
+        const hittable* leaf;
+        double leaf_t_min; // the t_min of the leaf's hit() that found it
+    };
+
+    struct span {
+        crossing first;
+        crossing second;
+    };
+
+    // Buffers for evaluate(): a result and a spare one to merge into, per level. Leaves that
+    // are compiled_csg objects themselves take the levels after those of the program around.
+    struct scratch {
+        std::deque<std::vector<span>> buffers;
+        size_t used = 0;
+    };
+
+    static scratch& thread_scratch() {
+        static thread_local scratch s;
+        return s;
+    }
+
+    std::vector<instruction> program;
+    std::vector<std::shared_ptr<hittable>> leaves; // keeps the leaves alive
+    size_t levels = 1; // of buffers evaluate() uses
+
+    // Appends node and its operands to the program. Only the part of node inside clip can
+    // change the result.
+    void compile(const csg_node& node, const aabb& clip) {
+        auto index = program.size();
+        program.push_back(instruction{node.op, node.leaf.get(), 0, clip, false});
+
+        if (node.op == csg_op::leaf) {
+            leaves.push_back(node.leaf);
+            aabb leaf_box;
+            if (node.leaf->bounding_box(0, 1, leaf_box)) {
+                program[index].box = enclosed_box(leaf_box, clip);
+            }
+        } else if (node.operands.empty()) {
+            program[index].empty = true;
+        } else if (node.op == csg_op::fusion) {
+            auto box = empty_box();
+            for (const auto& operand : node.operands) {
+                auto operand_index = program.size();
+                compile(operand, clip);
+                if (!program[operand_index].empty) {
+                    box = surrounding_box(box, program[operand_index].box);
+                }
+            }
+            program[index].box = enclosed_box(box, clip);
+        } else if (node.op == csg_op::intersection) {
+            // Each operand's box bounds the whole intersection. The operands are compiled
+            // clipped to the tightest one.
+            auto box = clip;
+            for (const auto& operand : node.operands) {
+                box = enclosed_box(box, bound(operand, clip));
+            }
+            program[index].box = box;
+            for (const auto& operand : node.operands) {
+                compile(operand, box);
+            }
+        } else { // difference
+            auto first_index = program.size();
+            compile(node.operands[0], clip);
+            // Points outside the first operand are never part of the result
+            const auto box = program[first_index].box;
+            program[index].box = box;
+            for (size_t i = 1; i < node.operands.size(); i++) {
+                compile(node.operands[i], box);
+            }
+        }
+
+        if (is_empty(program[index].box)) {
+            program[index].empty = true;
+        }
+        if (node.op == csg_op::difference && program[index + 1].empty) {
+            program[index].empty = true;
+        }
+        program[index].end = program.size();
+    }
+
+    // The box compile() gives node, or an empty box when node can't contribute anything,
+    // without compiling it
+    static aabb bound(const csg_node& node, const aabb& clip) {
+        auto box = clip;
+        if (node.op == csg_op::leaf) {
+            aabb leaf_box;
+            if (node.leaf->bounding_box(0, 1, leaf_box)) {
+                box = enclosed_box(leaf_box, clip);
+            }
+        } else if (node.operands.empty()) {
+            return empty_box();
+        } else if (node.op == csg_op::fusion) {
+            box = empty_box();
+            for (const auto& operand : node.operands) {
+                const auto operand_box = bound(operand, clip);
+                if (!is_empty(operand_box)) {
+                    box = surrounding_box(box, operand_box);
+                }
+            }
+            box = enclosed_box(box, clip);
+        } else if (node.op == csg_op::intersection) {
+            for (const auto& operand : node.operands) {
+                box = enclosed_box(box, bound(operand, clip));
+            }
+        } else { // difference
+            box = bound(node.operands[0], clip);
+        }
+        return is_empty(box) ? empty_box() : box;
+    }
+
+    // Levels of buffers evaluate() uses for the subtree starting at program[index]. The first
+    // operand is evaluated into the buffer of its node, the others into the next level.
+    size_t levels_used(size_t index) const {
+        const auto& ins = program[index];
+        if (ins.op == csg_op::leaf || index + 1 == ins.end) {
+            return 1;
+        }
+        auto result = levels_used(index + 1);
+        for (auto operand = program[index + 1].end; operand < ins.end;
+             operand = program[operand].end) {
+            result = std::max(result, 1 + levels_used(operand));
+        }
+        return result;
+    }
+
+    // Finds the first crossing of the ray in (t_min, t_max) into or out of the result
+    bool closest_crossing(const ray& r, double t_min, double t_max, crossing& closest) const {
+        auto& s = thread_scratch();
+        const auto base = s.used;
+        s.used += 2 * levels;
+        if (s.buffers.size() < s.used) {
+            s.buffers.resize(s.used);
+        }
+        evaluate(0, r, t_min, t_max, s.buffers, base);
+
+        auto found = false;
+        for (const auto& interval : s.buffers[base]) {
+            if (t_min < interval.first.t && interval.first.t < t_max) {
+                closest = interval.first;
+                found = true;
+                break;
+            }
+            if (t_min < interval.second.t && interval.second.t < t_max) {
+                closest = interval.second;
+                found = true;
+                break;
+            }
+        }
+        s.used = base;
+        return found;
+    }
+
+    // Sets buffers[at] to the sorted, disjoint intervals of the ray inside the subtree starting
+    // at program[index]. It merges into buffers[at + 1], and evaluates the operands after the
+    // first into buffers[at + 2] onwards. Only intervals in (t_min, t_max) are guaranteed to
+    // be correct.
+    void evaluate(
+        size_t index, const ray& r, double t_min, double t_max,
+        std::deque<std::vector<span>>& buffers, size_t at
+    ) const {
+        const auto& ins = program[index];
+        auto& intervals = buffers[at];
+        intervals.clear();
+
+        if (ins.empty || (is_bounded(ins.box) && !ins.box.hit(r, t_min, t_max))) {
+            return;
+        }
+
+        if (ins.op == csg_op::leaf) {
+            leaf_intervals(*ins.leaf, r, t_max, intervals);
+            return;
+        }
+
+        auto operand = index + 1;
+        evaluate(operand, r, t_min, t_max, buffers, at);
+        operand = program[operand].end;
+
+        auto& merged = buffers[at + 1];
+        auto& operand_intervals = buffers[at + 2];
+        for (; operand < ins.end; operand = program[operand].end) {
+            if (intervals.empty() && ins.op != csg_op::fusion) {
+                return;
+            }
+            evaluate(operand, r, t_min, t_max, buffers, at + 2);
+            if (ins.op == csg_op::fusion) {
+                set_union(intervals, operand_intervals, merged);
+            } else if (ins.op == csg_op::intersection) {
+                set_intersection(intervals, operand_intervals, merged);
+            } else if (operand_intervals.empty()) {
+                continue;
+            } else {
+                set_difference(intervals, operand_intervals, merged);
+            }
+            intervals.swap(merged);
+        }
+    }
+
+    // Intervals of a single closed object up to t_max. An interval that is still open at
+    // t_max is closed with an exit at infinity.
+    static void leaf_intervals(
+        const hittable& object, const ray& r, double t_max, std::vector<span>& intervals
+    ) {
+        hit_record rec;
+        span current;
+        current.first = crossing{-infinity, true, nullptr, -infinity};
+        bool inside = false;
+        auto t = -infinity;
+
+        while (object.hit(r, t, t_max, rec)) {
+            const crossing found{rec.t, rec.front_face, &object, t};
+            if (rec.front_face) {
+                current.first = found;
+                inside = true;
+            } else {
+                if (!inside) {
+                    // The object wasn't entered, as seen from -infinity
+                    current.first.t = -infinity;
+                }
+                current.second = found;
+                intervals.push_back(current);
+                inside = false;
+            }
+            t = rec.t + 0.0001;
+        }
+
+        if (inside) {
+            current.second = current.first;
+            current.second.t = infinity;
+            intervals.push_back(current);
+        }
+    }
+
+    // The set operations write to result, which mustn't be a or b
+
+    static void set_union(
+        const std::vector<span>& a, const std::vector<span>& b, std::vector<span>& result
+    ) {
+        result.clear();
+        size_t i = 0;
+        size_t j = 0;
+        while (i < a.size() || j < b.size()) {
+            const auto& next = j == b.size() || (i < a.size() && a[i].first.t < b[j].first.t)
+                ? a[i++] : b[j++];
+            if (!result.empty() && next.first.t <= result.back().second.t) {
+                if (next.second.t > result.back().second.t) {
+                    result.back().second = next.second;
+                }
+            } else {
+                result.push_back(next);
+            }
+        }
+    }
+
+    static void set_intersection(
+        const std::vector<span>& a, const std::vector<span>& b, std::vector<span>& result
+    ) {
+        result.clear();
+        size_t i = 0;
+        size_t j = 0;
+        while (i < a.size() && j < b.size()) {
+            const auto& first = a[i].first.t > b[j].first.t ? a[i].first : b[j].first;
+            const auto& second = a[i].second.t < b[j].second.t ? a[i].second : b[j].second;
+            if (first.t < second.t) {
+                result.push_back(span{first, second});
+            }
+            if (a[i].second.t < b[j].second.t) {
+                i++;
+            } else {
+                j++;
+            }
+        }
+    }
+
+    // The crossings taken from b face the other way in the result
+    static void set_difference(
+        const std::vector<span>& a, const std::vector<span>& b, std::vector<span>& result
+    ) {
+        result.clear();
+        size_t j = 0;
+        for (const auto& a_interval : a) {
+            auto start = a_interval.first;
+            const auto& end = a_interval.second;
+
+            while (j < b.size() && b[j].second.t < start.t) {
+                j++;
+            }
+            for (auto k = j; k < b.size() && b[k].first.t < end.t; k++) {
+                if (b[k].first.t > start.t) {
+                    auto local_end = b[k].first;
+                    local_end.front_face = !local_end.front_face;
+                    result.push_back(span{start, local_end});
+                }
+                if (b[k].second.t > start.t) {
+                    start = b[k].second;
+                    start.front_face = !start.front_face;
+                }
+            }
+
+            if (end.t > start.t) {
+                result.push_back(span{start, end});
+            }
+        }
+    }
+
+    static aabb empty_box() {
+        return aabb{
+            point3{infinity, infinity, infinity},
+            point3{-infinity, -infinity, -infinity}
+        };
+    }
+
+    static bool is_empty(const aabb& box) {
+        return box.min().x() >= box.max().x()
+            || box.min().y() >= box.max().y()
+            || box.min().z() >= box.max().z();
+    }
+
+    static bool is_bounded(const aabb& box) {
+        for (int i = 0; i < 3; i++) {
+            if (std::isinf(box.min()[i]) || std::isinf(box.max()[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
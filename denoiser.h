@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "./color.h"
+#include "./cpu_dispatch.h"
+#include "./thread_pool.h"
+#include "./vec3.h"
+
+// What a pixel's camera rays first see, averaged over its samples. Mirrors and glass are
+// looked through, so the features are those of what they show.
+struct pixel_features {
+    color albedo;
+    vec3 normal;
+    double depth = 0;
+};
+
+// Adds to a pixel's features what a sample's path first sees, told vertex by vertex by the
+// integrator as it traces the path, so the features cost no rays of their own
+struct feature_path {
+    pixel_features& features;
+    // Of the mirrors and glass on the way
+    color tint{1, 1, 1};
+    double distance = 0;
+    bool done = false;
+
+    // Looking through a mirror or glass, length from the vertex before
+    void pass(double length, const color& attenuation) {
+        distance += length;
+        tint = tint * attenuation;
+    }
+
+    // A surface the path scatters from, or a medium, whose normal is random
+    void scatter(double length, const color& albedo, const vec3& normal, bool volumetric) {
+        features.albedo += tint * albedo;
+        if (!volumetric) {
+            features.normal += normal;
+        }
+        features.depth += distance + length;
+        done = true;
+    }
+
+    // A surface that doesn't scatter, like a light
+    void stop(double length, const vec3& normal) {
+        features.normal += normal;
+        features.depth += distance + length;
+        end();
+    }
+
+    // Nothing more is seen: the background, which is as bright as it is, like a light
+    void end() {
+        if (!done) {
+            features.albedo += tint;
+            done = true;
+        }
+    }
+};
+
+// Removes noise from a rendered image with an edge-avoiding a-trous wavelet filter (Dammertz
+// et al.): repeated 5x5 blurs with the taps spread twice as far each time. Neighbours count
+// less the more their albedo, normal and depth differ, and the more their color differs
+// relative to the noise estimated for the pixels (as in SVGF). Lighting is filtered without
+// the albedo, so textures stay sharp. Four pixels of a row are filtered at once with SSE2.
+class denoiser {
+public:
+    // radiance and variance are per pixel means, and the variance of the mean of the
+    // luminance, row after row
+    denoiser(
+        int _width, int _height, const std::vector<color>& radiance,
+        const std::vector<double>& variance, const std::vector<pixel_features>& features
+    ) : width(_width), height(_height)
+    {
+        const auto size = static_cast<size_t>(width) * height;
+        for (auto* plane : {&light, &albedo, &normal}) {
+            for (auto& channel : *plane) {
+                channel.resize(size);
+            }
+        }
+        this->variance.resize(size);
+        depth.resize(size);
+
+        for (size_t p = 0; p < size; p++) {
+            auto modulation = 0.0;
+            for (int c = 0; c < 3; c++) {
+                albedo[c][p] = static_cast<float>(features[p].albedo[c]);
+                // Black surfaces keep their color, it can't be divided by their albedo
+                const auto a = albedo[c][p] > min_albedo ? albedo[c][p] : 1.0f;
+                light[c][p] = static_cast<float>(radiance[p][c] / a);
+                normal[c][p] = static_cast<float>(features[p].normal[c]);
+                modulation += a / 3;
+            }
+            this->variance[p] = static_cast<float>(variance[p] / (modulation * modulation));
+            depth[p] = static_cast<float>(features[p].depth);
+        }
+    }
+
+    // The filtered image, row after row. Runs on workers' threads when given.
+    std::vector<color> run(int iterations, int thread_count, worker_threads* workers = nullptr) {
+        std::vector<int> rows(height);
+        for (int j = 0; j < height; j++) {
+            rows[j] = j;
+        }
+
+        auto next_light = light;
+        auto next_variance = variance;
+        for (int i = 0; i < iterations; i++) {
+            const auto step = 1 << i;
+            pool<int>{
+                rows,
+                [&] (int j) { filter_row(j, step, next_light, next_variance); },
+                [] (int) {}
+            }.run(workers, thread_count);
+            std::swap(light, next_light);
+            std::swap(variance, next_variance);
+        }
+
+        std::vector<color> image(static_cast<size_t>(width) * height);
+        for (size_t p = 0; p < image.size(); p++) {
+            for (int c = 0; c < 3; c++) {
+                const auto a = albedo[c][p] > min_albedo ? albedo[c][p] : 1.0f;
+                image[p][c] = light[c][p] * a;
+            }
+        }
+        return image;
+    }
+
+private:
+    using planes = std::array<std::vector<float>, 3>;
+
+    // B3 spline, the weights of the taps along each axis
+    static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    // How many standard deviations of noise a color difference may be
+    static constexpr float sigma_color = 4;
+    static constexpr float sigma_normal = 0.15f;
+    static constexpr float sigma_albedo = 0.1f;
+    // Relative depth difference per step
+    static constexpr float sigma_depth = 0.05f;
+    static constexpr float min_albedo = 0.01f;
+
+    int width;
+    int height;
+    planes light;
+    std::vector<float> variance;
+    planes albedo;
+    planes normal;
+    std::vector<float> depth;
+
+    RENDER_KERNEL
+    void filter_row(int j, int step, planes& out, std::vector<float>& out_variance) const {
+        int i = 0;
+#if defined(__SSE2__)
+        // Taps of the first and last pixels of the row fall outside the image
+        for (; i < width && i - 2 * step < 0; i++) {
+            filter_pixel(i, j, step, out, out_variance);
+        }
+        for (; i + 3 + 2 * step < width; i += 4) {
+            filter_pixels4(i, j, step, out, out_variance);
+        }
+#endif
+        for (; i < width; i++) {
+            filter_pixel(i, j, step, out, out_variance);
+        }
+    }
+
+    void filter_pixel(int i, int j, int step, planes& out, std::vector<float>& out_variance) const {
+        const auto p = static_cast<size_t>(j) * width + i;
+        const auto luminance_p = (light[0][p] + light[1][p] + light[2][p]) / 3;
+        float sum[3] = {0, 0, 0};
+        auto weights = 0.0f;
+        auto variance_sum = 0.0f;
+        for (int dy = -2; dy <= 2; dy++) {
+            const auto y = j + dy * step;
+            if (y < 0 || y >= height) {
+                continue;
+            }
+            for (int dx = -2; dx <= 2; dx++) {
+                const auto x = i + dx * step;
+                if (x < 0 || x >= width) {
+                    continue;
+                }
+                const auto q = static_cast<size_t>(y) * width + x;
+                const auto luminance = luminance_p - (light[0][q] + light[1][q] + light[2][q]) / 3;
+                auto exponent = luminance * luminance
+                    / (sigma_color * sigma_color * (variance[p] + variance[q]) + 1e-10f);
+                for (int c = 0; c < 3; c++) {
+                    const auto dn = normal[c][p] - normal[c][q];
+                    const auto da = albedo[c][p] - albedo[c][q];
+                    exponent += dn * dn / (sigma_normal * sigma_normal)
+                        + da * da / (sigma_albedo * sigma_albedo);
+                }
+                exponent += std::abs(depth[p] - depth[q])
+                    / (sigma_depth * step * std::max(depth[p], depth[q]) + 1e-10f);
+
+                const auto w = kernel[dx + 2] * kernel[dy + 2] * std::exp(-exponent);
+                for (int c = 0; c < 3; c++) {
+                    sum[c] += w * light[c][q];
+                }
+                weights += w;
+                variance_sum += w * w * variance[q];
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            out[c][p] = sum[c] / weights;
+        }
+        out_variance[p] = variance_sum / (weights * weights);
+    }
+
+#if defined(__SSE2__)
+    // exp(x) for x <= 0, to about single precision: 2^x split into a power of two put in the
+    // exponent bits and a polynomial for the fraction
+    static __m128 exp4(__m128 x) {
+        x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+        const auto t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+        auto whole = _mm_cvttps_epi32(t);
+        auto floor = _mm_cvtepi32_ps(whole);
+        // Truncation rounds negative numbers up
+        const auto above = _mm_cmpgt_ps(floor, t);
+        floor = _mm_sub_ps(floor, _mm_and_ps(above, _mm_set1_ps(1.0f)));
+        whole = _mm_add_epi32(whole, _mm_castps_si128(above)); // adds -1 where above
+        const auto f = _mm_sub_ps(t, floor);
+
+        auto poly = _mm_set1_ps(0.001333355f);
+        poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.009618129f));
+        poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.05550411f));
+        poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.2402265f));
+        poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.6931472f));
+        poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(1.0f));
+
+        const auto scale = _mm_castsi128_ps(
+            _mm_slli_epi32(_mm_add_epi32(whole, _mm_set1_epi32(127)), 23));
+        return _mm_mul_ps(poly, scale);
+    }
+
+    static __m128 luminance4(const planes& light, size_t p) {
+        const auto sum = _mm_add_ps(
+            _mm_add_ps(_mm_loadu_ps(&light[0][p]), _mm_loadu_ps(&light[1][p])),
+            _mm_loadu_ps(&light[2][p]));
+        return _mm_mul_ps(sum, _mm_set1_ps(1.0f / 3));
+    }
+
+    // filter_pixel() for pixels i to i + 3, whose taps are all within the row
+    void filter_pixels4(int i, int j, int step, planes& out, std::vector<float>& out_variance) const {
+        const auto p = static_cast<size_t>(j) * width + i;
+        const auto luminance_p = luminance4(light, p);
+        const auto variance_p = _mm_loadu_ps(&variance[p]);
+        const auto depth_p = _mm_loadu_ps(&depth[p]);
+        __m128 normal_p[3];
+        __m128 albedo_p[3];
+        for (int c = 0; c < 3; c++) {
+            normal_p[c] = _mm_loadu_ps(&normal[c][p]);
+            albedo_p[c] = _mm_loadu_ps(&albedo[c][p]);
+        }
+        const auto sign = _mm_set1_ps(-0.0f);
+        const auto color_scale = _mm_set1_ps(sigma_color * sigma_color);
+        const auto normal_scale = _mm_set1_ps(1 / (sigma_normal * sigma_normal));
+        const auto albedo_scale = _mm_set1_ps(1 / (sigma_albedo * sigma_albedo));
+        const auto depth_scale = _mm_set1_ps(sigma_depth * step);
+        const auto tiny = _mm_set1_ps(1e-10f);
+
+        __m128 sum[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+        auto weights = _mm_setzero_ps();
+        auto variance_sum = _mm_setzero_ps();
+        for (int dy = -2; dy <= 2; dy++) {
+            const auto y = j + dy * step;
+            if (y < 0 || y >= height) {
+                continue;
+            }
+            for (int dx = -2; dx <= 2; dx++) {
+                const auto q = static_cast<size_t>(y) * width + i + dx * step;
+                const auto variance_q = _mm_loadu_ps(&variance[q]);
+                const auto luminance = _mm_sub_ps(luminance_p, luminance4(light, q));
+                auto exponent = _mm_div_ps(
+                    _mm_mul_ps(luminance, luminance),
+                    _mm_add_ps(_mm_mul_ps(color_scale, _mm_add_ps(variance_p, variance_q)), tiny));
+                for (int c = 0; c < 3; c++) {
+                    const auto dn = _mm_sub_ps(normal_p[c], _mm_loadu_ps(&normal[c][q]));
+                    const auto da = _mm_sub_ps(albedo_p[c], _mm_loadu_ps(&albedo[c][q]));
+                    exponent = _mm_add_ps(exponent, _mm_add_ps(
+                        _mm_mul_ps(_mm_mul_ps(dn, dn), normal_scale),
+                        _mm_mul_ps(_mm_mul_ps(da, da), albedo_scale)));
+                }
+                const auto depth_q = _mm_loadu_ps(&depth[q]);
+                exponent = _mm_add_ps(exponent, _mm_div_ps(
+                    _mm_andnot_ps(sign, _mm_sub_ps(depth_p, depth_q)),
+                    _mm_add_ps(_mm_mul_ps(depth_scale, _mm_max_ps(depth_p, depth_q)), tiny)));
+
+                const auto w = _mm_mul_ps(
+                    _mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]),
+                    exp4(_mm_sub_ps(_mm_setzero_ps(), exponent)));
+                for (int c = 0; c < 3; c++) {
+                    sum[c] = _mm_add_ps(sum[c], _mm_mul_ps(w, _mm_loadu_ps(&light[c][q])));
+                }
+                weights = _mm_add_ps(weights, w);
+                variance_sum = _mm_add_ps(variance_sum, _mm_mul_ps(_mm_mul_ps(w, w), variance_q));
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            _mm_storeu_ps(&out[c][p], _mm_div_ps(sum[c], weights));
+        }
+        _mm_storeu_ps(&out_variance[p], _mm_div_ps(variance_sum, _mm_mul_ps(weights, weights)));
+    }
+#endif
+};
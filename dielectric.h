@@ -1,5 +1,6 @@
 #pragma once
 
+#include "./counters.h"
 #include "./material.h"
 #include "./hittable.h"
 
@@ -28,9 +29,14 @@ public:
         }
 
         srec.skip_pdf_ray = ray{rec.p, direction};
+        count(&render_counters::specular_scatters);
         return true;
     }
 
+    bool uses_uv() const override {
+        return false;
+    }
+
     double index_of_refraction;
 
 private:
@@ -14,12 +14,20 @@ public:
 
     color emitted(const ray& r_in, const hit_record& rec) const override {
         if (rec.front_face) {
-            return emit->value(rec.u, rec.v, rec.p);
+            return emit->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
         } else {
             return {0, 0, 0};
         }
     }
 
+    color average_emission() const override {
+        return emit->value(0.5, 0.5, point3{0, 0, 0});
+    }
+
+    bool uses_uv() const override {
+        return emit->uses_uv();
+    }
+
 public:
     std::shared_ptr<texture> emit;
 };
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./alias_table.h"
+#include "./color.h"
+#include "./timeline.h"
+#include "./utils.h"
+#include "./vec3.h"
+#include "./stb/stb_image.h"
+
+// Light arriving from infinitely far away in every direction, given by an equirectangular
+// image: the top row looks along +y, the bottom row along -y, and the columns go around the
+// y axis. Directions are sampled in proportion to the radiance of the pixel they fall in,
+// picked from an alias table over all pixels.
+class environment_light {
+public:
+    // Loads an equirectangular image, ideally a floating point one (.hdr) so bright areas
+    // like the sun keep their actual radiance. scale multiplies all of it.
+    environment_light(const std::string& filename, double scale = 1) {
+        timeline_span span{"load environment map", "file", filename};
+        int components;
+        auto data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
+        if (data == nullptr) {
+            std::cerr << "ERROR: Could not load environment map '" << filename << "'.\n";
+            width = height = 1;
+            pixels.assign(1, color{0, 0, 0});
+        } else {
+            pixels.resize(static_cast<size_t>(width) * height);
+            for (size_t i = 0; i < pixels.size(); i++) {
+                pixels[i] = scale * color{data[3 * i], data[3 * i + 1], data[3 * i + 2]};
+            }
+            stbi_image_free(data);
+        }
+        build_distribution();
+    }
+
+    // Radiance given by a function of the (unit) direction. Directions are sampled from the
+    // function evaluated at the centers of a width by height grid, so it should be smooth at
+    // that resolution.
+    environment_light(
+        std::function<color(const vec3&)> _radiance, int _width = 64, int _height = 32
+    ) : width(_width), height(_height), function(_radiance)
+    {
+        pixels.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                pixels[y * width + x] = function(direction((x + 0.5) / width, (y + 0.5) / height));
+            }
+        }
+        build_distribution();
+    }
+
+    color radiance(const vec3& direction) const {
+        if (function) {
+            return function(direction.normalized());
+        }
+        double u;
+        double v;
+        to_uv(direction, u, v);
+        return pixels[pixel(u, v)];
+    }
+
+    // Density over solid angle of sample() returning direction
+    double pdf_value(const vec3& direction) const {
+        double u;
+        double v;
+        to_uv(direction, u, v);
+        const auto sin_theta = std::sin(pi * v);
+        if (sin_theta <= 0) {
+            return 0;
+        }
+        return table.pmf(pixel(u, v)) * width * height / (2 * pi * pi * sin_theta);
+    }
+
+    // A unit vector towards the environment, sets pdf to its pdf_value()
+    vec3 sample(double& pdf) const {
+        const auto i = table.sample(random_double());
+        const auto u = (i % width + random_double()) / width;
+        const auto v = (i / width + random_double()) / height;
+        const auto sin_theta = std::sin(pi * v);
+        pdf = sin_theta > 0 ? table.pmf(i) * width * height / (2 * pi * pi * sin_theta) : 0;
+        return direction(u, v);
+    }
+
+    // Radiance averaged over all directions
+    color average_radiance() const {
+        color sum{0, 0, 0};
+        auto weights = 0.0;
+        for (int y = 0; y < height; y++) {
+            const auto sin_theta = std::sin(pi * (y + 0.5) / height);
+            for (int x = 0; x < width; x++) {
+                sum += sin_theta * pixels[y * width + x];
+            }
+            weights += sin_theta * width;
+        }
+        return sum / weights;
+    }
+
+private:
+    int width;
+    int height;
+    std::vector<color> pixels;
+    std::function<color(const vec3&)> function;
+    alias_table table;
+
+    void build_distribution() {
+        // Rows near the poles cover less solid angle
+        std::vector<double> weights(pixels.size());
+        for (int y = 0; y < height; y++) {
+            const auto sin_theta = std::sin(pi * (y + 0.5) / height);
+            for (int x = 0; x < width; x++) {
+                const auto& c = pixels[y * width + x];
+                weights[y * width + x] = sin_theta * (c.x() + c.y() + c.z());
+            }
+        }
+        table = alias_table{weights};
+    }
+
+    static vec3 direction(double u, double v) {
+        const auto phi = 2 * pi * u - pi;
+        const auto theta = pi * v;
+        return vec3{
+            std::sin(theta) * std::cos(phi),
+            std::cos(theta),
+            std::sin(theta) * std::sin(phi)
+        };
+    }
+
+    static void to_uv(const vec3& direction, double& u, double& v) {
+        const auto d = direction.normalized();
+        u = (std::atan2(d.z(), d.x()) + pi) / (2 * pi);
+        v = std::acos(std::clamp(d.y(), -1.0, 1.0)) / pi;
+    }
+
+    int pixel(double u, double v) const {
+        const auto x = std::clamp(static_cast<int>(u * width), 0, width - 1);
+        const auto y = std::clamp(static_cast<int>(v * height), 0, height - 1);
+        return y * width + x;
+    }
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "./color.h"
+
+// Sums of light per pixel, to which any thread can add at any pixel at once. For light that
+// doesn't arrive through a pixel's own camera rays, like light traced from the lights.
+class film {
+public:
+    film(int _width, int _height)
+      : width(_width), height(_height), channels(3 * static_cast<size_t>(_width) * _height)
+    {
+        for (auto& c : channels) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Adds c to pixel (i, j), ignoring pixels outside the film
+    void add(int i, int j, const color& c) {
+        if (i < 0 || i >= width || j < 0 || j >= height) {
+            return;
+        }
+        const auto index = 3 * (static_cast<size_t>(j) * width + i);
+        for (int k = 0; k < 3; k++) {
+            auto& channel = channels[index + k];
+            auto old = channel.load(std::memory_order_relaxed);
+            while (!channel.compare_exchange_weak(old, old + c[k], std::memory_order_relaxed)) {}
+        }
+    }
+
+    color at(int i, int j) const {
+        const auto index = 3 * (static_cast<size_t>(j) * width + i);
+        return color{
+            channels[index].load(std::memory_order_relaxed),
+            channels[index + 1].load(std::memory_order_relaxed),
+            channels[index + 2].load(std::memory_order_relaxed)
+        };
+    }
+
+    const int width;
+    const int height;
+
+private:
+    std::vector<std::atomic<double>> channels;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+
+#include "./hittable.h"
+#include "./material.h"
+#include "./texture.h"
+#include "./isotropic.h"
+#include "./voxel_grid.h"
+
+// Participating medium with a density that varies through space, given by a voxel grid.
+// Scattering is sampled with delta tracking against the per-brick majorants of the grid, so
+// empty bricks are skipped and sparse regions take large steps. Shadow rays aren't blocked
+// by the medium but attenuated by it, by the transmittance ratio tracking estimates, which
+// takes the same steps but weighs the light at each of them instead of stopping it.
+class heterogeneous_medium : public hittable {
+public:
+    // The density of the medium is density_scale times the density in the grid
+    heterogeneous_medium(std::shared_ptr<voxel_grid> _grid, double _density_scale, color c)
+      : grid(_grid)
+      , phase_function(std::make_shared<isotropic>(c))
+      , density_scale(_density_scale)
+    {}
+
+    heterogeneous_medium(
+        std::shared_ptr<voxel_grid> _grid, double _density_scale, std::shared_ptr<texture> a
+    ) : grid(_grid)
+      , phase_function(std::make_shared<isotropic>(a))
+      , density_scale(_density_scale)
+    {}
+
+    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        const auto ray_length = r.direction().length();
+        bool scattered = false;
+
+        grid->traverse(r, std::max(t_min, 0.0), t_max, [&](double t0, double t1, float majorant) {
+            // majorant per unit of t instead of per unit of distance
+            const auto sigma_max = density_scale * majorant * ray_length;
+            if (sigma_max <= 0) {
+                return true;
+            }
+            auto t = t0;
+            while (true) {
+                t -= std::log(1 - random_double()) / sigma_max;
+                if (t >= t1) {
+                    return true;
+                }
+                // Real collision with probability density / majorant, otherwise a null
+                // collision and tracking continues
+                if (random_double() * majorant < grid->density(r.at(t))) {
+                    rec.t = t;
+                    scattered = true;
+                    return false;
+                }
+            }
+        });
+
+        if (!scattered) {
+            return false;
+        }
+
+        rec.p = r.at(rec.t);
+        rec.normal = vec3{1, 0, 0}; // unused
+        rec.front_face = true; // unused
+        rec.material = phase_function;
+        rec.object = this;
+        return true;
+    }
+
+    bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = grid->bounds();
+        return true;
+    }
+
+    // Shadow rays pass, see transmittance()
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        return false;
+    }
+
+    void collect_media(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& media
+    ) const override {
+        media.push_back(self);
+    }
+
+    // Estimated with ratio tracking
+    double transmittance(const ray& r, double t_min, double t_max) const override {
+        const auto ray_length = r.direction().length();
+        auto transmittance = 1.0;
+
+        grid->traverse(r, std::max(t_min, 0.0), t_max, [&](double t0, double t1, float majorant) {
+            const auto sigma_max = density_scale * majorant * ray_length;
+            if (sigma_max <= 0) {
+                return true;
+            }
+            auto t = t0;
+            while (true) {
+                t -= std::log(1 - random_double()) / sigma_max;
+                if (t >= t1) {
+                    return true;
+                }
+                transmittance *= 1 - grid->density(r.at(t)) / majorant;
+                // Once little light is left, the ray goes on with half the chance and twice the
+                // light, so dense regions don't take all their steps for nothing
+                if (transmittance < 0.1) {
+                    if (random_double() < 0.5) {
+                        transmittance = 0;
+                    } else {
+                        transmittance *= 2;
+                    }
+                }
+                if (transmittance <= 0) {
+                    return false;
+                }
+            }
+        });
+
+        return std::max(transmittance, 0.0);
+    }
+
+    std::shared_ptr<voxel_grid> grid;
+    std::shared_ptr<material> phase_function;
+    double density_scale;
+};
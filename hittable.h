@@ -1,20 +1,28 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include "./aabb.h"
 #include "./ray.h"
 
 class material;
+class hittable;
 
 struct hit_record {
     point3 p;
     vec3 normal; // points "against" the ray: dot(normal, ray.direction()) < 0
     std::shared_ptr<material> material;
-    double t;
-    double u;
-    double v;
-    bool front_face;
+    double t = 0;
+    double u = 0;
+    double v = 0;
+    bool front_face = true;
+    // The hittable whose complete() fills in the rest of the record
+    const hittable* object = nullptr;
+    // Rate of change of u and v per unit of distance on the surface (the larger of the two)
+    double uv_per_unit = 0;
+    // Width in uv units of the ray footprint at p, set by the integrator for texture filtering
+    double uv_footprint = 0;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -22,11 +30,36 @@ struct hit_record {
     }
 };
 
+// Describes where and in which directions a hittable emits light, for choosing which light
+// to sample. The surface normals lie within theta_o of axis, and light leaves the surface
+// at most theta_e away from the normal.
+struct emission_bounds {
+    aabb box;
+    vec3 axis;
+    double cos_theta_o;
+    double cos_theta_e;
+    // Total emitted power, averaged over the color channels
+    double power;
+};
+
 class hittable {
 public:
+    // Only has to set t, front_face and object, and leaves rec alone on a miss. The rest is
+    // filled in by object->complete(), once, for the hit that turns out to be the closest.
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+
+    // Fills in p, the normal, uv and material of rec, a hit found by hit() along r.
+    // Hittables whose hit() already fills in everything leave this empty.
+    virtual void complete(const ray& r, hit_record& rec) const {}
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
 
+    // Whether r hits anything between t_min and t_max. Unlike hit() it may stop at any hit
+    // instead of the closest, and fills in no record, which makes it cheaper for shadow rays.
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
     virtual double pdf_value(const point3& origin, const vec3& direction) const {
         return 0;
     }
@@ -36,5 +69,39 @@ public:
         return {1, 0, 0};
     } 
 
+    // Picks a point on the surface uniformly by area, for tracing light from it: sets p, the
+    // outward normal there and the area of the whole surface. Returns false for hittables
+    // that can't.
+    virtual bool sample_surface(point3& p, vec3& normal, double& area) const {
+        return false;
+    }
+
+    // Returns false when this hittable doesn't emit light, or can't describe its emission
+    virtual bool emission(emission_bounds& bounds) const {
+        return false;
+    }
+
+    // Adds the hittables that light sampling should aim at to lights. self is the pointer
+    // this hittable is owned by; containers pass their children instead.
+    virtual void collect_emitters(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& lights
+    ) const {
+        emission_bounds bounds;
+        if (emission(bounds)) {
+            lights.push_back(self);
+        }
+    }
+
+    // Adds the media that shadow rays pass through instead of being blocked by them to media,
+    // attenuated as their transmittance() says. Like collect_emitters().
+    virtual void collect_media(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& media
+    ) const {}
+
+    // Fraction of light that passes between r.at(t_min) and r.at(t_max)
+    virtual double transmittance(const ray& r, double t_min, double t_max) const {
+        return occluded(r, t_min, t_max) ? 0 : 1;
+    }
+
     virtual ~hittable() {}
 };
@@ -16,6 +16,15 @@ public:
     bool hit(
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        for (const auto& object : objects) {
+            if (object->occluded(r, t_min, t_max)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
     double pdf_value(const point3& origin, const point3& direction) const override {
@@ -28,20 +37,34 @@ public:
         return objects[random_int(0, objects.size() - 1)]->random(origin);
     }
 
+    void collect_emitters(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& lights
+    ) const override {
+        for (const auto& object : objects) {
+            object->collect_emitters(object, lights);
+        }
+    }
+
+    void collect_media(
+        const std::shared_ptr<hittable>& self, std::vector<std::shared_ptr<hittable>>& media
+    ) const override {
+        for (const auto& object : objects) {
+            object->collect_media(object, media);
+        }
+    }
+
 public:
     std::vector<std::shared_ptr<hittable>> objects;
 };
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "./counters.h"
 #include "./material.h"
 #include "./texture.h"
 #include "./hittable.h"
@@ -12,8 +13,9 @@ public:
     bool scatter(
         const ray& ray_in, const hit_record& rec, scatter_record& srec
     ) const override {
-        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+        srec.attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
         srec.pdf = std::make_shared<sphere_pdf>();
+        count(&render_counters::diffuse_scatters);
         return true;
     }
 
@@ -23,6 +25,14 @@ public:
         return 1 / (4 * pi);
     }
 
+    bool uses_uv() const override {
+        return albedo->uses_uv();
+    }
+
+    bool volumetric() const override {
+        return true;
+    }
+
 public:
     std::shared_ptr<texture> albedo;
 };
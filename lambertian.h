@@ -1,5 +1,6 @@
 #pragma once
 
+#include "./counters.h"
 #include "./material.h"
 #include "./hittable.h"
 #include "./texture.h"
@@ -13,8 +14,9 @@ public:
     bool scatter(
         const ray&, const hit_record& rec, scatter_record& srec
     ) const override {
-        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+        srec.attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
         srec.pdf = std::make_shared<cosine_pdf>(rec.normal);
+        count(&render_counters::diffuse_scatters);
         return true;
     }
 
@@ -25,5 +27,9 @@ public:
         return cosine < 0 ? 0 : cosine / pi;
     }
 
+    bool uses_uv() const override {
+        return albedo->uses_uv();
+    }
+
     std::shared_ptr<texture> albedo;
 };
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+#include "./alias_table.h"
+#include "./environment_light.h"
+#include "./hittable.h"
+#include "./material.h"
+#include "./utils.h"
+
+// Chooses which of many lights to sample from a point. With the power strategy lights are
+// picked in proportion to their power from an alias table. With the bvh strategy they are
+// picked by descending a BVH of the lights, choosing between two children in proportion to
+// an estimate of the light they send towards the point, based on their power, distance and
+// the cone of directions they emit in.
+//
+// Either way, the BVH culls the lights a direction can't reach when evaluating the pdf, so
+// the cost per sample grows with the depth of the tree instead of the number of lights.
+//
+// An environment light is picked with a fixed probability, in proportion to the power it
+// sends into a sphere of scene_radius compared to the power of the other lights.
+class light_sampler {
+public:
+    enum class strategy { power, bvh };
+
+    // Returned by sample() when it picks the environment light
+    static const int environment_index = -2;
+
+    light_sampler() {}
+
+    light_sampler(
+        const std::vector<std::shared_ptr<hittable>>& objects,
+        strategy s = strategy::bvh,
+        std::shared_ptr<const environment_light> _environment = nullptr,
+        double scene_radius = 1
+    ) : environment(_environment), selection(s)
+    {
+        std::vector<emission_bounds> bounds;
+        for (const auto& object : objects) {
+            emission_bounds b;
+            if (!object->emission(b)) {
+                continue;
+            }
+            index[object.get()] = static_cast<int>(lights.size());
+            lights.push_back(object);
+            bounds.push_back(b);
+        }
+
+        std::vector<double> powers;
+        for (const auto& b : bounds) {
+            powers.push_back(b.power);
+        }
+
+        if (environment) {
+            const auto radiance = environment->average_radiance();
+            const auto environment_power = pi * scene_radius * scene_radius * 4 * pi
+                * (radiance.x() + radiance.y() + radiance.z()) / 3;
+            const auto power = std::accumulate(powers.begin(), powers.end(), 0.0);
+            if (environment_power > 0) {
+                environment_probability = lights.empty() ? 1
+                    : std::isfinite(environment_power)
+                        ? environment_power / (environment_power + power) : 0.5;
+            }
+        }
+
+        if (lights.empty()) {
+            return;
+        }
+        table = alias_table{powers};
+
+        std::vector<int> order(lights.size());
+        std::iota(order.begin(), order.end(), 0);
+        leaf_of.resize(lights.size());
+        build(bounds, order, 0, static_cast<int>(order.size()), -1);
+    }
+
+    bool empty() const {
+        return lights.empty() && environment_probability == 0;
+    }
+
+    // Whether sample() can pick a light for a point at origin
+    bool reaches(const point3& origin) const {
+        if (environment_probability > 0) {
+            return true;
+        }
+        if (lights.empty()) {
+            return false;
+        }
+        return selection == strategy::power || nodes[0].light >= 0
+            || importance(nodes[0].bounds, origin) > 0;
+    }
+
+    // Picks a light for a point at origin with u uniform in [0, 1). Returns its index,
+    // environment_index or -1 when there are no lights, and sets probability to the chance
+    // of picking it.
+    int sample(const point3& origin, double u, double& probability) const {
+        if (u < environment_probability) {
+            probability = environment_probability;
+            return environment_index;
+        }
+        if (lights.empty()) {
+            return -1;
+        }
+        u = std::min((u - environment_probability) / (1 - environment_probability), 1 - 1e-12);
+        if (selection == strategy::power) {
+            auto i = table.sample(u);
+            probability = (1 - environment_probability) * table.pmf(i);
+            return i;
+        }
+
+        int node = 0;
+        probability = 1 - environment_probability;
+        while (nodes[node].light < 0) {
+            const auto p0 = first_probability(node, origin);
+            if (u < p0) {
+                node = node + 1;
+                u = std::min(u / p0, 1 - 1e-12);
+                probability *= p0;
+            } else {
+                node = nodes[node].second;
+                u = std::min((u - p0) / (1 - p0), 1 - 1e-12);
+                probability *= 1 - p0;
+            }
+        }
+        return nodes[node].light;
+    }
+
+    // Picks a light (not the environment) in proportion to its power, wherever the light it
+    // sends goes, with u uniform in [0, 1). Returns -1 when there are no lights.
+    int sample_emitter(double u, double& probability) const {
+        if (lights.empty()) {
+            return -1;
+        }
+        const auto i = table.sample(u);
+        probability = table.pmf(i);
+        return i;
+    }
+
+    // Chance that sample_emitter() picks light i
+    double emitter_probability(int i) const {
+        return table.pmf(i);
+    }
+
+    // Index of light, or -1 when it isn't one of the lights
+    int index_of(const hittable* light) const {
+        const auto found = index.find(light);
+        return found == index.end() ? -1 : found->second;
+    }
+
+    // Picks a point on light i uniformly by area, for tracing light from it. Sets p, the
+    // normal on the side it emits from, the area of the light and the radiance it emits
+    // there, and returns false when the light can't be traced from.
+    bool sample_emission(int i, point3& p, vec3& normal, double& area, color& radiance) const {
+        const auto& light = *lights[i];
+        if (!light.sample_surface(p, normal, area)) {
+            return false;
+        }
+        // Seen from just in front of the point
+        const ray towards{p + 1e-3 * normal, -normal};
+        hit_record rec;
+        if (!light.hit(towards, 0, infinity, rec)) {
+            return false;
+        }
+        rec.object->complete(towards, rec);
+        radiance = rec.material->emitted(towards, rec);
+        return true;
+    }
+
+    // Chance that sample() picks light i for a point at origin
+    double probability(const point3& origin, int i) const {
+        if (i == environment_index) {
+            return environment_probability;
+        }
+        if (selection == strategy::power) {
+            return (1 - environment_probability) * table.pmf(i);
+        }
+
+        auto probability = 1 - environment_probability;
+        for (auto node = leaf_of[i]; nodes[node].parent >= 0; node = nodes[node].parent) {
+            const auto parent = nodes[node].parent;
+            const auto p0 = first_probability(parent, origin);
+            probability *= node == parent + 1 ? p0 : 1 - p0;
+        }
+        return probability;
+    }
+
+    // Density over directions from origin of picking a light and then a direction towards
+    // it. Only lights whose bounds the direction passes through are visited.
+    double pdf_value(const point3& origin, const vec3& direction) const {
+        auto pdf = 0.0;
+        if (environment_probability > 0) {
+            pdf += environment_probability * environment->pdf_value(direction);
+        }
+        if (!lights.empty()) {
+            pdf += pdf_below(0, ray{origin, direction}, 1 - environment_probability);
+        }
+        return pdf;
+    }
+
+    const hittable& light(int i) const {
+        return *lights[i];
+    }
+
+    size_t size() const {
+        return lights.size();
+    }
+
+    // Light from outside the scene, or nullptr
+    std::shared_ptr<const environment_light> environment;
+    // Chance that sample() picks the environment
+    double environment_probability = 0;
+
+private:
+    struct node {
+        emission_bounds bounds;
+        int parent;
+        int second; // the first child directly follows its parent
+        int light; // -1 for interior nodes
+    };
+
+    strategy selection = strategy::bvh;
+    std::vector<std::shared_ptr<hittable>> lights;
+    std::unordered_map<const hittable*, int> index;
+    alias_table table;
+    std::vector<node> nodes;
+    std::vector<int> leaf_of;
+
+    int build(
+        const std::vector<emission_bounds>& bounds, std::vector<int>& order, int begin, int end,
+        int parent
+    ) {
+        const auto index = static_cast<int>(nodes.size());
+        nodes.push_back(node{bounds[order[begin]], parent, -1, -1});
+        if (end - begin == 1) {
+            nodes[index].light = order[begin];
+            leaf_of[order[begin]] = index;
+            return index;
+        }
+
+        // Median split along the axis in which the centers of the lights are spread most
+        auto center = [&](int i) { return 0.5 * (bounds[i].box.min() + bounds[i].box.max()); };
+        auto low = center(order[begin]);
+        auto high = low;
+        for (int i = begin + 1; i < end; i++) {
+            const auto c = center(order[i]);
+            for (int a = 0; a < 3; a++) {
+                low[a] = std::min(low[a], c[a]);
+                high[a] = std::max(high[a], c[a]);
+            }
+        }
+        const auto extent = high - low;
+        const int axis = extent.x() > extent.y()
+            ? (extent.x() > extent.z() ? 0 : 2)
+            : (extent.y() > extent.z() ? 1 : 2);
+        const auto middle = (begin + end) / 2;
+        std::nth_element(
+            order.begin() + begin, order.begin() + middle, order.begin() + end,
+            [&](int a, int b) { return center(a)[axis] < center(b)[axis]; });
+
+        build(bounds, order, begin, middle, index);
+        const auto second = build(bounds, order, middle, end, index);
+        nodes[index].second = second;
+        nodes[index].bounds = merge(nodes[index + 1].bounds, nodes[second].bounds);
+        return index;
+    }
+
+    double pdf_below(int index, const ray& r, double probability) const {
+        const auto& n = nodes[index];
+        if (!n.bounds.box.hit(r, 0.001, infinity)) {
+            return 0;
+        }
+        if (n.light >= 0) {
+            const auto p = selection == strategy::power
+                ? probability * table.pmf(n.light) : probability;
+            return p * lights[n.light]->pdf_value(r.origin(), r.direction());
+        }
+
+        auto p0 = 1.0;
+        auto p1 = 1.0;
+        if (selection == strategy::bvh) {
+            p0 = first_probability(index, r.origin());
+            p1 = 1 - p0;
+        }
+        return (p0 > 0 ? pdf_below(index + 1, r, probability * p0) : 0)
+             + (p1 > 0 ? pdf_below(n.second, r, probability * p1) : 0);
+    }
+
+    // Chance of descending into the first child of an interior node. When neither child
+    // seems to reach p (possible even when their parent does), both are equally likely, so
+    // a sample only fails when the root doesn't reach p.
+    double first_probability(int index, const point3& p) const {
+        const auto i0 = importance(nodes[index + 1].bounds, p);
+        const auto i1 = importance(nodes[nodes[index].second].bounds, p);
+        return i0 + i1 > 0 ? i0 / (i0 + i1) : 0.5;
+    }
+
+    // Estimate of the light the lights within bounds send to p: their power, divided by the
+    // squared distance, times the cosine of the smallest angle between the direction to p
+    // and a direction the bounds may emit in
+    static double importance(const emission_bounds& b, const point3& p) {
+        const auto center = 0.5 * (b.box.min() + b.box.max());
+        const auto radius2 = 0.25 * (b.box.max() - b.box.min()).length_squared();
+        const auto to_p = p - center;
+        const auto distance2 = to_p.length_squared();
+
+        // Angle between the axis and the direction to p
+        const auto cos_w = distance2 > 0 ? dot(b.axis, to_p) / std::sqrt(distance2) : 1.0;
+        const auto sin_w = std::sqrt(std::max(0.0, 1 - cos_w * cos_w));
+        // Angle under which the bounds are seen from p
+        const auto cos_b = distance2 > radius2 ? std::sqrt(1 - radius2 / distance2) : -1.0;
+        const auto sin_b = std::sqrt(std::max(0.0, 1 - cos_b * cos_b));
+        const auto sin_o = std::sqrt(std::max(0.0, 1 - b.cos_theta_o * b.cos_theta_o));
+
+        // cos(max(0, theta_w - theta_o - theta_b))
+        const auto cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, b.cos_theta_o);
+        const auto sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, b.cos_theta_o);
+        const auto cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+        if (cos_p <= b.cos_theta_e) {
+            return 0;
+        }
+        // Points close to or inside the bounds get the same importance
+        return b.power * cos_p / std::max(distance2, std::sqrt(radius2));
+    }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) of angles in [0, pi] given as sine and cosine
+    static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+    }
+
+    static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+    }
+
+    static emission_bounds merge(const emission_bounds& a, const emission_bounds& b) {
+        emission_bounds result;
+        result.box = surrounding_box(a.box, b.box);
+        result.power = a.power + b.power;
+        result.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+        merge_cones(a.axis, a.cos_theta_o, b.axis, b.cos_theta_o, result.axis, result.cos_theta_o);
+        return result;
+    }
+
+    // The smallest cone containing the cones around axis_a and axis_b
+    static void merge_cones(
+        const vec3& axis_a, double cos_a, const vec3& axis_b, double cos_b,
+        vec3& axis, double& cos_theta
+    ) {
+        const auto theta_a = std::acos(std::clamp(cos_a, -1.0, 1.0));
+        const auto theta_b = std::acos(std::clamp(cos_b, -1.0, 1.0));
+        const auto theta_d = std::acos(std::clamp(dot(axis_a, axis_b), -1.0, 1.0));
+        if (std::min(theta_d + theta_b, pi) <= theta_a) {
+            axis = axis_a;
+            cos_theta = cos_a;
+            return;
+        }
+        if (std::min(theta_d + theta_a, pi) <= theta_b) {
+            axis = axis_b;
+            cos_theta = cos_b;
+            return;
+        }
+
+        const auto theta_o = (theta_a + theta_d + theta_b) / 2;
+        const auto k = cross(axis_a, axis_b);
+        if (theta_o >= pi || k.length_squared() == 0) {
+            axis = axis_a;
+            cos_theta = -1;
+            return;
+        }
+        // Rotate axis_a towards axis_b by theta_o - theta_a (Rodrigues' formula)
+        const auto theta_r = theta_o - theta_a;
+        const auto unit_k = k.normalized();
+        axis = std::cos(theta_r) * axis_a + std::sin(theta_r) * cross(unit_k, axis_a)
+             + (1 - std::cos(theta_r)) * dot(unit_k, axis_a) * unit_k;
+        cos_theta = std::cos(theta_o);
+    }
+};
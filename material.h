@@ -31,5 +31,28 @@ public:
         return color{0, 0, 0};
     }
 
+    // Whether scattering or emission looks at the uv coordinates of a hit. Primitives skip
+    // computing them when it doesn't.
+    virtual bool uses_uv() const {
+        return true;
+    }
+
+    // Whether this scatters light inside a medium rather than at a surface
+    virtual bool volumetric() const {
+        return false;
+    }
+
+    // Radiance emitted by the front of a surface, roughly averaged over the surface. Only
+    // used to weigh lights against each other.
+    virtual color average_emission() const {
+        return color{0, 0, 0};
+    }
+
+    // Power (averaged over the color channels) emitted by a surface of this material
+    double emitted_power(double area) const {
+        const auto radiance = average_emission();
+        return pi * area * (radiance.x() + radiance.y() + radiance.z()) / 3;
+    }
+
     virtual ~material() {}
 };
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "./counters.h"
 #include "./material.h"
 #include "./hittable.h"
 
@@ -14,9 +15,14 @@ public:
         srec.pdf = nullptr;
         srec.skip_pdf_ray = ray{rec.p, reflected + fuzz * random_in_unit_sphere()};
         srec.attenuation = albedo;
+        count(&render_counters::specular_scatters);
         return dot(srec.skip_pdf_ray.direction(), rec.normal) > 0;
     }
 
+    bool uses_uv() const override {
+        return false;
+    }
+
     color albedo;
     double fuzz;
 };
\ No newline at end of file
@@ -1,30 +1,49 @@
 #pragma once
 
+#include <memory>
+
 #include "./texture.h"
 #include "./perlin.h"
+#include "./baked_noise.h"
 
 class noise_texture : public texture {
 public:
-    noise_texture(double scale) : scale(scale) {}
+    // With baked set, the noise is looked up in a precomputed grid instead of evaluated
+    noise_texture(double scale, bool baked = false)
+      : scale(scale), baked(baked ? std::make_shared<baked_noise>() : nullptr) {}
 
     color value(double u, double v, const point3& p) const override {
-        return color{1, 1, 1} * 0.5 * (1.0 + noise.noise(scale * p));
+        auto n = baked ? baked->noise(scale * p) : noise.noise(scale * p);
+        return color{1, 1, 1} * 0.5 * (1.0 + n);
+    }
+
+    bool uses_uv() const override {
+        return false;
     }
 
 private:
     double scale;
     perlin noise;
+    std::shared_ptr<baked_noise> baked;
 };
 
 class turbulence_texture : public texture {
 public:
-    turbulence_texture(double scale) : scale(scale) {}
+    // With baked set, the noise is looked up in a precomputed grid instead of evaluated
+    turbulence_texture(double scale, bool baked = false)
+      : scale(scale), baked(baked ? std::make_shared<baked_noise>() : nullptr) {}
 
     color value(double u, double v, const point3& p) const override {
-        return color{1, 1, 1} * 0.5 * (1 + std::sin(scale * p.z() + 10 * noise.turb(p)));
+        auto t = baked ? baked->turb(p) : noise.turb(p);
+        return color{1, 1, 1} * 0.5 * (1 + std::sin(scale * p.z() + 10 * t));
+    }
+
+    bool uses_uv() const override {
+        return false;
     }
 
 private:
     double scale;
     perlin noise;
-};
\ No newline at end of file
+    std::shared_ptr<baked_noise> baked;
+};
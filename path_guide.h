@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "./aabb.h"
+#include "./color.h"
+#include "./pdf.h"
+#include "./utils.h"
+#include "./vec3.h"
+
+// Learns where light arrives from, per cell of a grid over the scene, so bounces can be aimed
+// at it (path guiding). The cells are cubes, kept in a hash grid like the photon map's: only
+// cells that paths reach get a histogram, so memory follows what the scene fills rather
+// than its box. Every cell has a histogram over directions, with bins of equal solid angle:
+// equal steps of cos(theta) (with theta measured from the y axis) times equal steps of phi.
+// Render threads add what their paths find to the histograms with atomic adds, and claim
+// new cells with compare-and-swap, without locks. Between passes update() turns the
+// histograms into the distributions sampled from, which don't change during a pass.
+class path_guide {
+public:
+    static const int theta_bins = 16;
+    static const int phi_bins = 16;
+    static const int bins = theta_bins * phi_bins;
+
+    // Cells resolution times smaller than the longest side of box
+    path_guide(const aabb& _box, int _resolution = 16)
+      : box(_box)
+      , resolution(std::max(1, _resolution))
+    {
+        auto longest = 0.0;
+        for (int a = 0; a < 3; a++) {
+            longest = std::max(longest, box.max()[a] - box.min()[a]);
+        }
+        cell_size = longest > 0 ? longest / resolution : 1;
+        // Room for twice the cells the box can hold, up to a limit, so probes stay short
+        const auto most = std::min<size_t>(
+            max_cells, static_cast<size_t>(resolution) * resolution * resolution);
+        size_t size = 1;
+        while (size < 2 * most) {
+            size *= 2;
+        }
+        mask = size - 1;
+        slots = std::vector<slot>(size);
+    }
+
+    ~path_guide() {
+        for (auto& s : slots) {
+            delete s.data.load(std::memory_order_relaxed);
+        }
+    }
+
+    path_guide(const path_guide&) = delete;
+    path_guide& operator=(const path_guide&) = delete;
+
+    // Records that radiance arrived at p from direction, which was sampled with density pdf
+    void record(const point3& p, const vec3& direction, const color& radiance, double pdf) {
+        const auto luminance = (radiance.x() + radiance.y() + radiance.z()) / 3;
+        if (!(pdf > 0) || !std::isfinite(luminance)) {
+            return;
+        }
+        const auto c = find(p, true);
+        if (c == nullptr) {
+            return;
+        }
+        c->count.fetch_add(1, std::memory_order_relaxed);
+        if (luminance <= 0) {
+            return;
+        }
+        // Summing radiance over density estimates the light arriving through each bin
+        auto& sum = c->sums[bin(direction)];
+        auto old = sum.load(std::memory_order_relaxed);
+        const auto amount = static_cast<float>(luminance / pdf);
+        while (!sum.compare_exchange_weak(old, old + amount, std::memory_order_relaxed)) {}
+    }
+
+    // Rebuilds the distributions from everything recorded so far. Must not run during a pass.
+    void update() {
+        for (auto& s : slots) {
+            const auto c = s.data.load(std::memory_order_acquire);
+            if (c == nullptr || c->count.load(std::memory_order_relaxed) < min_samples) {
+                continue;
+            }
+            double total = 0;
+            for (const auto& sum : c->sums) {
+                total += sum.load(std::memory_order_relaxed);
+            }
+            if (total <= 0) {
+                continue;
+            }
+            // A little of every direction, for light the cell hasn't seen yet
+            const auto floor = uniform_fraction * total / bins;
+            double running = 0;
+            for (int b = 0; b < bins; b++) {
+                running += c->sums[b].load(std::memory_order_relaxed) + floor;
+                c->cdf[b] = static_cast<float>(running / (total * (1 + uniform_fraction)));
+            }
+            c->cdf[bins - 1] = 1;
+            c->trained = true;
+        }
+    }
+
+    // The distribution of directions learned for p, or nullptr when its cell hasn't learned
+    // enough yet
+    std::shared_ptr<pdf> distribution(const point3& p) const {
+        const auto c = find(p, false);
+        if (c == nullptr || !c->trained) {
+            return nullptr;
+        }
+        return std::make_shared<guided_pdf>(c->cdf.data());
+    }
+
+private:
+    // Cells with fewer paths through them aren't guided
+    static const int min_samples = 64;
+    static constexpr double uniform_fraction = 0.1;
+    // Cells beyond this many, in scenes larger than the box, aren't guided
+    static const size_t max_cells = size_t{1} << 16;
+
+    struct cell {
+        std::array<std::atomic<float>, bins> sums{};
+        std::atomic<int> count{0};
+        // Written by update() only, between passes
+        std::array<float, bins> cdf{};
+        bool trained = false;
+    };
+
+    struct slot {
+        // The cell's coordinates plus one in 21 bits each, 0 while the slot is free
+        std::atomic<uint64_t> key{0};
+        // Set by the thread that claimed the key, right after it
+        std::atomic<cell*> data{nullptr};
+    };
+
+    // Samples a bin from a cell's cdf, then a direction uniformly within it
+    class guided_pdf : public pdf {
+    public:
+        explicit guided_pdf(const float* _cdf) : cdf(_cdf) {}
+
+        double value(const vec3& direction) const override {
+            const auto b = bin(direction);
+            const auto pmf = cdf[b] - (b > 0 ? cdf[b - 1] : 0.0f);
+            return pmf * bins / (4 * pi);
+        }
+
+        vec3 generate() const override {
+            const auto b = static_cast<int>(
+                std::upper_bound(cdf, cdf + bins - 1, static_cast<float>(random_double())) - cdf);
+            const auto cos_theta = -1 + 2 * (b / phi_bins + random_double()) / theta_bins;
+            const auto phi = 2 * pi * (b % phi_bins + random_double()) / phi_bins;
+            const auto sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+            return vec3{sin_theta * std::cos(phi), cos_theta, sin_theta * std::sin(phi)};
+        }
+
+    private:
+        const float* cdf;
+    };
+
+    static int bin(const vec3& direction) {
+        const auto d = direction.normalized();
+        const auto t = std::clamp(
+            static_cast<int>((d.y() + 1) / 2 * theta_bins), 0, theta_bins - 1);
+        auto phi = std::atan2(d.z(), d.x());
+        if (phi < 0) {
+            phi += 2 * pi;
+        }
+        const auto p = std::clamp(static_cast<int>(phi / (2 * pi) * phi_bins), 0, phi_bins - 1);
+        return t * phi_bins + p;
+    }
+
+    // The cell p is in, or nullptr when it has none and create is false, or the grid is full
+    cell* find(const point3& p, bool create) const {
+        int coordinates[3];
+        uint64_t key = 0;
+        for (int a = 0; a < 3; a++) {
+            // Cells outside the box are clamped to 20 bits
+            coordinates[a] = std::clamp(
+                static_cast<int>(std::floor((p[a] - box.min()[a]) / cell_size)),
+                -(1 << 19), (1 << 19) - 2);
+            key = key << 21 | static_cast<uint64_t>(coordinates[a] + (1 << 19) + 1);
+        }
+        const auto h = (static_cast<uint32_t>(coordinates[0]) * 73856093u)
+            ^ (static_cast<uint32_t>(coordinates[1]) * 19349663u)
+            ^ (static_cast<uint32_t>(coordinates[2]) * 83492791u);
+        for (size_t probe = 0; probe <= mask; probe++) {
+            auto& s = slots[(h + probe) & mask];
+            auto found = s.key.load(std::memory_order_acquire);
+            if (found == 0) {
+                if (!create) {
+                    return nullptr;
+                }
+                if (s.key.compare_exchange_strong(found, key, std::memory_order_acq_rel)) {
+                    const auto c = new cell;
+                    s.data.store(c, std::memory_order_release);
+                    return c;
+                }
+                // Another thread took the slot first, found is now its key
+            }
+            if (found == key) {
+                auto c = s.data.load(std::memory_order_acquire);
+                // Claimed but not filled in yet, which takes a moment only
+                while (c == nullptr && create) {
+                    std::this_thread::yield();
+                    c = s.data.load(std::memory_order_acquire);
+                }
+                return c;
+            }
+        }
+        return nullptr;
+    }
+
+    aabb box;
+    int resolution;
+    double cell_size = 1;
+    size_t mask = 0;
+    // Claimed by record() as paths reach new cells
+    mutable std::vector<slot> slots;
+};
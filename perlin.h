@@ -1,38 +1,55 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "./cpu_dispatch.h"
 #include "./utils.h"
 #include "./vec3.h"
 
 class perlin {
 public:
-    perlin() {
+    static const int point_count = 256;
+
+    // The noise repeats itself every period units along each axis. period must be a power
+    // of two, at most point_count.
+    perlin(int period = point_count) : mask(period - 1) {
         for (int i = 0; i < point_count; i++) {
-            ranvec[i] = vec3::random(-1, 1).normalized();
+            auto g = vec3::random(-1, 1).normalized();
+            grad_x[i] = static_cast<float>(g.x());
+            grad_y[i] = static_cast<float>(g.y());
+            grad_z[i] = static_cast<float>(g.z());
         }
         perm_x = perlin_generate_perm();
         perm_y = perlin_generate_perm();
         perm_z = perlin_generate_perm();
     }
 
+    int period() const {
+        return mask + 1;
+    }
+
     double noise(const point3& p) const {
-        auto u = p.x() - std::floor(p.x());
-        auto v = p.y() - std::floor(p.y());
-        auto w = p.z() - std::floor(p.z());
-        auto i = static_cast<int>(std::floor(p.x()));
-        auto j = static_cast<int>(std::floor(p.y()));
-        auto k = static_cast<int>(std::floor(p.z()));
+        auto i = fast_floor(p.x());
+        auto j = fast_floor(p.y());
+        auto k = fast_floor(p.z());
+        auto u = p.x() - i;
+        auto v = p.y() - j;
+        auto w = p.z() - k;
+        const int px[2] = {perm_x[i & mask], perm_x[(i + 1) & mask]};
+        const int py[2] = {perm_y[j & mask], perm_y[(j + 1) & mask]};
+        const int pz[2] = {perm_z[k & mask], perm_z[(k + 1) & mask]};
         vec3 c[2][2][2];
 
         for (int di = 0; di < 2; di++) {
             for (int dj = 0; dj < 2; dj++) {
                 for (int dk = 0; dk < 2; dk++) {
-                    c[di][dj][dk] = ranvec[
-                        perm_x[(i + di) & 255] ^
-                        perm_y[(j + dj) & 255] ^
-                        perm_z[(k + dk) & 255]
-                    ];
+                    auto g = px[di] ^ py[dj] ^ pz[dk];
+                    c[di][dj][dk] = vec3(grad_x[g], grad_y[g], grad_z[g]);
                 }
             }
         }
@@ -40,37 +57,126 @@ public:
         return perlin_interp(c, u, v, w);
     }
 
+    // Noise at four points at once. The lattice lookups are scalar, the gradient dot
+    // products and the interpolation are done for all four points together.
+    void noise4(const point3 p[4], double out[4]) const {
+#if defined(__SSE2__)
+        alignas(16) float u[4], v[4], w[4];
+        // Permutation entries of both lattice planes along each axis
+        int px[2][4], py[2][4], pz[2][4];
+        for (int l = 0; l < 4; l++) {
+            auto i = fast_floor(p[l].x());
+            auto j = fast_floor(p[l].y());
+            auto k = fast_floor(p[l].z());
+            u[l] = static_cast<float>(p[l].x() - i);
+            v[l] = static_cast<float>(p[l].y() - j);
+            w[l] = static_cast<float>(p[l].z() - k);
+            px[0][l] = perm_x[i & mask];
+            px[1][l] = perm_x[(i + 1) & mask];
+            py[0][l] = perm_y[j & mask];
+            py[1][l] = perm_y[(j + 1) & mask];
+            pz[0][l] = perm_z[k & mask];
+            pz[1][l] = perm_z[(k + 1) & mask];
+        }
+
+        const auto one = _mm_set1_ps(1.0f);
+        const auto three = _mm_set1_ps(3.0f);
+        const auto two = _mm_set1_ps(2.0f);
+        const auto uu = _mm_load_ps(u);
+        const auto vv = _mm_load_ps(v);
+        const auto ww = _mm_load_ps(w);
+        // Hermite smoothing: t * t * (3 - 2 * t)
+        const auto su = _mm_mul_ps(_mm_mul_ps(uu, uu), _mm_sub_ps(three, _mm_mul_ps(two, uu)));
+        const auto sv = _mm_mul_ps(_mm_mul_ps(vv, vv), _mm_sub_ps(three, _mm_mul_ps(two, vv)));
+        const auto sw = _mm_mul_ps(_mm_mul_ps(ww, ww), _mm_sub_ps(three, _mm_mul_ps(two, ww)));
+
+        auto accum = _mm_setzero_ps();
+        for (int di = 0; di < 2; di++) {
+            const auto wu = di ? su : _mm_sub_ps(one, su);
+            const auto ou = di ? _mm_sub_ps(uu, one) : uu;
+            for (int dj = 0; dj < 2; dj++) {
+                const auto wv = dj ? sv : _mm_sub_ps(one, sv);
+                const auto ov = dj ? _mm_sub_ps(vv, one) : vv;
+                for (int dk = 0; dk < 2; dk++) {
+                    const auto wz = dk ? sw : _mm_sub_ps(one, sw);
+                    const auto ow = dk ? _mm_sub_ps(ww, one) : ww;
+
+                    const auto g0 = px[di][0] ^ py[dj][0] ^ pz[dk][0];
+                    const auto g1 = px[di][1] ^ py[dj][1] ^ pz[dk][1];
+                    const auto g2 = px[di][2] ^ py[dj][2] ^ pz[dk][2];
+                    const auto g3 = px[di][3] ^ py[dj][3] ^ pz[dk][3];
+                    const auto gx = _mm_set_ps(grad_x[g3], grad_x[g2], grad_x[g1], grad_x[g0]);
+                    const auto gy = _mm_set_ps(grad_y[g3], grad_y[g2], grad_y[g1], grad_y[g0]);
+                    const auto gz = _mm_set_ps(grad_z[g3], grad_z[g2], grad_z[g1], grad_z[g0]);
+
+                    const auto d = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(gx, ou), _mm_mul_ps(gy, ov)), _mm_mul_ps(gz, ow));
+                    accum = _mm_add_ps(accum, _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(wu, wv), wz), d));
+                }
+            }
+        }
+
+        alignas(16) float result[4];
+        _mm_store_ps(result, accum);
+        for (int l = 0; l < 4; l++) {
+            out[l] = result[l];
+        }
+#else
+        for (int l = 0; l < 4; l++) {
+            out[l] = noise(p[l]);
+        }
+#endif
+    }
+
+    RENDER_KERNEL
     double turb(const point3& p, int depth = 7) const {
         auto accum = 0.0;
-        auto temp_p = p;
         auto weight = 1.0;
+        auto frequency = 1.0;
 
-        for (int i = 0; i < depth; i++) {
-            accum += weight * noise(temp_p);
-            weight *= 0.5;
-            temp_p *= 2;
+        // Four octaves per noise4 call
+        for (int i = 0; i < depth; i += 4) {
+            point3 points[4];
+            double values[4];
+            for (int l = 0; l < 4; l++) {
+                points[l] = (frequency * (1 << l)) * p;
+            }
+            noise4(points, values);
+            for (int l = 0; l < 4 && i + l < depth; l++) {
+                accum += weight * values[l];
+                weight *= 0.5;
+            }
+            frequency *= 16;
         }
 
         return std::abs(accum);
     }
 
 private:
-    static const int point_count = 256;
-    std::array<vec3, point_count> ranvec;
-    std::array<int, point_count> perm_x;
-    std::array<int, point_count> perm_y;
-    std::array<int, point_count> perm_z;
+    int mask;
+    std::array<float, point_count> grad_x;
+    std::array<float, point_count> grad_y;
+    std::array<float, point_count> grad_z;
+    std::array<uint8_t, point_count> perm_x;
+    std::array<uint8_t, point_count> perm_y;
+    std::array<uint8_t, point_count> perm_z;
+
+    // std::floor is a library call without SSE4.1
+    static int fast_floor(double x) {
+        auto i = static_cast<int>(x);
+        return x < i ? i - 1 : i;
+    }
 
-    static std::array<int, point_count> perlin_generate_perm() {
-        std::array<int, point_count> p;
+    static std::array<uint8_t, point_count> perlin_generate_perm() {
+        std::array<uint8_t, point_count> p;
         for (int i = 0; i < point_count; i++) {
-            p[i] = i;
+            p[i] = static_cast<uint8_t>(i);
         }
         permute(p);
         return p;
     }
 
-    static void permute(std::array<int, point_count>& p) {
+    static void permute(std::array<uint8_t, point_count>& p) {
         for (int i = point_count - 1; i > 0; i--) {
             std::swap(p[i], p[random_int(0, i)]);
         }
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "./color.h"
+#include "./hittable.h"
+#include "./material.h"
+#include "./vec3.h"
+
+// Light that arrived at a surface, stored in single precision to keep the map small
+struct photon {
+    photon() {}
+
+    photon(const point3& p, const vec3& towards_light, const color& _power)
+      : position{float(p.x()), float(p.y()), float(p.z())}
+      , direction{float(towards_light.x()), float(towards_light.y()), float(towards_light.z())}
+      , power{float(_power.x()), float(_power.y()), float(_power.z())}
+    {}
+
+    float position[3];
+    // Unit vector back along the path the photon came from
+    float direction[3];
+    float power[3];
+};
+
+// Photons in a hash grid of cells twice the gather radius wide, so the photons within the
+// radius of a point are found in at most 8 cells. The photons of a cell are stored next to
+// each other, sorted by cell with a counting sort in linear time.
+class photon_map {
+public:
+    photon_map() {}
+
+    photon_map(const std::vector<photon>& unsorted, double _radius)
+      : radius(_radius), cell_size(2 * _radius)
+    {
+        size_t size = 1;
+        while (size < unsorted.size()) {
+            size <<= 1;
+        }
+        mask = size - 1;
+
+        std::vector<uint32_t> cells(unsorted.size());
+        cell_start.assign(size + 1, 0);
+        for (size_t i = 0; i < unsorted.size(); i++) {
+            const auto& p = unsorted[i].position;
+            cells[i] = cell(cell_index(p[0]), cell_index(p[1]), cell_index(p[2]));
+            cell_start[cells[i] + 1]++;
+        }
+        for (size_t c = 0; c < size; c++) {
+            cell_start[c + 1] += cell_start[c];
+        }
+        photons.resize(unsorted.size());
+        auto next = cell_start;
+        for (size_t i = 0; i < unsorted.size(); i++) {
+            photons[next[cells[i]]++] = unsorted[i];
+        }
+    }
+
+    // Radiance the surface at rec (with albedo attenuation) reflects back along r, estimated
+    // from the density of the photons within radius of rec.p
+    color radiance(const ray& r, const hit_record& rec, const color& attenuation) const {
+        if (photons.empty()) {
+            return color{0, 0, 0};
+        }
+
+        // Cells sharing a hash are only visited once
+        uint32_t visited[8];
+        int visited_count = 0;
+        int low[3];
+        int high[3];
+        for (int a = 0; a < 3; a++) {
+            low[a] = cell_index(rec.p[a] - radius);
+            high[a] = cell_index(rec.p[a] + radius);
+        }
+
+        const auto radius2 = radius * radius;
+        color sum{0, 0, 0};
+        for (int x = low[0]; x <= high[0]; x++) {
+            for (int y = low[1]; y <= high[1]; y++) {
+                for (int z = low[2]; z <= high[2]; z++) {
+                    const auto c = cell(x, y, z);
+                    if (std::find(visited, visited + visited_count, c) != visited + visited_count) {
+                        continue;
+                    }
+                    visited[visited_count++] = c;
+
+                    for (auto i = cell_start[c]; i < cell_start[c + 1]; i++) {
+                        const auto& ph = photons[i];
+                        const vec3 offset{
+                            ph.position[0] - rec.p.x(),
+                            ph.position[1] - rec.p.y(),
+                            ph.position[2] - rec.p.z()
+                        };
+                        if (offset.length_squared() > radius2) {
+                            continue;
+                        }
+                        const vec3 towards_light{ph.direction[0], ph.direction[1], ph.direction[2]};
+                        const auto cos_theta = dot(towards_light, rec.normal);
+                        if (cos_theta <= 0) {
+                            continue;
+                        }
+                        // The BRDF, scattering_pdf() includes the cosine
+                        const auto brdf = rec.material->scattering_pdf(
+                            r, rec, ray{rec.p, towards_light}) / cos_theta;
+                        sum += brdf * color{ph.power[0], ph.power[1], ph.power[2]};
+                    }
+                }
+            }
+        }
+        return attenuation * sum / (pi * radius2);
+    }
+
+    size_t size() const {
+        return photons.size();
+    }
+
+private:
+    double radius = 0;
+    double cell_size = 1;
+    uint32_t mask = 0;
+    std::vector<photon> photons;
+    // The photons of cell c are photons[cell_start[c]] up to photons[cell_start[c + 1]]
+    std::vector<uint32_t> cell_start;
+
+    int cell_index(double x) const {
+        return static_cast<int>(std::floor(x / cell_size));
+    }
+
+    uint32_t cell(int x, int y, int z) const {
+        const auto h = (static_cast<uint32_t>(x) * 73856093u)
+            ^ (static_cast<uint32_t>(y) * 19349663u)
+            ^ (static_cast<uint32_t>(z) * 83492791u);
+        return h & mask;
+    }
+};
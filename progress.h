@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Shows how far rendering is and how long it will still take. Workers only add the samples
+// they finished to a counter of their own, without locks or I/O; a thread of its own sums
+// the counters every interval and reports them. The time left is estimated from the samples
+// done, so it doesn't depend on how long each scanline takes.
+class progress_meter {
+public:
+    // machine_file, when not empty, gets a line of JSON per report, like
+    // {"pass": 1, "passes": 4, "samples": 1200, "total": 4800, "fraction": 0.25,
+    //  "elapsed": 3.1, "remaining": 9.3, "done": false}
+    // Without display, nothing is written to std::cerr.
+    progress_meter(
+        long long _total, int _passes, const std::string& machine_file = "",
+        bool _display = true, double interval_seconds = 0.5
+    ) : total(_total), passes(_passes), display(_display),
+        interval(std::chrono::duration<double>(interval_seconds)),
+        start(std::chrono::steady_clock::now())
+    {
+        if (!machine_file.empty()) {
+            machine.open(machine_file, std::ios::app);
+            if (!machine) {
+                std::cerr << "ERROR: Could not write progress to '" << machine_file << "'.\n";
+            }
+        }
+        reporter = std::thread{&progress_meter::run, this};
+    }
+
+    ~progress_meter() {
+        stop();
+    }
+
+    progress_meter(const progress_meter&) = delete;
+    progress_meter& operator=(const progress_meter&) = delete;
+
+    // Called by workers as they finish samples
+    void add(long long samples) {
+        counters[counter_index()].samples.fetch_add(samples, std::memory_order_relaxed);
+    }
+
+    // The pass now being rendered, from 0
+    void set_pass(int p) {
+        pass.store(p, std::memory_order_relaxed);
+    }
+
+    // Reports one last time and ends the reporting thread
+    void stop() {
+        {
+            std::scoped_lock lock(mutex);
+            if (stopped) {
+                return;
+            }
+            stopped = true;
+        }
+        wake.notify_one();
+        reporter.join();
+    }
+
+private:
+    // On cache lines of their own, so workers don't slow each other down
+    struct alignas(64) counter {
+        std::atomic<long long> samples{0};
+    };
+    // Threads beyond this many share counters, which still works
+    static constexpr int counter_count = 64;
+
+    std::array<counter, counter_count> counters;
+    const long long total;
+    const int passes;
+    const bool display;
+    std::atomic<int> pass{0};
+    const std::chrono::duration<double> interval;
+    const std::chrono::steady_clock::time_point start;
+    std::ofstream machine;
+
+    std::thread reporter;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopped = false;
+
+    static int counter_index() {
+        static std::atomic<int> next{0};
+        static thread_local const int index = next.fetch_add(1) % counter_count;
+        return index;
+    }
+
+    void run() {
+        std::unique_lock lock(mutex);
+        while (!wake.wait_for(lock, interval, [this] { return stopped; })) {
+            report(false);
+        }
+        report(true);
+    }
+
+    void report(bool done) {
+        long long samples = 0;
+        for (const auto& c : counters) {
+            samples += c.samples.load(std::memory_order_relaxed);
+        }
+        const auto elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        const auto fraction = total > 0 ? 1.0 * samples / total : 1.0;
+        // Unknown until some samples are done
+        const auto remaining = samples > 0 ? elapsed * (total - samples) / samples : -1.0;
+        const auto current = pass.load(std::memory_order_relaxed);
+
+        std::ostringstream line;
+        line << '\r';
+        if (passes > 1) {
+            line << "Pass " << current + 1 << " / " << passes << " -- ";
+        }
+        line << "Samples: " << std::fixed << std::setprecision(1) << 100 * fraction << "%"
+             << " -- Time spent: " << clock(elapsed)
+             << " -- Estimated time left: " << (remaining < 0 ? "?" : clock(remaining))
+             // Some extra white space to account for previous lines that were longer
+             << "         ";
+        if (display) {
+            std::cerr << line.str() << std::flush;
+        }
+
+        if (machine.is_open()) {
+            machine << std::fixed << std::setprecision(3)
+                    << "{\"pass\": " << current + 1 << ", \"passes\": " << passes
+                    << ", \"samples\": " << samples << ", \"total\": " << total
+                    << ", \"fraction\": " << fraction << ", \"elapsed\": " << elapsed
+                    << ", \"remaining\": " << remaining
+                    << ", \"done\": " << (done ? "true" : "false") << "}" << std::endl;
+        }
+    }
+
+    // h:mm:ss
+    static std::string clock(double seconds) {
+        const auto s = static_cast<long long>(seconds);
+        std::ostringstream out;
+        out << s / 3600 << ':' << std::setfill('0') << std::setw(2) << s / 60 % 60 << ':'
+            << std::setw(2) << s % 60;
+        return out.str();
+    }
+};
@@ -8,6 +8,7 @@
 #include "./scenes/cornell_box_two_boxes.h"
 #include "./scenes/cornell_smoke.h"
 #include "./scenes/cornell_box_and_glass.h"
+#include "./scenes/cornell_cloud.h"
 #include "./scenes/earth.h"
 #include "./scenes/lens_setup.h"
 #include "./scenes/random_balls.h"
@@ -58,6 +59,9 @@ int main() {
     case 10:
         final_scene(scene);
         break;
+    case 11:
+        cornell_cloud(scene);
+        break;
     }
 
     scene.render();
@@ -26,3 +26,14 @@ private:
     point3 _origin;
     vec3 _direction;
 };
+
+// The footprint of a ray approximated by a cone: its width at the origin of the ray and how
+// much that grows per unit of distance along it
+struct ray_cone {
+    double width = 0;
+    double spread = 0;
+
+    double width_at(double distance) const {
+        return width + spread * distance;
+    }
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+#include "./hittable.h"
+
+// Passes rays on to another hittable and counts them. Each thread counts on its own and adds
+// its count to the total with flush(), so counting doesn't make threads contend.
+class ray_counter : public hittable {
+public:
+    explicit ray_counter(const hittable& _inner) : inner(_inner) {}
+
+    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        local()++;
+        return inner.hit(r, t_min, t_max, rec);
+    }
+
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        local()++;
+        return inner.occluded(r, t_min, t_max);
+    }
+
+    bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        return inner.bounding_box(time0, time1, output_box);
+    }
+
+    // Adds the rays the calling thread traced since its last flush() to count()
+    void flush() const {
+        total.fetch_add(std::exchange(local(), 0), std::memory_order_relaxed);
+    }
+
+    long long count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+private:
+    const hittable& inner;
+    mutable std::atomic<long long> total{0};
+
+    static long long& local() {
+        static thread_local long long rays = 0;
+        return rays;
+    }
+};
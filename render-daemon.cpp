@@ -0,0 +1,215 @@
+// A render service that keeps scenes ready between jobs. The first job for a scene builds
+// it and its BVH, and decodes its textures; later jobs, with another camera, size or sample
+// count, start rendering right away. Jobs run at the same time, all on one set of threads.
+//
+//     ./render-daemon [--socket /tmp/ray-tracer.sock] [--threads N]
+//
+// A job is a line of key=value pairs sent over a connection to the socket, as described in
+// render_job.h, answered with a line when it is done: "ok <seconds>" or "error <message>".
+// For example
+//
+//     ./render-daemon --send "scene=three_spheres width=400 spp=100 output=/tmp/spheres.ppm"
+//
+// or the same line through socat - UNIX-CONNECT:/tmp/ray-tracer.sock.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "./render_job.h"
+#include "./scene.h"
+#include "./socket_io.h"
+#include "./scenes/scene_list.h"
+
+// Scenes built by the jobs so far, by name, shared by all later jobs for them
+class scene_cache {
+public:
+    // Returns nullptr when there is no scene of that name. Concurrent calls for the same
+    // scene wait for the first one to build it. When the build throws, they all throw its
+    // exception, and the next call builds the scene again.
+    std::shared_ptr<const scene> get(const std::string& name) {
+        std::promise<std::shared_ptr<const scene>> promise;
+        std::shared_future<std::shared_ptr<const scene>> result;
+        bool first = false;
+        {
+            std::scoped_lock lock(mutex);
+            auto found = scenes_by_name.find(name);
+            if (found != scenes_by_name.end()) {
+                result = found->second;
+            } else {
+                result = promise.get_future().share();
+                scenes_by_name.emplace(name, result);
+                first = true;
+            }
+        }
+        if (first) {
+            try {
+                promise.set_value(build(name));
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+                std::scoped_lock lock(mutex);
+                scenes_by_name.erase(name);
+            }
+        }
+        return result.get();
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_future<std::shared_ptr<const scene>>> scenes_by_name;
+
+    static std::shared_ptr<const scene> build(const std::string& name) {
+        const auto named = find_scene(name);
+        if (!named) {
+            return nullptr;
+        }
+        auto built = std::make_shared<scene>();
+        named->build(*built);
+        built->prepare();
+        return built;
+    }
+};
+
+// Sets up s for a job's line, from the job's cached scene. Returns an error message, or an
+// empty string.
+std::string prepare_job(const std::string& line, scene_cache& cache, scene& s) {
+    render_job job;
+    auto error = parse_job(line, job);
+    if (!error.empty()) {
+        return error;
+    }
+    const auto prototype = cache.get(job["scene"]);
+    if (!prototype) {
+        return "no scene named '" + job["scene"] + "'";
+    }
+    s = *prototype;
+    return apply_job(job, s);
+}
+
+// Answers a connection's job, on a thread of its own
+void serve(int connection, scene_cache& cache, worker_threads& workers) {
+    std::string line;
+    read_line(connection, line);
+
+    // A job that fails, by running out of memory for example, ends with an error reply
+    // rather than with the daemon and the other jobs
+    std::ostringstream reply;
+    try {
+        scene job;
+        const auto error = prepare_job(line, cache, job);
+        if (!error.empty()) {
+            reply << "error " << error << "\n";
+        } else {
+            // Its passes run on at most job.nthreads of the workers' threads
+            job.workers = &workers;
+            job.show_progress = false;
+            const auto start = std::chrono::steady_clock::now();
+            if (job.render()) {
+                reply << "ok " << std::fixed << std::setprecision(3)
+                      << std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start).count() << "\n";
+            } else {
+                reply << "error could not write '" << job.output_file << "'\n";
+            }
+        }
+    } catch (const std::exception& e) {
+        reply.str("");
+        reply << "error " << e.what() << "\n";
+    }
+    std::cerr << line << " -> " << reply.str();
+
+    // The client may have stopped waiting
+    write_all(connection, reply.str().data(), reply.str().size());
+    close(connection);
+}
+
+// Sends a job to a running daemon and prints its answer
+int send_job(const std::string& path, const std::string& line) {
+    const auto connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (connection < 0
+        || connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::perror(("ERROR: Could not connect to '" + path + "'").c_str());
+        return 1;
+    }
+    std::string reply;
+    if (!write_line(connection, line) || !read_line(connection, reply)) {
+        std::cerr << "ERROR: The daemon closed the connection.\n";
+        return 1;
+    }
+    close(connection);
+    std::cout << reply << "\n";
+    return reply.rfind("ok", 0) == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = "/tmp/ray-tracer.sock";
+    int thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::string job;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            path = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            thread_count = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--send" && i + 1 < argc) {
+            job = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--socket path] [--threads N]"
+                      << " [--send \"scene=... output=...\"]\n";
+            return 1;
+        }
+    }
+    if (!job.empty()) {
+        return send_job(path, job);
+    }
+
+    // A client that hangs up shouldn't end the daemon
+    std::signal(SIGPIPE, SIG_IGN);
+
+    const auto listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "ERROR: Socket path '" << path << "' is too long.\n";
+        return 1;
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (listener < 0
+        || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        || listen(listener, 16) != 0) {
+        std::perror(("ERROR: Could not listen on '" + path + "'").c_str());
+        return 1;
+    }
+    std::cerr << "Listening on " << path << " with " << thread_count << " threads\n";
+
+    scene_cache cache;
+    worker_threads workers{thread_count};
+    while (true) {
+        const auto connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            std::perror("accept");
+            continue;
+        }
+        std::thread{serve, connection, std::ref(cache), std::ref(workers)}.detach();
+    }
+}
@@ -0,0 +1,455 @@
+// Renders one image with several processes, on one host or several, over TCP. A coordinator
+// splits the image into units, tiles of the image times ranges of samples, and hands them to
+// the workers that connect to it; each worker renders a unit on all its threads and sends
+// back the sums of its samples. When every unit is in, the coordinator adds them up in the
+// order of the units and writes the image:
+//
+//     ./render-farm --coordinator [--bind host] [--port 7070] [--tile 64] [--unit-samples 100]
+//                   "<job>"
+//     ./render-farm --coordinator "scene=final_scene width=800 spp=1000 output=final.ppm"
+//     ./render-farm --worker host[:7070] [--threads N]
+//
+// The job is a line of key=value pairs, see render_job.h. Every sample takes random numbers
+// seeded from its pixel and its range (see scene::render_part), so the image is the same
+// however many workers render it, and whichever of them renders what. Workers on different
+// CPUs can run different versions of the kernels (see cpu_dispatch.h), whose results may
+// differ in the last bits; build with -DRENDER_NO_DISPATCH for the exact same image there.
+//
+// The coordinator listens on every address of its host unless --bind names one, and takes
+// any worker that connects, without authentication: bind it to a private address, or
+// firewall the port, on a network that isn't trusted.
+//
+// A unit is handed out again when its worker fails or disconnects, or when it takes more
+// than three times as long as units have taken on average, when another worker is idle.
+// Whichever copy of the unit comes back first is used. Only scenes rendered by plain path
+// tracing can be split this way, see scene::renders_in_parts().
+//
+// Protocol, one line each unless said otherwise:
+//     coordinator: job <job>
+//     worker:      ready, or error <message>
+//     coordinator: unit <id> <x> <y> <width> <height> <first sample> <samples>
+//     worker:      result <id>, then width * height * 3 doubles, in the host's byte order,
+//                  or error <message>
+//     ...
+//     coordinator: done
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./progress.h"
+#include "./render_job.h"
+#include "./scene.h"
+#include "./socket_io.h"
+#include "./scenes/scene_list.h"
+
+// Builds the scene a job names and applies its settings. Returns an error message, or an
+// empty string.
+std::string setup_job(const std::string& line, scene& s) {
+    render_job job;
+    auto error = parse_job(line, job);
+    if (!error.empty()) {
+        return error;
+    }
+    const auto named = find_scene(job["scene"]);
+    if (!named) {
+        return "no scene named '" + job["scene"] + "'";
+    }
+    named->build(s);
+    error = apply_job(job, s);
+    if (!error.empty()) {
+        return error;
+    }
+    if (!s.renders_in_parts()) {
+        return "scene '" + job["scene"] + "' can't be rendered in parts";
+    }
+    return "";
+}
+
+class coordinator {
+public:
+    coordinator(
+        const std::string& _job_line, const scene& _image, int tile_size, int unit_samples
+    ) : job_line(_job_line), image(_image),
+        progress(
+            static_cast<long long>(image.image_width) * image.height()
+                * image.samples_per_pixel, 1)
+    {
+        for (int y = 0; y < image.height(); y += tile_size) {
+            for (int x = 0; x < image.image_width; x += tile_size) {
+                for (int s = 0; s < image.samples_per_pixel; s += unit_samples) {
+                    unit u;
+                    u.x = x;
+                    u.y = y;
+                    u.width = std::min(tile_size, image.image_width - x);
+                    u.height = std::min(tile_size, image.height() - y);
+                    u.first_sample = s;
+                    u.samples = std::min(unit_samples, image.samples_per_pixel - s);
+                    units.push_back(u);
+                }
+            }
+        }
+    }
+
+    // Takes workers from listener until every unit is rendered, then writes the image.
+    // Returns false when it couldn't.
+    bool run(int listener) {
+        std::thread{[this, listener] {
+            while (true) {
+                const auto connection = accept(listener, nullptr, nullptr);
+                if (connection < 0) {
+                    // Like running out of file descriptors, which may pass as workers leave
+                    std::perror("accept");
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                    continue;
+                }
+                std::thread{&coordinator::serve, this, connection}.detach();
+            }
+        }}.detach();
+
+        {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [this] { return units_done == units.size(); });
+        }
+        progress.stop();
+
+        // Added up in the same order however the units were rendered, for the same image
+        std::vector<color> sums(static_cast<size_t>(image.image_width) * image.height());
+        for (const auto& u : units) {
+            for (int row = 0; row < u.height; row++) {
+                for (int i = 0; i < u.width; i++) {
+                    sums[(u.y + row) * image.image_width + u.x + i] +=
+                        u.sums[row * u.width + i];
+                }
+            }
+        }
+        for (auto& c : sums) {
+            c /= image.samples_per_pixel;
+        }
+        std::cerr << "\nRendered " << units.size() << " units on " << workers_seen
+                  << " workers, handed out again " << units_reissued << " times\n";
+        return image.write_image(image.output_file, sums);
+    }
+
+private:
+    struct unit {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+        int first_sample = 0;
+        int samples = 0;
+        // Workers rendering it now
+        int rendering = 0;
+        bool done = false;
+        std::chrono::steady_clock::time_point issued;
+        std::vector<color> sums;
+    };
+
+    const std::string job_line;
+    const scene& image;
+    std::vector<unit> units;
+    progress_meter progress;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t units_done = 0;
+    int workers_seen = 0;
+    int units_reissued = 0;
+    // Of the units done
+    double seconds_rendering = 0;
+
+    static constexpr size_t no_unit = static_cast<size_t>(-1);
+
+    // The next unit for a worker: one nobody renders, or else one that takes too long.
+    // Waits while there is none, and returns no_unit when all are done.
+    size_t next_unit() {
+        std::unique_lock lock(mutex);
+        while (units_done < units.size()) {
+            const auto now = std::chrono::steady_clock::now();
+            auto slowest = no_unit;
+            for (size_t id = 0; id < units.size(); id++) {
+                auto& u = units[id];
+                if (u.done) {
+                    continue;
+                }
+                if (u.rendering == 0) {
+                    return issue(id, now);
+                }
+                if (slowest == no_unit || u.issued < units[slowest].issued) {
+                    slowest = id;
+                }
+            }
+            // Only once there is an idea of how long units take
+            if (slowest != no_unit && units_done > 0) {
+                const auto average = seconds_rendering / units_done;
+                const auto taken = std::chrono::duration<double>(
+                    now - units[slowest].issued).count();
+                if (taken > 3 * average) {
+                    units_reissued++;
+                    return issue(slowest, now);
+                }
+            }
+            changed.wait_for(lock, std::chrono::seconds(1));
+        }
+        return no_unit;
+    }
+
+    // With the lock held
+    size_t issue(size_t id, std::chrono::steady_clock::time_point now) {
+        units[id].rendering++;
+        units[id].issued = now;
+        return id;
+    }
+
+    void finish(size_t id, std::vector<color>& sums, double seconds) {
+        std::scoped_lock lock(mutex);
+        auto& u = units[id];
+        u.rendering--;
+        if (!u.done) {
+            u.done = true;
+            u.sums = std::move(sums);
+            units_done++;
+            seconds_rendering += seconds;
+            progress.add(static_cast<long long>(u.width) * u.height * u.samples);
+        }
+        changed.notify_all();
+    }
+
+    // The worker failed, so the unit is free for another one
+    void release(size_t id) {
+        std::scoped_lock lock(mutex);
+        units[id].rendering--;
+        units_reissued++;
+        changed.notify_all();
+    }
+
+    // Talks to a worker, on a thread of its own
+    void serve(int connection) {
+        std::string line;
+        if (!write_line(connection, "job " + job_line) || !read_line(connection, line)
+            || line != "ready") {
+            std::cerr << "\nA worker couldn't start: " << line << "\n";
+            close(connection);
+            return;
+        }
+        {
+            std::scoped_lock lock(mutex);
+            workers_seen++;
+        }
+
+        for (auto id = next_unit(); id != no_unit; id = next_unit()) {
+            const auto& u = units[id];
+            std::ostringstream request;
+            request << "unit " << id << ' ' << u.x << ' ' << u.y << ' ' << u.width << ' '
+                    << u.height << ' ' << u.first_sample << ' ' << u.samples;
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<color> sums(static_cast<size_t>(u.width) * u.height);
+            const auto received = write_line(connection, request.str())
+                && read_line(connection, line) && line == "result " + std::to_string(id)
+                && read_all(connection, sums.data(), sums.size() * sizeof(color));
+            if (!received) {
+                std::cerr << "\nA worker failed, its unit " << id << " is handed out again\n";
+                release(id);
+                close(connection);
+                return;
+            }
+            finish(id, sums, std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+        write_line(connection, "done");
+        close(connection);
+    }
+};
+
+// Renders the units a coordinator sends until it is done. Returns the exit status.
+int work(int connection, int thread_count) {
+    std::string line;
+    if (!read_line(connection, line) || line.rfind("job ", 0) != 0) {
+        std::cerr << "ERROR: Expected a job from the coordinator.\n";
+        return 1;
+    }
+    scene s;
+    const auto error = setup_job(line.substr(4), s);
+    if (!error.empty()) {
+        std::cerr << "ERROR: " << error << "\n";
+        write_line(connection, "error " + error);
+        return 1;
+    }
+    s.nthreads = thread_count;
+    s.prepare();
+    if (!write_line(connection, "ready")) {
+        return 1;
+    }
+
+    static_assert(sizeof(color) == 3 * sizeof(double), "colors are sent as 3 doubles");
+    int units = 0;
+    while (read_line(connection, line) && line.rfind("unit ", 0) == 0) {
+        std::istringstream in{line.substr(5)};
+        size_t id;
+        int x, y, width, height, first_sample, samples;
+        in >> id >> x >> y >> width >> height >> first_sample >> samples;
+        const auto valid = in && x >= 0 && y >= 0 && width > 0 && height > 0
+            && width <= s.image_width - x && height <= s.height() - y
+            && first_sample >= 0 && samples > 0;
+        if (!valid) {
+            std::cerr << "ERROR: Invalid unit from the coordinator: " << line << "\n";
+            write_line(connection, "error invalid unit");
+            return 1;
+        }
+        const auto part = s.render_part(x, y, width, height, first_sample, samples);
+        if (!write_line(connection, "result " + std::to_string(id))
+            || !write_all(connection, part.sums.data(), part.sums.size() * sizeof(color))) {
+            break;
+        }
+        units++;
+    }
+    // The coordinator says done, or stops once it has all units
+    std::cerr << "Rendered " << units << " units\n";
+    return 0;
+}
+
+// Listens on port at host's address, or on every address, IPv6 and IPv4, when host is
+// empty. Returns -1 when it can't.
+int listen_on(const std::string& host, const std::string& port) {
+    addrinfo hints{};
+    hints.ai_family = host.empty() ? AF_INET6 : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) {
+        return -1;
+    }
+    auto listener = -1;
+    for (auto a = found; a != nullptr && listener < 0; a = a->ai_next) {
+        listener = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (listener < 0) {
+            continue;
+        }
+        const int off = 0;
+        const int on = 1;
+        if (a->ai_family == AF_INET6) {
+            setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
+        }
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (bind(listener, a->ai_addr, a->ai_addrlen) != 0 || listen(listener, 64) != 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return listener;
+}
+
+int main(int argc, char* argv[]) {
+    auto is_coordinator = false;
+    std::string address;
+    std::string bind_address;
+    std::string port = "7070";
+    int tile_size = 64;
+    int unit_samples = 100;
+    int thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::string job;
+    const auto usage = [&] {
+        std::cerr << "Usage: " << argv[0] << " --coordinator [--bind host] [--port P] [--tile N]"
+                  << " [--unit-samples N] \"scene=... output=...\"\n"
+                  << "       " << argv[0] << " --worker host[:port] [--threads N]\n";
+        return 1;
+    };
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--coordinator") {
+            is_coordinator = true;
+        } else if (arg == "--worker" && i + 1 < argc) {
+            address = argv[++i];
+        } else if (arg == "--bind" && i + 1 < argc) {
+            bind_address = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = argv[++i];
+        } else if (arg == "--tile" && i + 1 < argc) {
+            tile_size = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--unit-samples" && i + 1 < argc) {
+            unit_samples = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            thread_count = std::max(1, std::atoi(argv[++i]));
+        } else if (job.empty() && arg.rfind("--", 0) != 0) {
+            job = arg;
+        } else {
+            return usage();
+        }
+    }
+    if (is_coordinator == !address.empty() || is_coordinator == job.empty()) {
+        return usage();
+    }
+
+    // A worker that disconnects shouldn't end the coordinator
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (!is_coordinator) {
+        const auto colon = address.rfind(':');
+        if (colon != std::string::npos) {
+            port = address.substr(colon + 1);
+            address = address.substr(0, colon);
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(address.c_str(), port.c_str(), &hints, &found) != 0) {
+            std::cerr << "ERROR: Could not find '" << address << "'.\n";
+            return 1;
+        }
+        auto connection = -1;
+        for (auto a = found; a != nullptr && connection < 0; a = a->ai_next) {
+            connection = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (connection >= 0 && connect(connection, a->ai_addr, a->ai_addrlen) != 0) {
+                close(connection);
+                connection = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (connection < 0) {
+            std::perror(("ERROR: Could not connect to '" + address + ":" + port + "'").c_str());
+            return 1;
+        }
+        const auto status = work(connection, thread_count);
+        close(connection);
+        return status;
+    }
+
+    scene image;
+    const auto error = setup_job(job, image);
+    if (!error.empty()) {
+        std::cerr << "ERROR: " << error << "\n";
+        return 1;
+    }
+    if (image.output_file.empty()) {
+        std::cerr << "ERROR: The job needs an output.\n";
+        return 1;
+    }
+
+    const auto listener = listen_on(bind_address, port);
+    const auto where = (bind_address.empty() ? "" : bind_address + ":") + port;
+    if (listener < 0) {
+        std::perror(("ERROR: Could not listen on " + where).c_str());
+        return 1;
+    }
+    std::cerr << "Waiting for workers on " << where << "\n";
+
+    coordinator c{job, image, tile_size, unit_samples};
+    return c.run(listener) ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <exception>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "./scene.h"
+
+// A render job as render-daemon and render-farm take it, a line of key=value pairs:
+//
+//     scene      name of the scene, as in scenes/scene_list.h
+//     output     where to write the PPM image
+//     width, height, spp, threads
+//     lookfrom, lookat   camera position and target, as x,y,z
+//     vfov, aperture, focus
+//     progress   file to append progress to as JSON lines, see progress_meter
+using render_job = std::map<std::string, std::string>;
+
+// Limits on what a job may ask for, so that pixel and sample counts fit in an int and the
+// image buffers can be allocated
+constexpr long long max_job_pixels = 1 << 26;
+constexpr int max_job_samples = 1 << 20;
+
+// Returns an error message, or an empty string
+std::string parse_job(const std::string& line, render_job& job) {
+    std::istringstream in{line};
+    for (std::string pair; in >> pair;) {
+        const auto equals = pair.find('=');
+        if (equals == std::string::npos) {
+            return "expected key=value instead of '" + pair + "'";
+        }
+        job[pair.substr(0, equals)] = pair.substr(equals + 1);
+    }
+    if (job.count("scene") == 0 || job.count("output") == 0) {
+        return "a job needs a scene and an output";
+    }
+    return "";
+}
+
+// Reads x,y,z
+bool parse_vec3(const std::string& text, vec3& v) {
+    double x, y, z;
+    char comma1, comma2;
+    std::istringstream in{text};
+    if (!(in >> x >> comma1 >> y >> comma2 >> z) || comma1 != ',' || comma2 != ',') {
+        return false;
+    }
+    v = vec3{x, y, z};
+    return true;
+}
+
+// Sets what the job changes in a scene built as it names. Returns an error message, or an
+// empty string.
+std::string apply_job(const render_job& job, scene& s) {
+    for (const auto& [key, value] : job) {
+        auto valid = true;
+        try {
+            if (key == "scene") {
+                continue;
+            } else if (key == "output") {
+                s.output_file = value;
+            } else if (key == "width") {
+                s.image_width = std::stoi(value);
+                valid = s.image_width > 0;
+            } else if (key == "height") {
+                s.image_height = std::stoi(value);
+                valid = s.image_height > 0;
+            } else if (key == "spp") {
+                s.samples_per_pixel = std::stoi(value);
+                valid = s.samples_per_pixel > 0;
+            } else if (key == "threads") {
+                s.nthreads = std::stoi(value);
+                valid = s.nthreads > 0;
+            } else if (key == "lookfrom") {
+                valid = parse_vec3(value, s.cam.lookfrom);
+            } else if (key == "lookat") {
+                valid = parse_vec3(value, s.cam.lookat);
+            } else if (key == "vfov") {
+                s.cam.vfov = std::stod(value);
+            } else if (key == "aperture") {
+                s.cam.aperture = std::stod(value);
+            } else if (key == "focus") {
+                s.cam.focus_distance = std::stod(value);
+            } else if (key == "progress") {
+                s.progress_file = value;
+            } else {
+                return "unknown key '" + key + "'";
+            }
+        } catch (const std::exception&) {
+            valid = false;
+        }
+        if (!valid) {
+            return "invalid " + key + " '" + value + "'";
+        }
+    }
+    if (static_cast<long long>(s.image_width) * s.height() > max_job_pixels) {
+        return "too many pixels, at most " + std::to_string(max_job_pixels);
+    }
+    if (s.samples_per_pixel > max_job_samples) {
+        return "too many samples per pixel, at most " + std::to_string(max_job_samples);
+    }
+    return "";
+}
@@ -12,8 +12,8 @@ public:
         aabb child_box;
         has_aabb = child->bounding_box(0, 1, child_box);
 
-        point3 min{-infinity, -infinity, -infinity};
-        point3 max{infinity, infinity, infinity};
+        point3 min{infinity, infinity, infinity};
+        point3 max{-infinity, -infinity, -infinity};
 
         for (int i = 0; i < 2; i++) {
             for (int j = 0; j < 2; j++) {
@@ -43,19 +43,67 @@ public:
         ray rotated_r{origin, direction};
 
         if (child->hit(rotated_r, t_min, t_max, rec)) {
+            // Completed right away, as only here the record can be rotated back
+            rec.object->complete(rotated_r, rec);
             rec.p = rot.y_rotated(rec.p);
             rec.normal = rot.y_rotated(rec.normal);
+            rec.object = this;
             return true;
         } else {
             return false;
         }
     }
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        ray rotated_r{rot_inverse.y_rotated(r.origin()), rot_inverse.y_rotated(r.direction())};
+        return child->occluded(rotated_r, t_min, t_max);
+    }
+
     bool bounding_box(double time0, double time1, aabb& output_box) const override {
         output_box = box;
         return has_aabb;
     }
 
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        return child->pdf_value(rot_inverse.y_rotated(origin), rot_inverse.y_rotated(direction));
+    }
+
+    vec3 random(const point3& origin) const override {
+        return rot.y_rotated(child->random(rot_inverse.y_rotated(origin)));
+    }
+
+    bool sample_surface(point3& p, vec3& normal, double& area) const override {
+        if (!child->sample_surface(p, normal, area)) {
+            return false;
+        }
+        p = rot.y_rotated(p);
+        normal = rot.y_rotated(normal);
+        return true;
+    }
+
+    bool emission(emission_bounds& bounds) const override {
+        if (!child->emission(bounds)) {
+            return false;
+        }
+        bounds.axis = rot.y_rotated(bounds.axis);
+        auto min = rot.y_rotated(bounds.box.min());
+        auto max = min;
+        for (int corner = 1; corner < 8; corner++) {
+            const point3 p{
+                corner & 1 ? bounds.box.max().x() : bounds.box.min().x(),
+                corner & 2 ? bounds.box.max().y() : bounds.box.min().y(),
+                corner & 4 ? bounds.box.max().z() : bounds.box.min().z(),
+            };
+            const auto rotated = rot.y_rotated(p);
+            for (int c = 0; c < 3; c++) {
+                min[c] = std::min(min[c], rotated[c]);
+                max[c] = std::max(max[c], rotated[c]);
+            }
+        }
+        bounds.box = aabb{min, max};
+        return true;
+    }
+
 public:
     std::shared_ptr<hittable> child;
     rotation rot;
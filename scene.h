@@ -1,17 +1,34 @@
 #pragma once
 
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <numeric>
 #include <optional>
 #include <chrono>
-#include <iomanip>
+#include <string>
+#include <vector>
 
+#include "./ambient_medium.h"
+#include "./bidirectional.h"
 #include "./bvh.h"
 #include "./camera.h"
 #include "./color.h"
+#include "./counters.h"
+#include "./denoiser.h"
+#include "./environment_light.h"
+#include "./film.h"
+#include "./light_sampler.h"
 #include "./thread_pool.h"
 #include "./material.h"
+#include "./onb.h"
+#include "./path_guide.h"
 #include "./pdf.h"
+#include "./photon_map.h"
+#include "./progress.h"
+#include "./ray_counter.h"
+#include "./texture_registry.h"
+#include "./timeline.h"
 
 class camera_config {
 public:
@@ -23,31 +40,59 @@ public:
     double vfov = 20;
 };
 
+// What scene::ray_color() traces against, set up by scene::render()
+struct render_context {
+    const hittable& world_tree;
+    const light_sampler& light_tree;
+    // Caustics to gather at diffuse bounces, or nullptr
+    const photon_map* caustics;
+    // Learns where light comes from and aims bounces there, or nullptr
+    path_guide* guide;
+};
+
 class scene {
 public:
-    void render() {
-        auto image_height = static_cast<int>(image_width / aspect_ratio);
+    // Returns false when the image couldn't be written
+    bool render() {
+        const auto with_timeline = !timeline_file.empty();
+        if (with_timeline && !timeline::global().recording()) {
+            timeline::global().start();
+        }
+        const auto image_height = height();
+        auto camera = make_camera();
 
-        camera camera{
-            cam.lookfrom,
-            cam.lookat,
-            cam.up,
-            cam.vfov,
-            aspect_ratio,
-            cam.aperture,
-            cam.focus_distance
-        };
+        const auto build_start = std::chrono::steady_clock::now();
+        prepare();
+        stats = render_stats{};
+        stats.build_seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - build_start).count();
+        ray_counter world_tree{*prepared.bvh};
 
-        bvh_node world_tree{
-            world,
-            0,
-            0,
-        };
+        aabb world_box;
+        auto scene_radius = 1.0;
+        const auto light_tree = make_light_sampler(world_tree, world_box, scene_radius);
 
         std::vector<color> pixel_colors{
-            static_cast<size_t>(image_width * image_height), 
+            static_cast<size_t>(image_width) * image_height,
             color{0, 0, 0}
         };
+        // Sums over the samples of what they first see and of their squared luminance, for
+        // the denoiser
+        const auto with_features = denoise || !feature_images.empty();
+        std::vector<pixel_features> features;
+        std::vector<double> luminance_squares;
+        if (with_features) {
+            features.resize(pixel_colors.size());
+            luminance_squares.resize(pixel_colors.size());
+        }
+        // Traversal steps and path vertices of each pixel's samples, for the heatmaps
+        const auto with_heatmaps = counters_enabled && !heatmap_images.empty();
+        std::vector<long long> pixel_traversal;
+        std::vector<long long> pixel_vertices;
+        if (with_heatmaps) {
+            pixel_traversal.resize(pixel_colors.size());
+            pixel_vertices.resize(pixel_colors.size());
+        }
 
         std::vector<int> scanlines;
         for (int j = 0; j < image_height; j++) {
@@ -58,118 +103,774 @@ public:
         std::mt19937 g;
         std::shuffle(scanlines.begin(), scanlines.end(), g);
 
-        auto start = std::chrono::system_clock::now();
+        // Angle between the rays through neighbouring pixels, the spread of a camera ray's cone
+        const auto pixel_spread = 2 * std::tan(cam.vfov / 180.0 * pi / 2) / image_height;
 
-        pool<int> p{
-            scanlines,
-            [&] (int j) {
-                for (int i = 0; i < image_width; ++i) {
-                    color pixel_color;
-                    for (int s = 0; s < samples_per_pixel; s++) {
-                        auto u = (i + random_double()) / (image_width - 1);
-                        auto v = (j + random_double()) / (image_height - 1);
-                        auto r = camera.get_ray(u, v);
-                        pixel_color += ray_color(r, world_tree, max_depth);
+        // Without photon caustics or path guiding everything is one pass. With caustics
+        // every pass traces new photons, with a radius shrinking so the estimate converges
+        // (progressive photon mapping, as averaged in Knaus and Zwicker's probabilistic
+        // formulation). With guiding every pass samples from what the passes before it
+        // learned.
+        const auto photons = photon_caustics && method == integrator::path;
+        const auto guiding = path_guiding && method == integrator::path;
+        const auto pass_samples = photons || guiding
+            ? std::max(1, samples_per_pass) : samples_per_pixel;
+        const auto passes = (samples_per_pixel + pass_samples - 1) / pass_samples;
+        auto radius = photon_radius > 0 ? photon_radius : scene_radius / 500;
+        int pass = 0;
+        int samples = 0;
+        std::unique_ptr<photon_map> caustics;
+        std::unique_ptr<path_guide> guide;
+        if (guiding) {
+            guide = std::make_unique<path_guide>(world_box, guide_resolution);
+        }
+        render_context context{world_tree, light_tree, nullptr, guide.get()};
+
+        film splats{image_width, image_height};
+        bidirectional_tracer bidirectional{
+            world_tree, light_tree, atmosphere.get(), prepared.media, camera, splats, max_depth,
+            diffuse_spread
+        };
+
+        const auto render_start = std::chrono::steady_clock::now();
+        progress_meter progress{
+            static_cast<long long>(image_width) * image_height * samples_per_pixel, passes,
+            progress_file, show_progress
+        };
+
+        const auto trace_line = [&] (int j) {
+            timeline_span span{"scanline", "line", j};
+            for (int i = 0; i < image_width; ++i) {
+                render_counters before;
+                if (with_heatmaps) {
+                    before = thread_counters();
+                }
+                color pixel_color;
+                for (int s = 0; s < samples; s++) {
+                    count(&render_counters::samples);
+                    auto u = (i + random_double()) / (image_width - 1);
+                    auto v = (j + random_double()) / (image_height - 1);
+                    auto r = camera.get_ray(u, v);
+                    std::optional<feature_path> path;
+                    if (with_features) {
+                        path.emplace(feature_path{features[j * image_width + i]});
+                    }
+                    const auto features_seen = path ? &*path : nullptr;
+                    color sample;
+                    if (method == integrator::bidirectional) {
+                        sample = bidirectional.sample(
+                            r, ray_cone{0, pixel_spread}, features_seen);
+                    } else {
+                        sample = ray_color(
+                            r, context, max_depth, ray_cone{0, pixel_spread}, 0, false,
+                            features_seen);
+                    }
+                    pixel_color += sample;
+                    if (with_features) {
+                        const auto luminance = (sample.x() + sample.y() + sample.z()) / 3;
+                        luminance_squares[j * image_width + i] += luminance * luminance;
                     }
-                    pixel_colors[j * image_width + i] = pixel_color;
                 }
-            },
-            [&] (auto lines_left) {
-                std::cerr << "\rScanlines remaining: " << lines_left << " / " << image_height;
-
-                auto now = std::chrono::system_clock::now();
-                auto time_spend = std::chrono::duration_cast<std::chrono::seconds>(now - start).count();
-                auto seconds_spend = time_spend % 60;
-                auto minutes_spend = (time_spend / 60) % 60;
-                auto hours_spend = time_spend / (60 * 60);
+                pixel_colors[j * image_width + i] += pixel_color;
+                progress.add(samples);
+                if (with_heatmaps) {
+                    const auto& after = thread_counters();
+                    pixel_traversal[j * image_width + i] += after.traversal() - before.traversal();
+                    pixel_vertices[j * image_width + i] += after.vertices - before.vertices;
+                }
+            }
+            world_tree.flush();
+            flush_counters(stats.counters);
+        };
+        for (; pass < passes; pass++) {
+            progress.set_pass(pass);
+            samples = std::min(pass_samples, samples_per_pixel - pass * pass_samples);
+            if (photons) {
+                timeline_span span{"trace photons", "pass", pass};
+                caustics = std::make_unique<photon_map>(
+                    trace_photons(world_tree, light_tree), radius);
+                context.caustics = caustics.get();
+                radius *= std::sqrt((pass + 1 + photon_alpha) / (pass + 2));
+            }
+            pool<int>{scanlines, trace_line}.run(workers, nthreads);
+            if (guide) {
+                timeline_span span{"update guide", "pass", pass};
+                guide->update();
+            }
+        }
 
-                std::cerr << std::fixed << std::setprecision(2) << std::setfill('0');
-                std::cerr << " -- Time spend: " << hours_spend
-                        << ":" << std::setw(2) << minutes_spend
-                        << ":" << std::setw(2) << seconds_spend;
+        progress.stop();
 
-                auto time_left = static_cast<int>(1.0 * lines_left / (image_height - lines_left) * time_spend);
-                auto seconds_left = time_left % 60;
-                auto minutes_left = (time_left / 60) % 60;
-                auto hours_left = time_left / (60 * 60);
+        std::vector<color> image(pixel_colors.size());
+        for (int j = 0; j < image_height; j++) {
+            for (int i = 0; i < image_width; i++) {
+                image[j * image_width + i] =
+                    (pixel_colors[j * image_width + i] + splats.at(i, j)) / samples_per_pixel;
+            }
+        }
 
-                std::cerr << " -- Estimated time left: " << hours_left
-                                << ":" << std::setw(2) << minutes_left
-                                << ":" << std::setw(2) << seconds_left;
+        if (with_features) {
+            std::vector<double> variance(image.size());
+            for (size_t p = 0; p < image.size(); p++) {
+                auto& f = features[p];
+                f.albedo /= samples_per_pixel;
+                f.normal /= samples_per_pixel;
+                f.depth /= samples_per_pixel;
+                // Of the mean over the samples, which is what the image shows
+                const auto& c = pixel_colors[p];
+                const auto mean = (c.x() + c.y() + c.z()) / 3 / samples_per_pixel;
+                variance[p] = std::max(
+                    0.0, luminance_squares[p] / samples_per_pixel - mean * mean)
+                    / samples_per_pixel;
+            }
 
-                // Some extra white space to account for previous lines that where longer
-                std::cerr << "         " << std::flush;
+            if (!feature_images.empty()) {
+                std::vector<color> normals(image.size());
+                std::vector<color> depths(image.size());
+                auto farthest = 0.0;
+                for (const auto& f : features) {
+                    farthest = std::max(farthest, f.depth);
+                }
+                for (size_t p = 0; p < image.size(); p++) {
+                    normals[p] = 0.5 * (features[p].normal + color{1, 1, 1});
+                    const auto d = farthest > 0 ? features[p].depth / farthest : 0;
+                    depths[p] = color{d, d, d};
+                }
+                std::vector<color> albedos(image.size());
+                std::transform(
+                    features.begin(), features.end(), albedos.begin(),
+                    [] (const pixel_features& f) { return f.albedo; });
+                write_image(feature_images + "albedo.ppm", albedos);
+                write_image(feature_images + "normal.ppm", normals);
+                write_image(feature_images + "depth.ppm", depths);
             }
-        };
 
-        p.run(nthreads);
+            if (denoise) {
+                timeline_span span{"denoise"};
+                if (show_progress) {
+                    std::cerr << "\nDenoising";
+                }
+                image = denoiser{image_width, image_height, image, variance, features}
+                    .run(denoise_iterations, nthreads, workers);
+            }
+        }
 
         // Write the image
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-        
-        for (int j = image_height - 1; j >= 0; --j) {
-            for (int i = 0; i < image_width; ++i) {            
-                write_color(std::cout, pixel_colors[j * image_width + i], samples_per_pixel);
+        auto written = true;
+        {
+            timeline_span span{"write image"};
+            std::ofstream file;
+            if (!output_file.empty()) {
+                file.open(output_file);
+            }
+            auto& out = output_file.empty() ? std::cout : file;
+            out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+
+            for (int j = image_height - 1; j >= 0; --j) {
+                for (int i = 0; i < image_width; ++i) {
+                    write_color(out, image[j * image_width + i], 1);
+                }
+            }
+            out.flush();
+            if (!out) {
+                std::cerr << "\nERROR: Could not write '" << output_file << "'.\n";
+                written = false;
+            }
+        }
+
+        stats.render_seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - render_start).count();
+        stats.samples = static_cast<long long>(image_width) * image_height * samples_per_pixel;
+        stats.rays = world_tree.count();
+
+        if (show_progress) {
+            std::cerr << "\nDone\n";
+        }
+
+        const auto& tiles = *texture_registry::global().tiles;
+        if (tiles.misses() > 0) {
+            std::cerr << "Texture tiles: " << tiles.hits() << " hits, " << tiles.misses()
+                      << " misses, " << (tiles.capacity_bytes() >> 20) << " MB cache\n";
+        }
+
+        if (counters_enabled) {
+            stats.counters.report(std::cerr);
+        } else if (!heatmap_images.empty()) {
+            std::cerr << "ERROR: Heatmaps need counters, compile with -DRENDER_COUNTERS.\n";
+        }
+        if (with_heatmaps) {
+            write_heatmap(heatmap_images + "traversal.ppm", pixel_traversal,
+                "BVH nodes and primitive tests");
+            write_heatmap(heatmap_images + "path_length.ppm", pixel_vertices, "path vertices");
+        }
+        if (with_timeline) {
+            timeline::global().stop();
+            if (timeline::global().write(timeline_file)) {
+                std::cerr << "Timeline written to " << timeline_file << "\n";
             }
         }
+        return written;
+    }
 
-        std::cerr << "\nDone\n";
+    // Builds the BVH over world, unless the one built before is still over the same objects.
+    // Copies of the scene share it, so rendering a copy with another camera, size or sample
+    // count doesn't build it again.
+    void prepare() {
+        if (prepared.bvh && prepared.objects == world.objects) {
+            return;
+        }
+        timeline_span span{"build BVH"};
+        prepared.objects = world.objects;
+        prepared.bvh = std::make_shared<const bvh_node>(world, 0, 0);
+        prepared.media.clear();
+        for (const auto& object : world.objects) {
+            object->collect_media(object, prepared.media);
+        }
+    }
+
+    // The image's height in pixels
+    int height() const {
+        return image_height > 0 ? image_height : static_cast<int>(image_width / aspect_ratio);
+    }
+
+    // Whether render_part() can render this scene: passes of photon caustics and path
+    // guiding depend on the passes before them, and the denoiser on the whole image
+    bool renders_in_parts() const {
+        return method == integrator::path && !photon_caustics && !path_guiding && !denoise;
+    }
+
+    // Sums of the samples of a rectangle of the image, see render_part()
+    struct partial_image {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+        int samples = 0;
+        // Row by row from the bottom, like the image
+        std::vector<color> sums;
+    };
+
+    // Renders samples first_sample up to first_sample + samples of each pixel in the
+    // rectangle at (x, y), for rendering an image in parts, as render-farm does. The samples
+    // of a pixel take random numbers seeded from the pixel and first_sample, so the sums are
+    // the same whichever thread or process renders them. See renders_in_parts().
+    partial_image render_part(int x, int y, int width, int height, int first_sample, int samples) {
+        prepare();
+        const auto image_height = this->height();
+        const auto camera = make_camera();
+        const hittable& world_tree = *prepared.bvh;
+        aabb world_box;
+        auto scene_radius = 1.0;
+        const auto light_tree = make_light_sampler(world_tree, world_box, scene_radius);
+        render_context context{world_tree, light_tree, nullptr, nullptr};
+        const auto pixel_spread = 2 * std::tan(cam.vfov / 180.0 * pi / 2) / image_height;
+
+        partial_image part{x, y, width, height, samples};
+        part.sums.resize(static_cast<size_t>(width) * height);
+        std::vector<int> rows(height);
+        std::iota(rows.begin(), rows.end(), 0);
+        pool<int>{rows, [&] (int row) {
+            const auto j = y + row;
+            timeline_span span{"scanline", "line", j};
+            for (int i = x; i < x + width; ++i) {
+                seed_random({
+                    static_cast<unsigned int>(i), static_cast<unsigned int>(j),
+                    static_cast<unsigned int>(first_sample)
+                });
+                color pixel_color;
+                for (int s = 0; s < samples; s++) {
+                    auto u = (i + random_double()) / (image_width - 1);
+                    auto v = (j + random_double()) / (image_height - 1);
+                    pixel_color += ray_color(
+                        camera.get_ray(u, v), context, max_depth, ray_cone{0, pixel_spread},
+                        0, false);
+                }
+                part.sums[row * width + i - x] = pixel_color;
+            }
+        }}.run(workers, nthreads);
+        return part;
+    }
+
+    // Writes a linear image as a PPM file. Returns false when it couldn't.
+    bool write_image(const std::string& filename, const std::vector<color>& pixels) const {
+        timeline_span span{"write image", "file", filename};
+        std::ofstream out{filename};
+        out << "P3\n" << image_width << ' ' << pixels.size() / image_width << "\n255\n";
+        for (auto j = static_cast<int>(pixels.size() / image_width) - 1; j >= 0; --j) {
+            for (int i = 0; i < image_width; ++i) {
+                write_color(out, pixels[j * image_width + i], 1);
+            }
+        }
+        out.flush();
+        if (!out) {
+            std::cerr << "\nERROR: Could not write '" << filename << "'.\n";
+            return false;
+        }
+        return true;
     }
 
 public:
+    // What the last render() took
+    struct render_stats {
+        // Building the BVH
+        double build_seconds = 0;
+        // Everything after that, up to and including writing the image
+        double render_seconds = 0;
+        long long samples = 0;
+        // Rays traced against the scene, including shadow rays and photons
+        long long rays = 0;
+        // Only counted when compiled with RENDER_COUNTERS
+        render_counters counters;
+    };
+
+    // Path tracing from the camera, or bidirectional path tracing, which also traces paths
+    // from the lights and connects them to the camera's. That finds light coming through
+    // glass or scattered by smoke much more often, at a higher cost per sample.
+    enum class integrator { path, bidirectional };
+
     hittable_list world;
-    hittable_list lights;
+    render_stats stats;
+    integrator method = integrator::path;
+    light_sampler::strategy light_selection = light_sampler::strategy::bvh;
     camera_config cam;
     std::optional<color> background = std::nullopt;
+    // Lights the scene from all directions instead of the background
+    std::shared_ptr<environment_light> environment;
+    // Haze or atmosphere filling the whole scene
+    std::shared_ptr<ambient_medium> atmosphere;
 
     int image_width = 100;
     double aspect_ratio = 1.0;
+    // When not 0, sets the image's height, and with it its aspect ratio, instead
+    int image_height = 0;
     int samples_per_pixel = 10;
     int max_depth = 50;
     int nthreads = 4;
 
+    // Photon caustics and path guiding render in passes of this many samples per pixel
+    int samples_per_pass = 4;
+
+    // Caustics, light reaching a diffuse surface only through mirrors and glass, are
+    // estimated from photons traced from the lights instead of by paths from the camera,
+    // which can't find a small light through glass. Every pass traces photons_per_pass
+    // photons. Only for path tracing.
+    bool photon_caustics = false;
+    int photons_per_pass = 200000;
+    // Initial radius around a point in which photons are gathered, 0 picks one from the
+    // scene size. Larger is smoother but blurrier, until enough passes shrink it.
+    double photon_radius = 0;
+    // How quickly the radius shrinks, between 0 and 1: less is faster
+    double photon_alpha = 2.0 / 3;
+
+    // Diffuse bounces are partly aimed where earlier passes found light coming from, which
+    // helps where light arrives through narrow gaps. Only for path tracing.
+    bool path_guiding = false;
+    // Cells of the guide's grid along the longest side of the scene
+    int guide_resolution = 16;
+    // Part of the bounces aimed by the guide, the rest samples the material as usual
+    double guide_fraction = 0.5;
+
+    // Filters the noise out of the finished image, guided by what the camera rays first see,
+    // so a clean image takes far fewer samples per pixel. More iterations smooth over larger
+    // areas.
+    bool denoise = false;
+    int denoise_iterations = 5;
+    // With counters compiled in, writes heatmaps of the work per sample in each pixel to
+    // images named with this prefix: "frame-" writes frame-traversal.ppm (BVH nodes visited
+    // and primitives tested) and frame-path_length.ppm (path vertices).
+    std::string heatmap_images;
+
+    // Writes the image to this file instead of standard output
+    std::string output_file;
+    // Shows progress on std::cerr while rendering
+    bool show_progress = true;
+    // Threads shared with other renders to render on, instead of starting nthreads threads
+    // of its own. nthreads still limits how many of them it uses.
+    worker_threads* workers = nullptr;
+
+    // Appends a line of JSON with the progress to this file twice a second, for tools that
+    // watch renders. See progress_meter.
+    std::string progress_file;
+
+    // Records what every thread did when to a Chrome trace with this name, to be opened in
+    // chrome://tracing or ui.perfetto.dev. Textures are loaded while the scene is built, so
+    // to see them too, call timeline::global().start() before building it.
+    std::string timeline_file;
+
+    // Also writes what the camera rays first see to images named with this prefix: "frame-"
+    // writes frame-albedo.ppm, frame-normal.ppm and frame-depth.ppm. Empty writes none.
+    std::string feature_images;
+
 private:
-    color ray_color(const ray& r, const hittable& world_tree, int depth) {
+    // The BVH built by prepare(), and the objects it was built over
+    struct prepared_world {
+        std::vector<std::shared_ptr<hittable>> objects;
+        std::shared_ptr<const bvh_node> bvh;
+        // What shadow rays pass through, see hittable::collect_media()
+        std::vector<std::shared_ptr<hittable>> media;
+    };
+    prepared_world prepared;
+
+    // Lower bound of the spread of a ray's cone after a diffuse bounce. Textures seen through
+    // rough reflections are blurry anyway, so lookups can use coarse mip levels.
+    static constexpr double diffuse_spread = 0.1;
+
+    // Weight of a sample taken with density pdf, when the same path could also have been
+    // found by a strategy with density other_pdf (multiple importance sampling)
+    static double power_heuristic(double pdf, double other_pdf) {
+        const auto a = pdf * pdf;
+        const auto b = other_pdf * other_pdf;
+        return a + b > 0 ? a / (a + b) : 0;
+    }
+
+    // scatter_pdf is the density with which r was sampled by a diffuse bounce, or 0 when
+    // light sampling couldn't have found the same path (camera rays, mirror reflections).
+    // gathered is set when the last diffuse bounce took caustics from the caustics photon
+    // map, which then already holds any light found through mirrors and glass from there.
+    // features, when given, gets what the path first sees.
+    color ray_color(
+        const ray& r, const render_context& context, int depth, ray_cone cone,
+        double scatter_pdf, bool gathered, feature_path* features = nullptr
+    ) {
         if (depth <= 0) {
+            if (features) {
+                features->end();
+            }
             return color{0, 0, 0};
         }
 
         hit_record rec;
-        if (world.hit(r, 0.001, infinity, rec)) {
+        bool hit_anything = context.world_tree.hit(r, 0.001, infinity, rec);
+        if (hit_anything) {
+            rec.object->complete(r, rec);
+        }
+        if (atmosphere && atmosphere->sample(r, 0.001, hit_anything ? rec.t : infinity, rec)) {
+            hit_anything = true;
+        }
+
+        if (hit_anything) {
+            count(&render_counters::vertices);
             // Normals: 
             //return 0.5 * (rec.normal + color{1, 1, 1});
 
+            const auto length = rec.t * r.direction().length();
+            const auto width = cone.width_at(length);
+            rec.uv_footprint = width * rec.uv_per_unit;
+
             scatter_record srec;
             color emitted = rec.material->emitted(r, rec);
+            if (scatter_pdf > 0 && emitted.length_squared() > 0) {
+                emitted *= power_heuristic(
+                    scatter_pdf, context.light_tree.pdf_value(r.origin(), r.direction()));
+            } else if (gathered) {
+                emitted = color{0, 0, 0};
+            }
 
-            if (rec.material->scatter(r, rec, srec)) {
+            const auto scatters = rec.material->scatter(r, rec, srec);
+            if (features) {
+                if (!scatters) {
+                    features->stop(length, rec.normal);
+                } else if (srec.pdf != nullptr) {
+                    features->scatter(
+                        length, srec.attenuation, rec.normal, rec.material->volumetric());
+                } else {
+                    features->pass(length, srec.attenuation);
+                }
+            }
+            if (scatters) {
                 if (srec.pdf != nullptr) {
-                    auto p0 = std::make_shared<hittable_pdf>(lights, rec.p);
-                    mixture_pdf mix_pdf{p0, srec.pdf, 0.1};
+                    if (context.guide) {
+                        // Light sampling is weighed against the mixture, the density with
+                        // which bounces are actually sampled
+                        auto guided = context.guide->distribution(rec.p);
+                        if (guided) {
+                            srec.pdf = std::make_shared<mixture_pdf>(
+                                guided, srec.pdf, guide_fraction);
+                        }
+                    }
+
+                    auto direct = sample_light(
+                        r, rec, srec, context.world_tree, context.light_tree);
+                    const auto gather = context.caustics != nullptr
+                        && !rec.material->volumetric();
+                    if (gather) {
+                        direct += context.caustics->radiance(r, rec, srec.attenuation);
+                    }
 
-                    ray scattered{rec.p, mix_pdf.generate()};
-                    auto pdf_value = mix_pdf.value(scattered.direction());
+                    ray scattered{rec.p, srec.pdf->generate()};
+                    ray_cone diffuse_cone{width, std::max(cone.spread, diffuse_spread)};
+                    auto pdf_value = srec.pdf->value(scattered.direction());
+                    // Guided directions can point where the material doesn't scatter to
+                    const auto scattering = rec.material->scattering_pdf(r, rec, scattered);
+                    if (pdf_value <= 0 || scattering <= 0) {
+                        return emitted + direct;
+                    }
 
-                    return emitted
-                        + srec.attenuation * rec.material->scattering_pdf(r, rec, scattered)
-                                        * ray_color(scattered, world, depth - 1) / pdf_value;
+                    const auto incoming = ray_color(
+                        scattered, context, depth - 1, diffuse_cone, pdf_value, gather);
+                    if (context.guide) {
+                        context.guide->record(rec.p, scattered.direction(), incoming, pdf_value);
+                    }
+                    return emitted + direct
+                        + srec.attenuation * scattering * incoming / pdf_value;
                 } else {
                     return emitted 
-                        + srec.attenuation * ray_color(srec.skip_pdf_ray, world_tree, depth - 1);
+                        + srec.attenuation * ray_color(
+                            srec.skip_pdf_ray, context, depth - 1, ray_cone{width, cone.spread},
+                            0, gathered, features);
                 }
             } else {
                 return emitted;
             }
         } else { // nothing hit
-            if (background.has_value()) {
-                return background.value();
-            } else {
-                // Sky box:
-                auto unit_direction = r.direction().normalized();
-                auto s = 0.5 * (unit_direction.y() + 1.0);
-                return (1.0 - s) * color{1.0, 1.0, 1.0} + s * color{0.5, 0.7, 1.0};
+            if (features) {
+                features->end();
+            }
+            const auto& light_tree = context.light_tree;
+            if (!light_tree.environment) {
+                return color{0, 0, 0};
+            }
+            auto radiance = light_tree.environment->radiance(r.direction());
+            if (scatter_pdf > 0) {
+                radiance *= power_heuristic(
+                    scatter_pdf, light_tree.pdf_value(r.origin(), r.direction()));
+            }
+            return radiance;
+        }
+    }
+
+    // Fraction of light that passes through the atmosphere and the media along a shadow ray
+    double transmittance_along(const ray& r, double t_min, double t_max) const {
+        auto fraction = atmosphere ? atmosphere->transmittance(r, t_min, t_max) : 1.0;
+        for (const auto& medium : prepared.media) {
+            if (fraction <= 0) {
+                break;
+            }
+            fraction *= medium->transmittance(r, t_min, t_max);
+        }
+        return fraction;
+    }
+
+    camera make_camera() const {
+        return camera{
+            cam.lookfrom,
+            cam.lookat,
+            cam.up,
+            cam.vfov,
+            image_height > 0 ? 1.0 * image_width / image_height : aspect_ratio,
+            cam.aperture,
+            cam.focus_distance
+        };
+    }
+
+    // Samples every emitting primitive in the world directly. Also sets the box around the
+    // world and the scene's radius.
+    light_sampler make_light_sampler(
+        const hittable& world_tree, aabb& world_box, double& scene_radius
+    ) const {
+        std::vector<std::shared_ptr<hittable>> emitters;
+        for (const auto& object : world.objects) {
+            object->collect_emitters(object, emitters);
+        }
+        if (world_tree.bounding_box(0, 0, world_box)) {
+            scene_radius = std::max(
+                scene_radius, 0.5 * (world_box.max() - world_box.min()).length());
+        }
+        return light_sampler{emitters, light_selection, sky(), scene_radius};
+    }
+
+    // Writes the per pixel sums of a counter as a heatmap. White is the 99th percentile, so a
+    // few extreme pixels don't leave all others black.
+    void write_heatmap(
+        const std::string& filename, const std::vector<long long>& sums, const char* what
+    ) const {
+        std::vector<double> per_sample(sums.size());
+        for (size_t p = 0; p < sums.size(); p++) {
+            per_sample[p] = 1.0 * sums[p] / samples_per_pixel;
+        }
+        auto sorted = per_sample;
+        const auto top = sorted.begin() + sorted.size() * 99 / 100;
+        std::nth_element(sorted.begin(), top, sorted.end());
+        const auto scale = *top > 0 ? *top : 1;
+
+        std::vector<color> pixels(sums.size());
+        for (size_t p = 0; p < sums.size(); p++) {
+            // write_image() applies the gamma, these colors are meant as they are
+            const auto c = heat(per_sample[p] / scale);
+            pixels[p] = c * c;
+        }
+        write_image(filename, pixels);
+        std::cerr << filename << ": white is " << scale << " " << what << " per sample\n";
+    }
+
+    // Traces photons_per_pass photons from the lights through mirrors and glass, and keeps
+    // those that reach a diffuse surface that way. Photons that hit a diffuse surface or
+    // scatter in a medium first are left to the paths from the camera.
+    std::vector<photon> trace_photons(
+        const ray_counter& world_tree, const light_sampler& light_tree
+    ) {
+        const int batch_count = 256;
+        std::vector<std::vector<photon>> batches(batch_count);
+        std::vector<int> work(batch_count);
+        std::iota(work.begin(), work.end(), 0);
+        pool<int>{
+            work,
+            [&] (int b) {
+                timeline_span span{"photon batch", "batch", b};
+                const auto count = photons_per_pass / batch_count
+                    + (b < photons_per_pass % batch_count ? 1 : 0);
+                for (int i = 0; i < count; i++) {
+                    trace_photon(world_tree, light_tree, batches[b]);
+                }
+                world_tree.flush();
+                flush_counters(stats.counters);
+            },
+            [] (int) {}
+        }.run(workers, nthreads);
+
+        std::vector<photon> photons;
+        for (const auto& batch : batches) {
+            photons.insert(photons.end(), batch.begin(), batch.end());
+        }
+        return photons;
+    }
+
+    void trace_photon(
+        const hittable& world_tree, const light_sampler& light_tree, std::vector<photon>& photons
+    ) {
+        double probability;
+        const auto i = light_tree.sample_emitter(random_double(), probability);
+        if (i < 0) {
+            return;
+        }
+        point3 origin;
+        vec3 normal;
+        double area;
+        color radiance;
+        if (!light_tree.sample_emission(i, origin, normal, area, radiance)) {
+            return;
+        }
+        // Leaving in a cosine weighted direction, the flux a photon carries is pi times
+        // the radiance, over the densities of the light, the point and the photon count
+        auto power = radiance * pi * area / (probability * photons_per_pass);
+
+        onb uvw;
+        uvw.build_from_w(normal);
+        ray r{origin, uvw.local(random_cosine_direction())};
+        auto specular = false;
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            const auto hit_anything = world_tree.hit(r, 0.001, infinity, rec);
+            if (atmosphere && atmosphere->sample(r, 0.001, hit_anything ? rec.t : infinity, rec)) {
+                return;
+            }
+            if (!hit_anything) {
+                return;
+            }
+            rec.object->complete(r, rec);
+
+            scatter_record srec;
+            if (!rec.material->scatter(r, rec, srec)) {
+                return;
+            }
+            if (srec.pdf == nullptr) {
+                power = power * srec.attenuation;
+                r = srec.skip_pdf_ray;
+                specular = true;
+                continue;
+            }
+            if (specular && !rec.material->volumetric()) {
+                photons.emplace_back(rec.p, -r.direction().normalized(), power);
+            }
+            return;
+        }
+    }
+
+    // The light from outside the scene: the environment map, else a non-black background
+    // color, else a sky gradient
+    std::shared_ptr<const environment_light> sky() const {
+        if (environment) {
+            return environment;
+        }
+        if (background.has_value()) {
+            const auto c = background.value();
+            if (c.length_squared() == 0) {
+                return nullptr;
             }
+            return std::make_shared<environment_light>([c](const vec3&) { return c; }, 1, 1);
         }
+        return std::make_shared<environment_light>([](const vec3& direction) {
+            auto s = 0.5 * (direction.y() + 1.0);
+            return (1.0 - s) * color{1.0, 1.0, 1.0} + s * color{0.5, 0.7, 1.0};
+        });
+    }
+
+    // Light reaching rec.p straight from a light picked by light_tree and scattered along r,
+    // weighted against finding it by scattering instead
+    color sample_light(
+        const ray& r, const hit_record& rec, const scatter_record& srec,
+        const hittable& world_tree, const light_sampler& light_tree
+    ) {
+        double probability;
+        const auto i = light_tree.sample(rec.p, random_double(), probability);
+        if (i == light_sampler::environment_index) {
+            return sample_environment(r, rec, srec, world_tree, light_tree, probability);
+        }
+        if (i < 0) {
+            return color{0, 0, 0};
+        }
+
+        const auto& light = light_tree.light(i);
+        const ray to_light{rec.p, light.random(rec.p)};
+        hit_record light_rec;
+        if (!light.hit(to_light, 0.001, infinity, light_rec)) {
+            return color{0, 0, 0};
+        }
+        light_rec.object->complete(to_light, light_rec);
+        const auto emitted = light_rec.material->emitted(to_light, light_rec);
+        const auto scattering_pdf = rec.material->scattering_pdf(r, rec, to_light);
+        const auto light_pdf = probability * light.pdf_value(rec.p, to_light.direction());
+        if (emitted.length_squared() == 0 || scattering_pdf <= 0 || light_pdf <= 0) {
+            return color{0, 0, 0};
+        }
+
+        // Shadow ray, stopping just short of the light itself
+        count(&render_counters::shadow_rays);
+        if (world_tree.occluded(to_light, 0.001, light_rec.t * (1 - 1e-6))) {
+            return color{0, 0, 0};
+        }
+        const auto transmittance = transmittance_along(to_light, 0.001, light_rec.t);
+
+        // Weighed with the density of all lights together in this direction, the same density
+        // a bounce that hits a light is weighed with
+        const auto weight = power_heuristic(
+            light_tree.pdf_value(rec.p, to_light.direction()),
+            srec.pdf->value(to_light.direction()));
+        return transmittance * weight * srec.attenuation * scattering_pdf * emitted / light_pdf;
+    }
+
+    color sample_environment(
+        const ray& r, const hit_record& rec, const scatter_record& srec,
+        const hittable& world_tree, const light_sampler& light_tree, double probability
+    ) {
+        double environment_pdf;
+        const ray to_light{rec.p, light_tree.environment->sample(environment_pdf)};
+        const auto scattering_pdf = rec.material->scattering_pdf(r, rec, to_light);
+        const auto light_pdf = probability * environment_pdf;
+        if (scattering_pdf <= 0 || light_pdf <= 0) {
+            return color{0, 0, 0};
+        }
+        count(&render_counters::shadow_rays);
+        if (world_tree.occluded(to_light, 0.001, infinity)) {
+            return color{0, 0, 0};
+        }
+        const auto transmittance = transmittance_along(to_light, 0.001, infinity);
+
+        const auto weight = power_heuristic(
+            light_tree.pdf_value(rec.p, to_light.direction()),
+            srec.pdf->value(to_light.direction()));
+        return transmittance * weight * srec.attenuation * scattering_pdf
+            * light_tree.environment->radiance(to_light.direction()) / light_pdf;
     }
 };
@@ -27,10 +27,7 @@ void cornell_box_and_glass(scene& scene) {
     auto white = std::make_shared<lambertian>(color{0.73, 0.73, 0.73});
     auto glass = std::make_shared<dielectric>(1.5);
 
-    auto glass_sphere = std::make_shared<sphere>(point3{190, 90, 190}, 90, glass);
-    objects.add(glass_sphere);
-
-    scene.lights.add(glass_sphere);
+    objects.add(std::make_shared<sphere>(point3{190, 90, 190}, 90, glass));
 
     auto box2 = std::make_shared<translate>(
         std::make_shared<rotate_y>(
@@ -5,6 +5,7 @@
 #include "../scene.h"
 #include "../translation.h"
 #include "../csg.h"
+#include "../csg_program.h"
 #include "../sphere.h"
 #include "../dielectric.h"
 #include "./cornell_box.h"
@@ -36,9 +37,8 @@ void cornell_box_csg(scene& scene) {
         );
         objects.add(
             std::make_shared<translate>(
-                std::make_shared<fusion>(
-                    ball,
-                    cut_out
+                std::make_shared<compiled_csg>(
+                    csg_fusion({csg_leaf(ball), csg_leaf(cut_out)})
                 ),
                 vec3{160, 120, 405}
             )
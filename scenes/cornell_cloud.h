@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+
+#include "../scene.h"
+#include "../heterogeneous_medium.h"
+#include "../voxel_grid.h"
+#include "../perlin.h"
+#include "./cornell_box.h"
+
+void cornell_cloud(scene& scene) {
+    scene.background = color{0, 0, 0};
+    scene.aspect_ratio = 1.0;
+    scene.image_width = 400;
+    scene.samples_per_pixel = 400;
+    scene.cam.lookfrom = point3{278, 278, -800};
+    scene.cam.lookat = point3{278, 278, 0};
+    scene.cam.vfov = 40.0;
+
+    empty_cornell_box(scene);
+
+    // A simulation cache can be used instead with voxel_grid::load("cloud.vxg")
+    auto grid = std::make_shared<voxel_grid>(96, 64, 96, point3{80, 150, 130}, 4.0);
+    grid->fill_from_perlin(perlin{}, 0.02, 0.05);
+
+    scene.world.add(std::make_shared<heterogeneous_medium>(grid, 0.3, color{0.9, 0.9, 0.9}));
+}
@@ -12,7 +12,9 @@
 void cornell_smoke(scene& scene) {
     scene.aspect_ratio = 1.0;
     scene.image_width = 600;
-    scene.samples_per_pixel = 1500;
+    // Light scattered by the smoke is found from the light's side as well
+    scene.method = scene::integrator::bidirectional;
+    scene.samples_per_pixel = 1000;
     scene.cam.lookfrom = point3{278, 278, -800};
     scene.cam.lookat = point3{278, 278, 0};
     scene.cam.vfov = 40.0;
@@ -46,9 +46,7 @@ void final_scene(scene& scene_desc) {
     world.add(std::make_shared<bvh_node>(boxes1, 0, 1));
 
     auto light = std::make_shared<diffuse_light>(color(7, 7, 7));
-    auto light_obj = std::make_shared<xz_rect>(123, 423, 147, 413, 554, -1, light);
-    world.add(light_obj);
-    scene_desc.lights.add(light_obj);
+    world.add(std::make_shared<xz_rect>(123, 423, 147, 413, 554, -1, light));
 
     auto center1 = point3(400, 400, 200);
     // auto center2 = center1 + vec3(30,0,0);
@@ -63,8 +61,7 @@ void final_scene(scene& scene_desc) {
     auto boundary = std::make_shared<sphere>(point3(360,150,145), 70, std::make_shared<dielectric>(1.5));
     world.add(boundary);
     world.add(std::make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = std::make_shared<sphere>(point3(0,0,0), 5000, std::make_shared<dielectric>(1.5));
-    world.add(std::make_shared<constant_medium>(boundary, .0001, color(1,1,1)));
+    scene_desc.atmosphere = std::make_shared<ambient_medium>(.0001, color(1,1,1), 0, 0, 5000);
 
     auto emat = std::make_shared<lambertian>(std::make_shared<image_texture>("Blue_Marble_2002.png"));
     world.add(std::make_shared<sphere>(point3(400,200,400), 100, emat));
@@ -1,12 +1,17 @@
 #pragma once
 
 #include "../scene.h"
+#include "../csg_program.h"
 
 void lens_setup(scene& scene) {
     scene.background = color{0, 0, 0};
     scene.aspect_ratio = 3.0/2.0;
     scene.image_width = 600;
-    scene.samples_per_pixel = 10000;
+    // The image the lens projects onto the screen is a caustic, lit only through the glass
+    scene.samples_per_pixel = 64;
+    scene.photon_caustics = true;
+    scene.photons_per_pass = 1000000;
+    scene.photon_radius = 1;
     scene.cam.lookfrom = point3{-120, 120, 0};
     scene.cam.lookat = point3{60, 0, 0};
     scene.cam.vfov = 24;
@@ -36,17 +41,19 @@ void lens_setup(scene& scene) {
     auto lens_x = 40.0;
     auto glass = std::make_shared<dielectric>(1.5);
     objects.add(
-        std::make_shared<intersection>(
-            std::make_shared<sphere>(
-                point3{lens_x + -R + d/2, 0, 0},
-                R,
-                glass
-            ),
-            std::make_shared<sphere>(
-                point3{lens_x + R - d/2, 0, 0},
-                R,
-                glass
-            )
+        std::make_shared<compiled_csg>(
+            csg_intersection({
+                csg_leaf(std::make_shared<sphere>(
+                    point3{lens_x + -R + d/2, 0, 0},
+                    R,
+                    glass
+                )),
+                csg_leaf(std::make_shared<sphere>(
+                    point3{lens_x + R - d/2, 0, 0},
+                    R,
+                    glass
+                ))
+            })
         )
     );
 
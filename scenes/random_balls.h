@@ -7,6 +7,7 @@
 #include "../sphere.h"
 #include "../bumpy_sphere.h"
 #include "../checker_texture.h"
+#include "../image_texture.h"
 
 void random_scene(scene& scene) {
     scene.cam.lookfrom = point3{13, 2, 3};
@@ -17,6 +18,9 @@ void random_scene(scene& scene) {
 
     hittable_list& world = scene.world;
 
+    // Decode the images in parallel up front; every textured ball below then shares them
+    texture_registry::global().preload({"2k_mars.jpg", "Blue_Marble_2002.png", "2k_sun.jpg"});
+
     auto checker = std::make_shared<spatial_checker_texture>(
         color{0.2, 0.3, 0.1}, color{0.9, 0.9, 0.9}, 10);
     auto ground_material = std::make_shared<lambertian>(checker);
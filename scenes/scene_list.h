@@ -0,0 +1,57 @@
+#pragma once
+
+// The scenes by name, for the tools in bench/, the render daemon and the render farm
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../scene.h"
+
+#include "./cornell_box.h"
+#include "./cornell_box_2.h"
+#include "./cornell_box_csg.h"
+#include "./cornell_box_two_boxes.h"
+#include "./cornell_smoke.h"
+#include "./cornell_box_and_glass.h"
+#include "./cornell_cloud.h"
+#include "./earth.h"
+#include "./lens_setup.h"
+#include "./random_balls.h"
+#include "./simple_light.h"
+#include "./three_spheres.h"
+#include "./three_spheres_light.h"
+#include "./two_perlin_spheres.h"
+#include "./final.h"
+
+struct named_scene {
+    const char* name;
+    std::function<void(scene&)> build;
+};
+
+const std::vector<named_scene> scenes{
+    {"three_spheres", three_spheres},
+    {"three_spheres_light", three_spheres_light},
+    {"random_scene", random_scene},
+    {"two_perlin_spheres", two_perlin_spheres},
+    {"earth", earth},
+    {"simple_light", simple_light},
+    {"cornell_box", cornell_box},
+    {"cornell_box_2", cornell_box_2},
+    {"cornell_box_and_glass", cornell_box_and_glass},
+    {"cornell_box_csg", cornell_box_csg},
+    {"cornell_smoke", cornell_smoke},
+    {"cornell_cloud", cornell_cloud},
+    {"lens_setup", lens_setup},
+    {"final_scene", final_scene},
+};
+
+// The scene with this name, or nullptr
+const named_scene* find_scene(const std::string& name) {
+    for (const auto& s : scenes) {
+        if (s.name == name) {
+            return &s;
+        }
+    }
+    return nullptr;
+}
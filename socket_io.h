@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+
+// Blocking reads and writes of whole messages on a socket, for render-daemon and render-farm.
+// Each returns false when the connection failed or was closed first.
+
+bool write_all(int connection, const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        const auto n = send(connection, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_line(int connection, const std::string& line) {
+    const auto text = line + "\n";
+    return write_all(connection, text.data(), text.size());
+}
+
+bool read_all(int connection, void* data, size_t size) {
+    auto bytes = static_cast<char*>(data);
+    while (size > 0) {
+        const auto n = recv(connection, bytes, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// The longest line read_line() takes; jobs, units and results are far shorter
+constexpr size_t max_line_length = 4096;
+
+// Without the newline. Lines are short, so it reads byte by byte rather than keep a buffer.
+// A line longer than max_line_length fails like a closed connection, and is dropped.
+bool read_line(int connection, std::string& line) {
+    line.clear();
+    char c;
+    while (read_all(connection, &c, 1)) {
+        if (c == '\n') {
+            return true;
+        }
+        if (line.size() == max_line_length) {
+            line.clear();
+            return false;
+        }
+        line += c;
+    }
+    return false;
+}
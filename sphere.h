@@ -1,6 +1,7 @@
 #pragma once
 
 #include "./vec3.h"
+#include "./counters.h"
 #include "./hittable.h"
 #include "./material.h"
 
@@ -11,34 +12,31 @@ public:
       : center(center), radius(radius), material(material) {};
 
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        const vec3 oc = r.origin() - center;
-        const auto a = dot(r.direction(), r.direction());
-        const auto b = 2.0 * dot(oc, r.direction());
-        const auto c = dot(oc, oc) - radius*radius;
-        const auto discriminant = b * b - 4 * a * c;
-        if (discriminant < 0) {
+        double root;
+        if (!count_test(intersect(r, t_min, t_max, root))) {
             return false;
-        } else {
-            auto sqrtd = sqrt(discriminant);
+        }
 
-            // Find the nearest root that lies in the acceptable range.
-            auto root = (-b - sqrtd) / a / 2;
-            if (root < t_min || root > t_max) {
-                root = (- b + sqrtd) / a / 2;
-                if (root < t_min || root > t_max) {
-                    return false;
-                }
-            }
+        rec.t = root;
+        rec.front_face = dot(r.direction(), r.at(root) - center) < 0;
+        rec.object = this;
+        return true;
+    }
 
-            rec.t = root;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
+    void complete(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        if (material->uses_uv()) {
             get_sphere_uv(outward_normal, rec.u, rec.v);
-            rec.material = material;
-
-            return true;
+            rec.uv_per_unit = 1 / (pi * radius);
         }
+        rec.material = material;
+    }
+
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        double root;
+        return count_test(intersect(r, t_min, t_max, root));
     }
 
     bool bounding_box(double time0, double time1, aabb& output_box) const override {
@@ -50,8 +48,7 @@ public:
     }
 
     double pdf_value(const point3& origin, const point3& direction) const override {
-        hit_record rec;
-        if (!hit(ray{origin, direction}, 0.001, infinity, rec)) {
+        if (!occluded(ray{origin, direction}, 0.001, infinity)) {
             return 0;
         }
 
@@ -68,11 +65,53 @@ public:
         return uvw.local(random_to_sphere(radius, distance2));
     }
 
+    bool sample_surface(point3& p, vec3& normal, double& area) const override {
+        normal = random_unit_vector();
+        p = center + radius * normal;
+        area = 4 * pi * radius * radius;
+        return true;
+    }
+
+    bool emission(emission_bounds& bounds) const override {
+        bounds.power = material->emitted_power(4 * pi * radius * radius);
+        if (bounds.power <= 0) {
+            return false;
+        }
+        bounding_box(0, 0, bounds.box);
+        bounds.axis = vec3{0, 1, 0};
+        bounds.cos_theta_o = -1; // normals in every direction
+        bounds.cos_theta_e = 0;
+        return true;
+    }
+
     point3 center;
     double radius;
     std::shared_ptr<material> material;
 
 private:
+    // Sets root to the nearest t between t_min and t_max where r crosses the sphere
+    bool intersect(const ray& r, double t_min, double t_max, double& root) const {
+        const vec3 oc = r.origin() - center;
+        const auto a = dot(r.direction(), r.direction());
+        const auto b = 2.0 * dot(oc, r.direction());
+        const auto c = dot(oc, oc) - radius*radius;
+        const auto discriminant = b * b - 4 * a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+        auto sqrtd = sqrt(discriminant);
+
+        // Find the nearest root that lies in the acceptable range.
+        root = (-b - sqrtd) / a / 2;
+        if (root < t_min || root > t_max) {
+            root = (- b + sqrtd) / a / 2;
+            if (root < t_min || root > t_max) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     // p must be of length 1
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         auto theta = std::acos(-p.y());
@@ -6,6 +6,17 @@ class texture {
 public:
     virtual color value(double u, double v, const point3& p) const = 0;
 
+    // footprint is the width, in uv units, of the area on the surface the lookup stands
+    // for. Textures that can filter use it to avoid aliasing, the others ignore it.
+    virtual color filtered_value(double u, double v, const point3& p, double footprint) const {
+        return value(u, v, p);
+    }
+
+    // Textures that only depend on p return false, so hits don't need to compute uv
+    virtual bool uses_uv() const {
+        return true;
+    }
+
     virtual ~texture() {}
 };
 
@@ -20,6 +31,10 @@ public:
         return _color;
     }
 
+    bool uses_uv() const override {
+        return false;
+    }
+
 private:
     color _color;
 };
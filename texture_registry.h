@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./thread_pool.h"
+#include "./tile_cache.h"
+#include "./tiled_image.h"
+#include "./timeline.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "./stb/stb_image.h"
+
+// Loads every image file at most once. Images are shared between all textures that use the
+// same path, or a different path with the same contents. Decoded images are written to a
+// cache directory, keyed by a hash of the file contents, and later runs map those files
+// instead of decoding again. Large images aren't mapped but paged in a tile at a time.
+class texture_registry {
+public:
+    // Leave empty to disable the disk cache. Without it, images can't be paged and are held
+    // in memory completely.
+    std::string cache_directory = "texture_cache";
+    // Images whose tiles take more than this many bytes are read on demand through tiles
+    // instead of being mapped whole
+    size_t page_above = 64 << 20;
+    // Shared by all paged images, which therefore never take more memory than its capacity
+    std::shared_ptr<tile_cache> tiles = std::make_shared<tile_cache>(256 << 20);
+
+    static texture_registry& global() {
+        static texture_registry registry;
+        return registry;
+    }
+
+    // Returns nullptr (after printing an error) when the image can't be loaded. Concurrent
+    // calls for the same image wait for the first one instead of loading it again.
+    std::shared_ptr<const tiled_image> load(const std::string& path) {
+        return once(by_path, path, [&] { return load_file(path); });
+    }
+
+    // Loads the images on thread_count threads, so the textures created afterwards find them
+    // ready
+    void preload(
+        const std::vector<std::string>& paths,
+        int thread_count = std::max(1u, std::thread::hardware_concurrency())
+    ) {
+        pool<std::string>{
+            paths,
+            [this](std::string path) { load(path); },
+            [](int) {}
+        }.run(std::min(thread_count, static_cast<int>(paths.size())));
+    }
+
+private:
+    using image_ptr = std::shared_ptr<const tiled_image>;
+
+    std::mutex mutex;
+    std::map<std::string, std::shared_future<image_ptr>> by_path;
+    std::map<uint64_t, std::shared_future<image_ptr>> by_hash;
+
+    // Returns the value for key in cache, computing it when this is the first request
+    template<typename Key, typename F>
+    image_ptr once(std::map<Key, std::shared_future<image_ptr>>& cache, const Key& key, F compute) {
+        std::promise<image_ptr> promise;
+        std::shared_future<image_ptr> result;
+        bool first = false;
+        {
+            std::scoped_lock lock(mutex);
+            auto found = cache.find(key);
+            if (found != cache.end()) {
+                result = found->second;
+            } else {
+                result = promise.get_future().share();
+                cache.emplace(key, result);
+                first = true;
+            }
+        }
+        if (first) {
+            promise.set_value(compute());
+        }
+        return result.get();
+    }
+
+    image_ptr load_file(const std::string& path) {
+        timeline_span span{"load texture", "file", path};
+        std::ifstream in{path, std::ios::binary};
+        std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(in), {}};
+        if (bytes.empty()) {
+            std::cerr << "ERROR: Could not load texture image file '" << path << "'.\n";
+            return nullptr;
+        }
+
+        const auto hash = fnv1a(bytes);
+        return once(by_hash, hash, [&] { return load_contents(path, hash, bytes); });
+    }
+
+    image_ptr load_contents(
+        const std::string& path, uint64_t hash, const std::vector<unsigned char>& bytes
+    ) {
+        std::string cache_file;
+        if (!cache_directory.empty()) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.tiles", static_cast<unsigned long long>(hash));
+            cache_file = cache_directory + "/" + name;
+            auto image = open_cached(cache_file);
+            if (!image.empty()) {
+                return std::make_shared<const tiled_image>(std::move(image));
+            }
+        }
+
+        int width;
+        int height;
+        int components;
+        unsigned char* pixels;
+        {
+            timeline_span span{"decode texture", "file", path};
+            pixels = stbi_load_from_memory(
+                bytes.data(), static_cast<int>(bytes.size()), &width, &height, &components, 3);
+        }
+        if (pixels == nullptr) {
+            std::cerr << "ERROR: Could not load texture image file '" << path << "'.\n";
+            return nullptr;
+        }
+
+        if (!cache_file.empty()) {
+            std::error_code error;
+            std::filesystem::create_directories(cache_directory, error);
+            if (tiled_image::write(cache_file.c_str(), pixels, width, height, 3)) {
+                stbi_image_free(pixels);
+                auto image = open_cached(cache_file);
+                if (!image.empty()) {
+                    return std::make_shared<const tiled_image>(std::move(image));
+                }
+                std::cerr << "ERROR: Could not load texture image file '" << path << "'.\n";
+                return nullptr;
+            }
+        }
+
+        auto image = std::make_shared<const tiled_image>(pixels, width, height, 3);
+        stbi_image_free(pixels);
+        return image;
+    }
+
+    // Maps small images whole and pages large ones through the tile cache
+    tiled_image open_cached(const std::string& cache_file) {
+        std::error_code error;
+        const auto size = std::filesystem::file_size(cache_file, error);
+        if (error) {
+            return tiled_image{};
+        }
+        return size > page_above
+            ? tiled_image::open_paged(cache_file.c_str(), tiles)
+            : tiled_image::map(cache_file.c_str());
+    }
+
+    static uint64_t fnv1a(const std::vector<unsigned char>& bytes) {
+        uint64_t hash = 14695981039346656037ull;
+        for (auto b : bytes) {
+            hash = (hash ^ b) * 1099511628211ull;
+        }
+        return hash;
+    }
+};
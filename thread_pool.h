@@ -1,18 +1,88 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <optional>
 #include <functional>
 
+#include "./timeline.h"
+
+// Threads that stay around and run tasks, in the order they were submitted. Several pools
+// can run on the same threads at once, like the renders of a daemon, which then share the
+// processor instead of each starting threads of its own.
+class worker_threads {
+public:
+    explicit worker_threads(int count) {
+        for (int i = 0; i < count; i++) {
+            threads.emplace_back(&worker_threads::work, this);
+        }
+    }
+
+    // Runs the tasks still queued first
+    ~worker_threads() {
+        {
+            std::scoped_lock lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    worker_threads(const worker_threads&) = delete;
+    worker_threads& operator=(const worker_threads&) = delete;
+
+    int size() const {
+        return static_cast<int>(threads.size());
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::scoped_lock lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
 template<typename T>
 class pool {
 public:
     // _worker will be called on some thread for each item in _work. 
-    // _reporter is called with the items remaining after every change.
-    pool(std::vector<T> _work, std::function<void(T)> _worker, std::function<void(int)> _reporter)
-      : work(_work), worker(_worker), reporter(_reporter) {}
+    // _reporter, if any, is called with the items remaining after every change. It runs while
+    // the other threads wait for their next item, so it should be quick.
+    pool(
+        std::vector<T> _work, std::function<void(T)> _worker,
+        std::function<void(int)> _reporter = nullptr
+    ) : work(_work), worker(_worker), reporter(_reporter) {}
 
     void run(int thread_count) {
         std::vector<std::thread> threads;
@@ -24,14 +94,50 @@ public:
         }
     }
 
+    // Like run(), on at most thread_count of workers' threads instead of threads of its own.
+    // Must not be called from one of those threads, which could all end up waiting.
+    void run(worker_threads& workers, int thread_count) {
+        const auto count = std::max(1, std::min(thread_count, workers.size()));
+        std::mutex done_mutex;
+        std::condition_variable done;
+        auto running = count;
+        for (int i = 0; i < count; i++) {
+            workers.submit([&] {
+                _run();
+                std::scoped_lock lock(done_mutex);
+                if (--running == 0) {
+                    done.notify_one();
+                }
+            });
+        }
+        std::unique_lock lock(done_mutex);
+        done.wait(lock, [&] { return running == 0; });
+    }
+
+    // Runs on workers, or on threads of its own when there are none
+    void run(worker_threads* workers, int thread_count) {
+        if (workers != nullptr) {
+            run(*workers, thread_count);
+        } else {
+            run(thread_count);
+        }
+    }
+
     std::optional<T> request_item() {
-        std::scoped_lock lock(request_mutex);
+        std::unique_lock lock(request_mutex, std::defer_lock);
+        {
+            timeline_span span{"wait for work"};
+            lock.lock();
+        }
         if (work.empty()) {
             return {};
         } else {
             auto value = work.back();
             work.pop_back();
-            reporter(work.size());
+            if (reporter) {
+                timeline_span span{"report progress"};
+                reporter(work.size());
+            }
             return {value};
         }
     }
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A fixed-size cache of pages of texture tiles, shared by all paged images. The pages are
+// spread over shards by key, each with its own lock and LRU list, so threads looking up
+// different pages rarely wait for each other. A page that is evicted stays alive for as long
+// as a lookup still holds it.
+class tile_cache {
+public:
+    static const size_t page_bytes = 16384;
+
+    using page = std::shared_ptr<const unsigned char>;
+
+    tile_cache(size_t capacity_bytes, int shard_count = 16)
+      : shards(shard_count),
+        pages_per_shard(std::max<size_t>(1, capacity_bytes / page_bytes / shard_count))
+    {}
+
+    // Returns the page for key. On a miss, load(buffer) fills a new page of page_bytes; it
+    // runs without holding any lock.
+    template<typename F>
+    page get(uint64_t key, F load) {
+        auto& s = shards[hash(key) % shards.size()];
+        {
+            std::scoped_lock lock(s.mutex);
+            auto found = s.index.find(key);
+            if (found != s.index.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, found->second);
+                hit_count.fetch_add(1, std::memory_order_relaxed);
+                return found->second->second;
+            }
+        }
+
+        miss_count.fetch_add(1, std::memory_order_relaxed);
+        auto buffer = new unsigned char[page_bytes];
+        load(buffer);
+        page loaded{buffer, std::default_delete<unsigned char[]>()};
+
+        std::scoped_lock lock(s.mutex);
+        auto found = s.index.find(key);
+        if (found != s.index.end()) {
+            // Another thread loaded it in the meantime
+            return found->second->second;
+        }
+        s.lru.emplace_front(key, loaded);
+        s.index.emplace(key, s.lru.begin());
+        if (s.lru.size() > pages_per_shard) {
+            s.index.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+        return loaded;
+    }
+
+    // Keys of different paged images must not collide; every image takes a new prefix
+    uint64_t new_prefix() {
+        return next_prefix.fetch_add(1) << 40;
+    }
+
+    size_t capacity_bytes() const {
+        return pages_per_shard * shards.size() * page_bytes;
+    }
+
+    size_t resident_bytes() {
+        size_t pages = 0;
+        for (auto& s : shards) {
+            std::scoped_lock lock(s.mutex);
+            pages += s.lru.size();
+        }
+        return pages * page_bytes;
+    }
+
+    size_t hits() const {
+        return hit_count.load();
+    }
+
+    size_t misses() const {
+        return miss_count.load();
+    }
+
+private:
+    struct shard {
+        std::mutex mutex;
+        std::list<std::pair<uint64_t, page>> lru; // most recently used first
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, page>>::iterator> index;
+    };
+
+    std::vector<shard> shards;
+    size_t pages_per_shard;
+    std::atomic<uint64_t> next_prefix{1};
+    std::atomic<size_t> hit_count{0};
+    std::atomic<size_t> miss_count{0};
+
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key;
+    }
+};
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./tile_cache.h"
+#include "./vec3.h"
+
+// An 8-bit sRGB image together with its mip pyramid. Texels are stored in tiles of
+// tile_size x tile_size, in Morton order inside a tile and with the tiles of a level in
+// row-major order, so a filtered lookup touches one or two tiles of 256 bytes instead of
+// rows that are a whole scan line apart.
+//
+// The tiles are either in memory (possibly a mapped file) or paged in from a file on demand
+// through a tile_cache, which keeps memory use bounded however large the image is.
+class tiled_image {
+public:
+    static const int tile_shift = 3;
+    static const int tile_size = 1 << tile_shift;
+    // RGBA, the alpha byte is unused and only keeps texels aligned
+    static const int bytes_per_texel = 4;
+    static const int tile_bytes = tile_size * tile_size * bytes_per_texel;
+
+    struct level {
+        int width;
+        int height;
+        int tiles_x;
+        int tiles_y;
+        size_t first_tile;
+    };
+
+    tiled_image() {}
+
+    // pixels is a row-major image with the top row first and components (3 or 4) bytes per
+    // pixel
+    tiled_image(const unsigned char* pixels, int width, int height, int components)
+      : levels(mip_chain(width, height))
+    {
+        auto buffer = new unsigned char[tile_count() * tile_bytes]();
+        data = std::shared_ptr<const unsigned char>{buffer, std::default_delete<unsigned char[]>()};
+        build(levels, pixels, components, buffer);
+    }
+
+    // An image of the given size whose tiles (for all levels, as laid out by write()) are
+    // already in memory
+    tiled_image(int width, int height, std::shared_ptr<const unsigned char> tiles)
+      : levels(mip_chain(width, height)), data(tiles) {}
+
+    // Creates the tiles and mip levels of an image directly in a file, so the file's pages
+    // can be written back instead of taking up memory. File layout: "TIL1", int32 width,
+    // int32 height, zero padding up to header_bytes, and then the tiles of all levels. The
+    // file is written under a temporary name of its own first, so readers never see a partial
+    // file and processes writing the same file at once don't write into each other's.
+    static bool write(
+        const char* filename, const unsigned char* pixels, int width, int height, int components
+    ) {
+        const auto chain = mip_chain(width, height);
+        const auto size = header_bytes + chain_tile_count(chain) * tile_bytes;
+        auto temporary = std::string{filename} + ".XXXXXX";
+
+        const auto fd = mkstemp(temporary.data());
+        // mkstemp() makes it readable by its owner only
+        auto address = fd >= 0 && fchmod(fd, 0644) == 0 && ftruncate(fd, size) == 0
+            ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+            : MAP_FAILED;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (address == MAP_FAILED) {
+            std::cerr << "ERROR: Could not write tiled image file '" << filename << "'.\n";
+            if (fd >= 0) {
+                std::remove(temporary.c_str());
+            }
+            return false;
+        }
+
+        auto bytes = static_cast<unsigned char*>(address);
+        const int32_t header[2] = {width, height};
+        std::memcpy(bytes, file_magic, 4);
+        std::memcpy(bytes + 4, header, sizeof(header));
+        build(chain, pixels, components, bytes + header_bytes);
+        munmap(address, size);
+
+        if (std::rename(temporary.c_str(), filename) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Maps a file written by write() into memory, so only the parts that are used are read.
+    // Returns an empty image when the file can't be opened, and prints an error as well when
+    // it isn't a valid image file.
+    static tiled_image map(const char* filename) {
+        int32_t header[2];
+        size_t size;
+        const auto fd = open_file(filename, header, size);
+        if (fd < 0) {
+            return tiled_image{};
+        }
+        auto address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            std::cerr << "ERROR: Could not map tiled image file '" << filename << "'.\n";
+            return tiled_image{};
+        }
+
+        std::shared_ptr<const unsigned char> mapping{
+            static_cast<const unsigned char*>(address),
+            [size](const unsigned char* p) { munmap(const_cast<unsigned char*>(p), size); }
+        };
+        // The tiles share ownership of the whole mapping
+        return tiled_image{
+            header[0], header[1],
+            std::shared_ptr<const unsigned char>{mapping, mapping.get() + header_bytes}
+        };
+    }
+
+    // Opens a file written by write() for reading its tiles on demand through cache. Fails
+    // like map().
+    static tiled_image open_paged(const char* filename, std::shared_ptr<tile_cache> cache) {
+        int32_t header[2];
+        size_t size;
+        const auto fd = open_file(filename, header, size);
+        if (fd < 0) {
+            return tiled_image{};
+        }
+        tiled_image image;
+        image.levels = mip_chain(header[0], header[1]);
+        image.pages = std::make_shared<paged_file>(fd, cache);
+        return image;
+    }
+
+    bool empty() const {
+        return levels.empty();
+    }
+
+    int width() const {
+        return empty() ? 0 : levels[0].width;
+    }
+
+    int height() const {
+        return empty() ? 0 : levels[0].height;
+    }
+
+    int level_count() const {
+        return static_cast<int>(levels.size());
+    }
+
+    // Bilinearly filtered, linear color at (s, t) in [0, 1], with (0, 0) the top-left corner
+    // of the image
+    color bilinear(int l, double s, double t) const {
+        const auto& mip = levels[l];
+        const auto x = s * mip.width - 0.5;
+        const auto y = t * mip.height - 0.5;
+        const auto x_floor = std::floor(x);
+        const auto y_floor = std::floor(y);
+        const auto fx = static_cast<float>(x - x_floor);
+        const auto fy = static_cast<float>(y - y_floor);
+        const int x0 = std::clamp(static_cast<int>(x_floor), 0, mip.width - 1);
+        const int x1 = std::clamp(static_cast<int>(x_floor) + 1, 0, mip.width - 1);
+        const int y0 = std::clamp(static_cast<int>(y_floor), 0, mip.height - 1);
+        const int y1 = std::clamp(static_cast<int>(y_floor) + 1, 0, mip.height - 1);
+
+        const size_t offsets[4] = {
+            texel_offset(mip, x0, y0),
+            texel_offset(mip, x1, y0),
+            texel_offset(mip, x0, y1),
+            texel_offset(mip, x1, y1),
+        };
+        unsigned char texels[4][bytes_per_texel];
+        read_texels(offsets, texels);
+
+        const auto& lut = srgb_table();
+        float result[3];
+        for (int c = 0; c < 3; c++) {
+            const auto top = lut[texels[0][c]] + fx * (lut[texels[1][c]] - lut[texels[0][c]]);
+            const auto bottom = lut[texels[2][c]] + fx * (lut[texels[3][c]] - lut[texels[2][c]]);
+            result[c] = top + fy * (bottom - top);
+        }
+        return color{result[0], result[1], result[2]};
+    }
+
+    // Filtered color at (s, t) for a lookup that covers footprint (in the same units as s
+    // and t) of the image. The mip level is chosen so a texel is about as wide as the
+    // footprint, and the two nearest levels are blended.
+    color trilinear(double s, double t, double footprint) const {
+        const auto texels = footprint * std::max(levels[0].width, levels[0].height);
+        if (!(texels > 1)) {
+            return bilinear(0, s, t);
+        }
+        const auto lod = std::log2(texels);
+        const auto last = level_count() - 1;
+        if (lod >= last) {
+            return bilinear(last, s, t);
+        }
+        const auto l = static_cast<int>(lod);
+        const auto f = lod - l;
+        return (1 - f) * bilinear(l, s, t) + f * bilinear(l + 1, s, t);
+    }
+
+    // Bytes taken by the tiles of all levels of an image of the given size
+    static size_t tile_data_size(int width, int height) {
+        return chain_tile_count(mip_chain(width, height)) * tile_bytes;
+    }
+
+    static float srgb_to_linear(unsigned char c) {
+        return srgb_table()[c];
+    }
+
+    static unsigned char linear_to_srgb(float c) {
+        c = std::clamp(c, 0.0f, 1.0f);
+        auto s = c <= 0.0031308f ? 12.92f * c : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+        return static_cast<unsigned char>(std::lround(255 * s));
+    }
+
+private:
+    static constexpr const char* file_magic = "TIL1";
+    // Keeps the tiles in a mapped file aligned like they are in memory
+    static const size_t header_bytes = tile_bytes;
+
+    // The tiles of an image in a file, read a page at a time through a tile_cache
+    struct paged_file {
+        paged_file(int fd, std::shared_ptr<tile_cache> cache)
+          : fd(fd), cache(cache), prefix(cache->new_prefix()) {}
+
+        ~paged_file() {
+            close(fd);
+        }
+
+        tile_cache::page get(size_t index) const {
+            return cache->get(prefix | index, [&](unsigned char* buffer) {
+                const auto offset = header_bytes + index * tile_cache::page_bytes;
+                const auto read = std::max<ssize_t>(
+                    0, pread(fd, buffer, tile_cache::page_bytes, offset));
+                // The last page of the file is partial
+                std::memset(buffer + read, 0, tile_cache::page_bytes - read);
+            });
+        }
+
+        int fd;
+        std::shared_ptr<tile_cache> cache;
+        uint64_t prefix;
+    };
+
+    std::vector<level> levels;
+    // Exactly one of these is set for a non-empty image
+    std::shared_ptr<const unsigned char> data;
+    std::shared_ptr<paged_file> pages;
+
+    static std::vector<level> mip_chain(int width, int height) {
+        std::vector<level> chain;
+        size_t first_tile = 0;
+        while (true) {
+            level l{
+                width,
+                height,
+                (width + tile_size - 1) / tile_size,
+                (height + tile_size - 1) / tile_size,
+                first_tile,
+            };
+            chain.push_back(l);
+            first_tile += static_cast<size_t>(l.tiles_x) * l.tiles_y;
+            if (width == 1 && height == 1) {
+                return chain;
+            }
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+    }
+
+    static size_t chain_tile_count(const std::vector<level>& chain) {
+        const auto& last = chain.back();
+        return last.first_tile + static_cast<size_t>(last.tiles_x) * last.tiles_y;
+    }
+
+    size_t tile_count() const {
+        return chain_tile_count(levels);
+    }
+
+    // Fills tiles with level 0 copied from pixels and every other level box filtered, in
+    // linear space, from the one before it. Working from the tiles means no memory is needed
+    // besides the tiles themselves.
+    static void build(
+        const std::vector<level>& chain, const unsigned char* pixels, int components,
+        unsigned char* tiles
+    ) {
+        const auto& base = chain[0];
+        for (int y = 0; y < base.height; y++) {
+            for (int x = 0; x < base.width; x++) {
+                auto pixel = pixels + (static_cast<size_t>(y) * base.width + x) * components;
+                auto texel = tiles + texel_offset(base, x, y);
+                texel[0] = pixel[0];
+                texel[1] = pixel[1];
+                texel[2] = pixel[2];
+                texel[3] = 255;
+            }
+        }
+
+        const auto& lut = srgb_table();
+        for (size_t l = 1; l < chain.size(); l++) {
+            const auto& source = chain[l - 1];
+            const auto& target = chain[l];
+            for (int y = 0; y < target.height; y++) {
+                for (int x = 0; x < target.width; x++) {
+                    const int x0 = std::min(2 * x, source.width - 1);
+                    const int x1 = std::min(2 * x + 1, source.width - 1);
+                    const int y0 = std::min(2 * y, source.height - 1);
+                    const int y1 = std::min(2 * y + 1, source.height - 1);
+                    const unsigned char* quad[4] = {
+                        tiles + texel_offset(source, x0, y0),
+                        tiles + texel_offset(source, x1, y0),
+                        tiles + texel_offset(source, x0, y1),
+                        tiles + texel_offset(source, x1, y1),
+                    };
+                    auto texel = tiles + texel_offset(target, x, y);
+                    for (int c = 0; c < 3; c++) {
+                        const auto sum = lut[quad[0][c]] + lut[quad[1][c]]
+                                       + lut[quad[2][c]] + lut[quad[3][c]];
+                        texel[c] = linear_to_srgb(0.25f * sum);
+                    }
+                    texel[3] = 255;
+                }
+            }
+        }
+    }
+
+    // Opens a file written by write() and checks its header. Returns the file descriptor,
+    // or -1.
+    static int open_file(const char* filename, int32_t header[2], size_t& size) {
+        const auto fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat info;
+        char magic[4];
+        size = fstat(fd, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+        if (size < header_bytes
+            || pread(fd, magic, 4, 0) != 4
+            || pread(fd, header, 2 * sizeof(int32_t), 4) != 2 * sizeof(int32_t)
+            || std::memcmp(magic, file_magic, 4) != 0
+            || header[0] <= 0 || header[1] <= 0
+            || size != header_bytes + tile_data_size(header[0], header[1])
+        ) {
+            std::cerr << "ERROR: Corrupt tiled image file '" << filename << "'.\n";
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static size_t texel_offset(const level& l, int x, int y) {
+        // Spreads the three bits of a coordinate inside a tile to every other bit
+        static const uint8_t spread[tile_size] = {0, 1, 4, 5, 16, 17, 20, 21};
+        const auto tile = l.first_tile
+            + static_cast<size_t>(y >> tile_shift) * l.tiles_x + (x >> tile_shift);
+        const auto morton = spread[x & (tile_size - 1)] | (spread[y & (tile_size - 1)] << 1);
+        return tile * tile_bytes + morton * bytes_per_texel;
+    }
+
+    void read_texels(const size_t offsets[4], unsigned char texels[4][bytes_per_texel]) const {
+        if (data) {
+            for (int i = 0; i < 4; i++) {
+                std::memcpy(texels[i], data.get() + offsets[i], bytes_per_texel);
+            }
+            return;
+        }
+
+        // Neighbouring texels are usually on the same page, which then is looked up once
+        tile_cache::page page;
+        size_t page_index = SIZE_MAX;
+        for (int i = 0; i < 4; i++) {
+            const auto index = offsets[i] / tile_cache::page_bytes;
+            if (index != page_index) {
+                page = pages->get(index);
+                page_index = index;
+            }
+            std::memcpy(texels[i], page.get() + offsets[i] % tile_cache::page_bytes, bytes_per_texel);
+        }
+    }
+
+    static const std::array<float, 256>& srgb_table() {
+        static const auto table = [] {
+            std::array<float, 256> t;
+            for (int i = 0; i < 256; i++) {
+                auto c = i / 255.0;
+                t[i] = static_cast<float>(
+                    c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+            }
+            return t;
+        }();
+        return table;
+    }
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records what each thread did when, and writes it as a Chrome trace (trace event format),
+// which chrome://tracing, Perfetto and speedscope show as a timeline with a row per thread.
+// While not recording, a span only checks a flag.
+class timeline {
+public:
+    static timeline& global() {
+        static timeline instance;
+        return instance;
+    }
+
+    bool recording() const {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    // Forgets what was recorded before
+    void start() {
+        std::scoped_lock lock(mutex);
+        threads.clear();
+        generation.fetch_add(1, std::memory_order_relaxed);
+        origin = std::chrono::steady_clock::now();
+        active.store(true, std::memory_order_relaxed);
+    }
+
+    void stop() {
+        active.store(false, std::memory_order_relaxed);
+    }
+
+    // Writes what was recorded since start(). Call it while no spans are open on other
+    // threads, such as after a pool has finished.
+    bool write(const std::string& filename) {
+        std::ofstream out{filename};
+        if (!out) {
+            std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+            return false;
+        }
+        std::scoped_lock lock(mutex);
+        // Microseconds, to the nanosecond
+        out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [\n";
+        auto first = true;
+        for (size_t tid = 0; tid < threads.size(); tid++) {
+            const auto& thread = *threads[tid];
+            out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", "
+                << "\"pid\": 1, \"tid\": " << tid << ", \"args\": {\"name\": \"thread "
+                << tid << "\"}}";
+            first = false;
+            for (const auto& e : thread.events) {
+                out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                    << tid << ", \"ts\": " << e.start / 1e3 << ", \"dur\": " << e.duration / 1e3;
+                if (e.arg_name != nullptr) {
+                    out << ", \"args\": {\"" << e.arg_name << "\": ";
+                    if (e.text.empty()) {
+                        out << e.number;
+                    } else {
+                        out << '"' << escaped(e.text) << '"';
+                    }
+                    out << "}";
+                }
+                out << "}";
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    friend class timeline_span;
+
+    struct event {
+        const char* name;
+        long long start;
+        long long duration;
+        const char* arg_name;
+        long long number;
+        std::string text;
+    };
+
+    struct thread_events {
+        std::vector<event> events;
+    };
+
+    std::atomic<bool> active{false};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<thread_events>> threads;
+    // Tells threads that their events from before the last start() are gone
+    std::atomic<int> generation{0};
+    std::chrono::steady_clock::time_point origin;
+
+    // Nanoseconds since start()
+    long long now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // The calling thread's events, which only it adds to
+    thread_events& local() {
+        static thread_local thread_events* events = nullptr;
+        static thread_local int events_generation = -1;
+        const auto current = generation.load(std::memory_order_relaxed);
+        if (events_generation != current) {
+            std::scoped_lock lock(mutex);
+            threads.push_back(std::make_unique<thread_events>());
+            events = threads.back().get();
+            events_generation = current;
+        }
+        return *events;
+    }
+
+    static std::string escaped(const std::string& text) {
+        std::string result;
+        for (auto c : text) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+            }
+            result += c;
+        }
+        return result;
+    }
+};
+
+// Records the time from its construction to its destruction as name on the calling thread's
+// row of the timeline, with an optional argument shown along with it. name and arg_name must
+// outlive the recording, like string literals.
+class timeline_span {
+public:
+    explicit timeline_span(const char* name) : timeline_span(name, nullptr, 0LL) {}
+
+    timeline_span(const char* name, const char* arg_name, long long number) {
+        if (timeline::global().recording()) {
+            begin(name, arg_name, number);
+        }
+    }
+
+    timeline_span(const char* name, const char* arg_name, const std::string& text) {
+        if (timeline::global().recording()) {
+            begin(name, arg_name, 0);
+            e.text = text;
+        }
+    }
+
+    ~timeline_span() {
+        if (events != nullptr) {
+            e.duration = timeline::global().now() - e.start;
+            events->events.push_back(std::move(e));
+        }
+    }
+
+    timeline_span(const timeline_span&) = delete;
+    timeline_span& operator=(const timeline_span&) = delete;
+
+private:
+    timeline::thread_events* events = nullptr;
+    timeline::event e;
+
+    void begin(const char* name, const char* arg_name, long long number) {
+        auto& t = timeline::global();
+        events = &t.local();
+        e = timeline::event{name, t.now(), 0, arg_name, number, {}};
+    }
+};
@@ -12,11 +12,18 @@ public:
         if (!child->hit(moved_r, t_min, t_max, rec)) {
             return false;
         } else {
+            // Completed right away, as only here the record can be moved back
+            rec.object->complete(moved_r, rec);
             rec.p += offset;
+            rec.object = this;
             return true;
         }
     }
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        return child->occluded(ray{r.origin() - offset, r.direction()}, t_min, t_max);
+    }
+
     bool bounding_box(double time0, double time1, aabb& output_box) const override {
         aabb temp_box;
 
@@ -31,6 +38,30 @@ public:
         }
     }
 
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        return child->pdf_value(origin - offset, direction);
+    }
+
+    vec3 random(const point3& origin) const override {
+        return child->random(origin - offset);
+    }
+
+    bool sample_surface(point3& p, vec3& normal, double& area) const override {
+        if (!child->sample_surface(p, normal, area)) {
+            return false;
+        }
+        p += offset;
+        return true;
+    }
+
+    bool emission(emission_bounds& bounds) const override {
+        if (!child->emission(bounds)) {
+            return false;
+        }
+        bounds.box = aabb{bounds.box.min() + offset, bounds.box.max() + offset};
+        return true;
+    }
+
     std::shared_ptr<hittable> child;
     vec3 offset;    
 };
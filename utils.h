@@ -1,5 +1,6 @@
 #pragma once
 
+#include <initializer_list>
 #include <random>
 
 double clamp(double x, double min, double max) {
@@ -15,10 +16,22 @@ double clamp(double x, double min, double max) {
 const double pi = 3.14159265358979;
 const double infinity = std::numeric_limits<double>::infinity();
 
+// This thread's random numbers
+std::mt19937& random_generator() {
+    static thread_local std::mt19937 generator;
+    return generator;
+}
+
 double random_double() {
     static auto distribution = std::uniform_real_distribution<double>(0.0, 1.0);
-    static thread_local std::mt19937 generator;
-    return distribution(generator);
+    return distribution(random_generator());
+}
+
+// Restarts this thread's random numbers from a seed made of values, so that what is computed
+// with them can be repeated exactly, on any thread
+void seed_random(std::initializer_list<unsigned int> values) {
+    std::seed_seq seed(values);
+    random_generator().seed(seed);
 }
 
 // Returns a random real in [min, max)
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./aabb.h"
+#include "./perlin.h"
+#include "./vec3.h"
+
+// Sparse density grid with two levels: the voxels are grouped in bricks of brick_size^3 and
+// only bricks containing some density are stored. The top level is a dense grid with one
+// entry per brick: the index of its data (or -1 when empty) and its majorant, an upper bound
+// of the interpolated density anywhere inside the brick.
+class voxel_grid {
+public:
+    static const int brick_size = 8;
+    static const int voxels_per_brick = brick_size * brick_size * brick_size;
+
+    voxel_grid() : voxel_grid(0, 0, 0, point3{0, 0, 0}, 1) {}
+
+    // A grid of nx * ny * nz voxels of voxel_size, with its minimum corner at origin
+    voxel_grid(int nx, int ny, int nz, point3 origin, double voxel_size)
+      : nx(nx), ny(ny), nz(nz), origin(origin), voxel_size(voxel_size),
+        bricks_x((nx + brick_size - 1) / brick_size),
+        bricks_y((ny + brick_size - 1) / brick_size),
+        bricks_z((nz + brick_size - 1) / brick_size),
+        brick_index(static_cast<size_t>(bricks_x) * bricks_y * bricks_z, -1),
+        majorants(brick_index.size(), 0.0f)
+    {}
+
+    // Loads a grid written by save(). Prints an error and returns an empty grid on failure.
+    static voxel_grid load(const char* filename) {
+        std::ifstream in{filename, std::ios::binary};
+        char magic[4];
+        int32_t size[3];
+        double header[4];
+        uint32_t brick_count;
+
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(size), sizeof(size));
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        in.read(reinterpret_cast<char*>(&brick_count), sizeof(brick_count));
+        if (!in || std::string(magic, 4) != file_magic) {
+            std::cerr << "ERROR: Could not load voxel grid file '" << filename << "'.\n";
+            return voxel_grid{};
+        }
+        // Checked before the grid allocates its top level from them
+        auto valid = header[3] > 0 && std::isfinite(header[3]);
+        size_t bricks = 1;
+        for (int a = 0; a < 3; a++) {
+            valid = valid && std::isfinite(header[a]) && size[a] > 0 && size[a] <= max_voxels;
+            if (valid) {
+                bricks *= (size[a] + brick_size - 1) / brick_size;
+            }
+        }
+        if (!valid || bricks > max_bricks || brick_count > bricks) {
+            std::cerr << "ERROR: Corrupt voxel grid file '" << filename << "'.\n";
+            return voxel_grid{};
+        }
+
+        voxel_grid grid{
+            size[0], size[1], size[2], point3{header[0], header[1], header[2]}, header[3]};
+        for (uint32_t b = 0; b < brick_count; b++) {
+            int32_t brick[3];
+            in.read(reinterpret_cast<char*>(brick), sizeof(brick));
+            if (!in || !grid.contains_brick(brick[0], brick[1], brick[2])
+                || grid.brick_index[grid.brick_offset(brick[0], brick[1], brick[2])] >= 0) {
+                std::cerr << "ERROR: Corrupt voxel grid file '" << filename << "'.\n";
+                return voxel_grid{};
+            }
+            auto data = grid.allocate_brick(brick[0], brick[1], brick[2]);
+            in.read(reinterpret_cast<char*>(data), voxels_per_brick * sizeof(float));
+            // Majorants and tracking need finite, non-negative densities
+            if (std::any_of(data, data + voxels_per_brick, [](float d) {
+                    return !std::isfinite(d) || d < 0;
+                })) {
+                std::cerr << "ERROR: Corrupt voxel grid file '" << filename << "'.\n";
+                return voxel_grid{};
+            }
+        }
+        if (!in) {
+            std::cerr << "ERROR: Corrupt voxel grid file '" << filename << "'.\n";
+            return voxel_grid{};
+        }
+
+        grid.build_majorants();
+        return grid;
+    }
+
+    // File layout: "VXG1", int32 nx, ny, nz, double origin x, y, z, double voxel_size,
+    // uint32 number of bricks, and for every stored brick: int32 brick x, y, z followed by
+    // brick_size^3 float densities, x varying fastest.
+    void save(const char* filename) const {
+        std::ofstream out{filename, std::ios::binary};
+        int32_t size[3] = {nx, ny, nz};
+        double header[4] = {origin.x(), origin.y(), origin.z(), voxel_size};
+        auto brick_count = static_cast<uint32_t>(brick_data.size() / voxels_per_brick);
+
+        out.write(file_magic, 4);
+        out.write(reinterpret_cast<const char*>(size), sizeof(size));
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&brick_count), sizeof(brick_count));
+        for (int bz = 0; bz < bricks_z; bz++) {
+            for (int by = 0; by < bricks_y; by++) {
+                for (int bx = 0; bx < bricks_x; bx++) {
+                    auto index = brick_index[brick_offset(bx, by, bz)];
+                    if (index < 0) {
+                        continue;
+                    }
+                    int32_t brick[3] = {bx, by, bz};
+                    auto data = &brick_data[static_cast<size_t>(index) * voxels_per_brick];
+                    out.write(reinterpret_cast<const char*>(brick), sizeof(brick));
+                    out.write(reinterpret_cast<const char*>(data), voxels_per_brick * sizeof(float));
+                }
+            }
+        }
+
+        if (!out) {
+            std::cerr << "ERROR: Could not write voxel grid file '" << filename << "'.\n";
+        }
+    }
+
+    // Sets every voxel to density(center of the voxel). Bricks that end up without any
+    // density aren't stored.
+    void fill(const std::function<double(const point3&)>& density) {
+        std::vector<float> brick(voxels_per_brick);
+        for (int bz = 0; bz < bricks_z; bz++) {
+            for (int by = 0; by < bricks_y; by++) {
+                for (int bx = 0; bx < bricks_x; bx++) {
+                    bool any = false;
+                    for (int k = 0; k < brick_size; k++) {
+                        for (int j = 0; j < brick_size; j++) {
+                            for (int i = 0; i < brick_size; i++) {
+                                point3 center = voxel_center(
+                                    bx * brick_size + i, by * brick_size + j, bz * brick_size + k);
+                                auto d = static_cast<float>(std::max(0.0, density(center)));
+                                brick[(k * brick_size + j) * brick_size + i] = d;
+                                any = any || d > 0;
+                            }
+                        }
+                    }
+                    if (any) {
+                        auto data = allocate_brick(bx, by, bz);
+                        std::copy(brick.begin(), brick.end(), data);
+                    }
+                }
+            }
+        }
+        build_majorants();
+    }
+
+    // A cloud of turbulent noise that fades out towards the sides of the grid
+    void fill_from_perlin(const perlin& noise, double scale, double threshold) {
+        const auto center = origin + 0.5 * voxel_size * vec3(nx, ny, nz);
+        const auto half_size = 0.5 * voxel_size * vec3(nx, ny, nz);
+        fill([&](const point3& p) {
+            auto q = p - center;
+            auto r2 = std::pow(q.x() / half_size.x(), 2)
+                    + std::pow(q.y() / half_size.y(), 2)
+                    + std::pow(q.z() / half_size.z(), 2);
+            auto falloff = std::max(0.0, 1 - r2);
+            return falloff * noise.turb(scale * p) - threshold;
+        });
+    }
+
+    aabb bounds() const {
+        return aabb{origin, origin + voxel_size * vec3(nx, ny, nz)};
+    }
+
+    // Trilinearly interpolated density at p, in world space
+    double density(const point3& p) const {
+        auto q = (p - origin) / voxel_size;
+        auto x = q.x() - 0.5;
+        auto y = q.y() - 0.5;
+        auto z = q.z() - 0.5;
+        auto i = static_cast<int>(std::floor(x));
+        auto j = static_cast<int>(std::floor(y));
+        auto k = static_cast<int>(std::floor(z));
+        auto u = x - i;
+        auto v = y - j;
+        auto w = z - k;
+
+        auto accum = 0.0;
+        for (int di = 0; di < 2; di++) {
+            for (int dj = 0; dj < 2; dj++) {
+                for (int dk = 0; dk < 2; dk++) {
+                    accum += (di ? u : 1 - u) * (dj ? v : 1 - v) * (dk ? w : 1 - w)
+                           * voxel(i + di, j + dj, k + dk);
+                }
+            }
+        }
+        return accum;
+    }
+
+    // Density of a single voxel, 0 outside the grid and in empty bricks
+    float voxel(int i, int j, int k) const {
+        if (i < 0 || j < 0 || k < 0 || i >= nx || j >= ny || k >= nz) {
+            return 0;
+        }
+        auto index = brick_index[brick_offset(i / brick_size, j / brick_size, k / brick_size)];
+        if (index < 0) {
+            return 0;
+        }
+        return brick_data[static_cast<size_t>(index) * voxels_per_brick + voxel_offset(i, j, k)];
+    }
+
+    void set_voxel(int i, int j, int k, float density) {
+        auto offset = brick_offset(i / brick_size, j / brick_size, k / brick_size);
+        auto data = brick_index[offset] < 0
+            ? allocate_brick(i / brick_size, j / brick_size, k / brick_size)
+            : &brick_data[static_cast<size_t>(brick_index[offset]) * voxels_per_brick];
+        data[voxel_offset(i, j, k)] = density;
+    }
+
+    // Must be called after changing voxels with set_voxel
+    void build_majorants() {
+        for (int bz = 0; bz < bricks_z; bz++) {
+            for (int by = 0; by < bricks_y; by++) {
+                for (int bx = 0; bx < bricks_x; bx++) {
+                    // Interpolation near the sides of a brick uses voxels of the neighbours
+                    float majorant = 0;
+                    for (int k = bz * brick_size - 1; k <= (bz + 1) * brick_size; k++) {
+                        for (int j = by * brick_size - 1; j <= (by + 1) * brick_size; j++) {
+                            for (int i = bx * brick_size - 1; i <= (bx + 1) * brick_size; i++) {
+                                majorant = std::max(majorant, voxel(i, j, k));
+                            }
+                        }
+                    }
+                    majorants[brick_offset(bx, by, bz)] = majorant;
+                }
+            }
+        }
+    }
+
+    // Calls visit(t0, t1, majorant) for consecutive segments of r between t_min and t_max,
+    // one per brick the ray passes through, in order. Stops when visit returns false.
+    template<typename F>
+    void traverse(const ray& r, double t_min, double t_max, F visit) const {
+        if (!bounds().clip(r, t_min, t_max)) {
+            return;
+        }
+
+        const auto brick_world_size = brick_size * voxel_size;
+        const auto start = (r.at(t_min) - origin) / brick_world_size;
+        const int bricks[3] = {bricks_x, bricks_y, bricks_z};
+
+        int cell[3];
+        int step[3];
+        double t_next[3];
+        double t_delta[3];
+        for (int a = 0; a < 3; a++) {
+            cell[a] = std::clamp(static_cast<int>(std::floor(start[a])), 0, bricks[a] - 1);
+            auto d = r.direction()[a];
+            if (d > 0) {
+                step[a] = 1;
+                t_delta[a] = brick_world_size / d;
+                t_next[a] = t_min + ((cell[a] + 1) - start[a]) * t_delta[a];
+            } else if (d < 0) {
+                step[a] = -1;
+                t_delta[a] = -brick_world_size / d;
+                t_next[a] = t_min + (start[a] - cell[a]) * t_delta[a];
+            } else {
+                step[a] = 0;
+                t_delta[a] = infinity;
+                t_next[a] = infinity;
+            }
+        }
+
+        auto t = t_min;
+        while (t < t_max) {
+            int a = t_next[0] < t_next[1]
+                ? (t_next[0] < t_next[2] ? 0 : 2)
+                : (t_next[1] < t_next[2] ? 1 : 2);
+            auto t_exit = std::min(t_next[a], t_max);
+            if (!visit(t, t_exit, majorants[brick_offset(cell[0], cell[1], cell[2])])) {
+                return;
+            }
+            t = t_exit;
+            cell[a] += step[a];
+            t_next[a] += t_delta[a];
+            if (cell[a] < 0 || cell[a] >= bricks[a]) {
+                return;
+            }
+        }
+    }
+
+    size_t stored_bricks() const {
+        return brick_data.size() / voxels_per_brick;
+    }
+
+private:
+    static constexpr const char* file_magic = "VXG1";
+    // Largest grids load() accepts, voxels along an axis and bricks in all
+    static const int max_voxels = 1 << 16;
+    static constexpr size_t max_bricks = size_t{1} << 24;
+
+    int nx;
+    int ny;
+    int nz;
+    point3 origin;
+    double voxel_size;
+
+    int bricks_x;
+    int bricks_y;
+    int bricks_z;
+    std::vector<int32_t> brick_index;
+    std::vector<float> majorants;
+    std::vector<float> brick_data;
+
+    size_t brick_offset(int bx, int by, int bz) const {
+        return (static_cast<size_t>(bz) * bricks_y + by) * bricks_x + bx;
+    }
+
+    static int voxel_offset(int i, int j, int k) {
+        return ((k % brick_size) * brick_size + j % brick_size) * brick_size + i % brick_size;
+    }
+
+    bool contains_brick(int bx, int by, int bz) const {
+        return bx >= 0 && by >= 0 && bz >= 0 && bx < bricks_x && by < bricks_y && bz < bricks_z;
+    }
+
+    point3 voxel_center(int i, int j, int k) const {
+        return origin + voxel_size * vec3(i + 0.5, j + 0.5, k + 0.5);
+    }
+
+    float* allocate_brick(int bx, int by, int bz) {
+        auto index = static_cast<int32_t>(brick_data.size() / voxels_per_brick);
+        brick_index[brick_offset(bx, by, bz)] = index;
+        brick_data.resize(brick_data.size() + voxels_per_brick, 0.0f);
+        return &brick_data[static_cast<size_t>(index) * voxels_per_brick];
+    }
+};
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "./counters.h"
 #include "./hittable.h"
+#include "./material.h"
 #include "./vec3.h"
 
 class xy_rect : public hittable {
@@ -15,22 +17,25 @@ xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
     ) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), normal(1), material(_material) {}
 
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        auto t = (k - r.origin().z()) / r.direction().z();
-        if (t < t_min || t > t_max) {
-            return false;
-        }
-        auto x = r.at(t).x();
-        auto y = r.at(t).y();
-        if (x < x0 || x > x1 || y < y0 || y > y1) {
+        double t;
+        if (!count_test(intersect(r, t_min, t_max, t))) {
             return false;
         }
         rec.t = t;
+        rec.front_face = r.direction().z() * normal < 0;
+        rec.object = this;
+        return true;
+    }
+
+    void complete(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
         rec.set_face_normal(r, vec3{0, 0, normal});
         rec.material = material;
-        rec.p = r.at(t);
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (y - y0) / (y1 - y0);
-        return true;
+        if (material->uses_uv()) {
+            rec.u = (rec.p.x() - x0) / (x1 - x0);
+            rec.v = (rec.p.y() - y0) / (y1 - y0);
+            rec.uv_per_unit = 1 / std::min(x1 - x0, y1 - y0);
+        }
     }
 
     bool bounding_box(double time0, double time, aabb& output_box) const override {
@@ -39,7 +44,68 @@ xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
         return true;
     }
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        double t;
+        return count_test(intersect(r, t_min, t_max, t));
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        double t;
+        if (!intersect(ray{origin, direction}, 0.001, infinity, t)) {
+            return 0;
+        }
+
+        const auto distance2 = t * t * direction.length_squared();
+        const auto cosine_theta = std::abs(direction.z()) / direction.length();
+        const auto area = (x1 - x0) * (y1 - y0);
+
+        return distance2 / (cosine_theta * area);
+    }
+
+    vec3 random(const point3& origin) const override {
+        const vec3 p{
+            x0 + (x1 - x0) * random_double(),
+            y0 + (y1 - y0) * random_double(),
+            k
+        };
+        return p - origin;
+    }
+
+    bool sample_surface(point3& p, vec3& _normal, double& area) const override {
+        p = point3{
+            x0 + (x1 - x0) * random_double(),
+            y0 + (y1 - y0) * random_double(),
+            k
+        };
+        _normal = vec3{0, 0, normal};
+        area = (x1 - x0) * (y1 - y0);
+        return true;
+    }
+
+    bool emission(emission_bounds& bounds) const override {
+        bounds.power = material->emitted_power((x1 - x0) * (y1 - y0));
+        if (bounds.power <= 0) {
+            return false;
+        }
+        bounding_box(0, 0, bounds.box);
+        bounds.axis = vec3{0, 0, normal};
+        bounds.cos_theta_o = 1;
+        bounds.cos_theta_e = 0;
+        return true;
+    }
+
 private:
+    // Sets t to where r crosses the rectangle, if that is between t_min and t_max
+    bool intersect(const ray& r, double t_min, double t_max, double& t) const {
+        t = (k - r.origin().z()) / r.direction().z();
+        if (t < t_min || t > t_max) {
+            return false;
+        }
+        auto x = r.origin().x() + t * r.direction().x();
+        auto y = r.origin().y() + t * r.direction().y();
+        return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+    }
+
     double x0;
     double x1;
     double y0;
@@ -61,22 +127,25 @@ public:
     ) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), normal(1), material(_material) {}
     
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        auto t = (k - r.origin().y()) / r.direction().y();
-        if (t < t_min || t > t_max) {
-            return false;
-        }
-        auto x = r.at(t).x();
-        auto z = r.at(t).z();
-        if (x < x0 || x > x1 || z < z0 || z > z1) {
+        double t;
+        if (!count_test(intersect(r, t_min, t_max, t))) {
             return false;
         }
         rec.t = t;
+        rec.front_face = r.direction().y() * normal < 0;
+        rec.object = this;
+        return true;
+    }
+
+    void complete(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
         rec.set_face_normal(r, vec3{0, normal, 0});
         rec.material = material;
-        rec.p = r.at(t);
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (z - z0) / (z1 - z0);
-        return true;
+        if (material->uses_uv()) {
+            rec.u = (rec.p.x() - x0) / (x1 - x0);
+            rec.v = (rec.p.z() - z0) / (z1 - z0);
+            rec.uv_per_unit = 1 / std::min(x1 - x0, z1 - z0);
+        }
     }
 
     bool bounding_box(double time0, double time, aabb& output_box) const override {
@@ -85,14 +154,19 @@ public:
         return true;
     }
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        double t;
+        return count_test(intersect(r, t_min, t_max, t));
+    }
+
     double pdf_value(const point3& origin, const vec3& direction) const override {
-        hit_record rec;
-        if (!hit(ray{origin, direction}, 0.001, infinity, rec)) {
+        double t;
+        if (!intersect(ray{origin, direction}, 0.001, infinity, t)) {
             return 0;
         }
 
-        const auto distance2 = rec.t * rec.t * direction.length_squared();
-        const auto cosine_theta = std::abs(dot(direction, rec.normal)) / direction.length();
+        const auto distance2 = t * t * direction.length_squared();
+        const auto cosine_theta = std::abs(direction.y()) / direction.length();
         const auto area = (x1 - x0) * (z1 - z0);
 
         return distance2 / (cosine_theta * area);
@@ -107,7 +181,41 @@ public:
         return p - origin;
     }
 
+    bool sample_surface(point3& p, vec3& _normal, double& area) const override {
+        p = point3{
+            x0 + (x1 - x0) * random_double(),
+            k,
+            z0 + (z1 - z0) * random_double()
+        };
+        _normal = vec3{0, normal, 0};
+        area = (x1 - x0) * (z1 - z0);
+        return true;
+    }
+
+    bool emission(emission_bounds& bounds) const override {
+        bounds.power = material->emitted_power((x1 - x0) * (z1 - z0));
+        if (bounds.power <= 0) {
+            return false;
+        }
+        bounding_box(0, 0, bounds.box);
+        bounds.axis = vec3{0, normal, 0};
+        bounds.cos_theta_o = 1;
+        bounds.cos_theta_e = 0;
+        return true;
+    }
+
 private:
+    // Sets t to where r crosses the rectangle, if that is between t_min and t_max
+    bool intersect(const ray& r, double t_min, double t_max, double& t) const {
+        t = (k - r.origin().y()) / r.direction().y();
+        if (t < t_min || t > t_max) {
+            return false;
+        }
+        auto x = r.origin().x() + t * r.direction().x();
+        auto z = r.origin().z() + t * r.direction().z();
+        return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+    }
+
     double x0;
     double x1;
     double z0;
@@ -130,22 +238,25 @@ public:
     ) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), normal(1), material(_material) {}
     
     bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
-        auto t = (k - r.origin().x()) / r.direction().x();
-        if (t < t_min || t > t_max) {
-            return false;
-        }
-        auto y = r.at(t).y();
-        auto z = r.at(t).z();
-        if (y < y0 || y > y1 || z < z0 || z > z1) {
+        double t;
+        if (!count_test(intersect(r, t_min, t_max, t))) {
             return false;
         }
         rec.t = t;
+        rec.front_face = r.direction().x() * normal < 0;
+        rec.object = this;
+        return true;
+    }
+
+    void complete(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
         rec.set_face_normal(r, vec3{normal, 0, 0});
         rec.material = material;
-        rec.p = r.at(t);
-        rec.u = (y - y0) / (y1 - y0);
-        rec.v = (z - z0) / (z1 - z0);
-        return true;
+        if (material->uses_uv()) {
+            rec.u = (rec.p.y() - y0) / (y1 - y0);
+            rec.v = (rec.p.z() - z0) / (z1 - z0);
+            rec.uv_per_unit = 1 / std::min(y1 - y0, z1 - z0);
+        }
     }
 
     bool bounding_box(double time0, double time, aabb& output_box) const override {
@@ -154,7 +265,68 @@ public:
         return true;
     }
 
+    bool occluded(const ray& r, double t_min, double t_max) const override {
+        double t;
+        return count_test(intersect(r, t_min, t_max, t));
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        double t;
+        if (!intersect(ray{origin, direction}, 0.001, infinity, t)) {
+            return 0;
+        }
+
+        const auto distance2 = t * t * direction.length_squared();
+        const auto cosine_theta = std::abs(direction.x()) / direction.length();
+        const auto area = (y1 - y0) * (z1 - z0);
+
+        return distance2 / (cosine_theta * area);
+    }
+
+    vec3 random(const point3& origin) const override {
+        const vec3 p{
+            k,
+            y0 + (y1 - y0) * random_double(),
+            z0 + (z1 - z0) * random_double()
+        };
+        return p - origin;
+    }
+
+    bool sample_surface(point3& p, vec3& _normal, double& area) const override {
+        p = point3{
+            k,
+            y0 + (y1 - y0) * random_double(),
+            z0 + (z1 - z0) * random_double()
+        };
+        _normal = vec3{normal, 0, 0};
+        area = (y1 - y0) * (z1 - z0);
+        return true;
+    }
+
+    bool emission(emission_bounds& bounds) const override {
+        bounds.power = material->emitted_power((y1 - y0) * (z1 - z0));
+        if (bounds.power <= 0) {
+            return false;
+        }
+        bounding_box(0, 0, bounds.box);
+        bounds.axis = vec3{normal, 0, 0};
+        bounds.cos_theta_o = 1;
+        bounds.cos_theta_e = 0;
+        return true;
+    }
+
 private:
+    // Sets t to where r crosses the rectangle, if that is between t_min and t_max
+    bool intersect(const ray& r, double t_min, double t_max, double& t) const {
+        t = (k - r.origin().x()) / r.direction().x();
+        if (t < t_min || t > t_max) {
+            return false;
+        }
+        auto y = r.origin().y() + t * r.direction().y();
+        auto z = r.origin().z() + t * r.direction().z();
+        return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+    }
+
     double y0;
     double y1;
     double z0;